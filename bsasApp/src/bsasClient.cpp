@@ -0,0 +1,224 @@
+
+#include <sstream>
+
+#include <epicsTime.h>
+
+#define epicsExportSharedSymbols
+#include "bsasClient.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+const std::string empty;
+
+// field, or any enclosing structure, marked changed
+bool isChanged(const pvd::PVField& fld, const pvd::BitSet& changed)
+{
+    for(const pvd::PVField *cur = &fld; cur; cur = cur->getParent()) {
+        if(changed.get(cur->getFieldOffset()))
+            return true;
+    }
+    return false;
+}
+} // namespace
+
+namespace bsas {
+
+Column::Column()
+    :type(pvd::pvDouble)
+    ,isarray(false)
+    ,encoded(false)
+{}
+
+const std::string& Column::string(size_t row) const
+{
+    check(isarray, pvd::pvUInt);
+    pvd::uint32 code = pvd::static_shared_vector_cast<const pvd::uint32>(scalars).at(row);
+    return code < dictionary.size() ? dictionary[code] : empty;
+}
+
+void Column::check(bool wrongshape, pvd::ScalarType T) const
+{
+    if(wrongshape || T!=(encoded ? pvd::pvUInt : type)) {
+        std::ostringstream strm;
+        strm<<"Column "<<label<<" is "<<(isarray ? "array" : "scalar")
+            <<" of "<<pvd::ScalarTypeFunc::name(encoded ? pvd::pvUInt : type)
+            <<" not "<<pvd::ScalarTypeFunc::name(T);
+        throw std::logic_error(strm.str());
+    }
+}
+
+Table::Table()
+    :generation(0u)
+    ,decimation(1u)
+    ,batchId(0u)
+    ,batchPart(0u)
+    ,batchMore(false)
+    ,batchEpoch(0u)
+{}
+
+const Column* Table::find(const std::string& label) const
+{
+    index_t::const_iterator it(index.find(label));
+    return it==index.end() ? 0 : &columns[it->second];
+}
+
+const Column& Table::operator[](const std::string& label) const
+{
+    const Column *col = find(label);
+    if(!col)
+        throw std::out_of_range("No column "+label);
+    return *col;
+}
+
+void Table::clear()
+{
+    type.reset();
+    keys.clear();
+    columns.clear();
+    index.clear();
+    decimation = 1u;
+    batchId = batchPart = 0u;
+    batchMore = false;
+    batchEpoch = 0u;
+}
+
+void Table::update(const pvd::PVStructure& root, const pvd::BitSet& changed)
+{
+    pvd::PVStructurePtr value(root.getSubFieldT<pvd::PVStructure>("value"));
+    pvd::PVStructurePtr dicts(root.getSubField<pvd::PVStructure>("dictionary"));
+
+    if(root.getStructure()!=type) {
+        // new column list
+        pvd::PVStringArray::const_svector labels(root.getSubFieldT<pvd::PVStringArray>("labels")->view());
+        const pvd::PVFieldPtrArray& fields(value->getPVFields());
+
+        columns.clear();
+        index.clear();
+
+        for(size_t i=0, N=fields.size(); i<N; i++) {
+            const std::string& fname = fields[i]->getFieldName();
+            if(fname=="secondsPastEpoch" || fname=="nanoseconds")
+                continue;
+
+            Column col;
+            col.field = fname;
+            col.label = i<labels.size() ? labels[i] : fname;
+
+            if(pvd::PVScalarArray *arr = dynamic_cast<pvd::PVScalarArray*>(fields[i].get())) {
+                col.type = arr->getScalarArray()->getElementType();
+                col.encoded = dicts && dicts->getSubField(fname);
+                if(col.encoded)
+                    col.type = pvd::pvString;
+
+            } else if(pvd::PVUnionArray *arr = dynamic_cast<pvd::PVUnionArray*>(fields[i].get())) {
+                pvd::UnionConstPtr U(arr->getUnionArray()->getUnion());
+                pvd::ScalarArrayConstPtr S(std::tr1::dynamic_pointer_cast<const pvd::ScalarArray>(U->getField("arr")));
+                if(!S)
+                    continue; // not a bsas column
+                col.type = S->getElementType();
+                col.isarray = true;
+
+            } else {
+                continue;
+            }
+
+            index[col.label] = columns.size();
+            columns.push_back(col);
+        }
+
+        type = root.getStructure();
+        generation++;
+    }
+
+    {
+        pvd::PVUIntArray::const_svector sec(value->getSubFieldT<pvd::PVUIntArray>("secondsPastEpoch")->view()),
+                                        nsec(value->getSubFieldT<pvd::PVUIntArray>("nanoseconds")->view());
+        if(sec.size()!=nsec.size())
+            throw std::runtime_error("Table timestamp columns differ in length");
+
+        pvd::shared_vector<epicsUInt64> K(sec.size());
+        for(size_t r=0, R=K.size(); r<R; r++)
+            K[r] = (epicsUInt64(sec[r])<<32u) | nsec[r];
+        keys = pvd::freeze(K);
+    }
+
+    for(size_t c=0, C=columns.size(); c<C; c++) {
+        Column& col = columns[c];
+        pvd::PVFieldPtr fld(value->getSubFieldT(col.field));
+
+        if(col.isarray) {
+            col.cells = static_cast<pvd::PVUnionArray*>(fld.get())->view();
+        } else {
+            static_cast<pvd::PVScalarArray*>(fld.get())->getAs(col.scalars);
+        }
+
+        if(col.encoded) {
+            // the server only sends a dictionary when it grows
+            pvd::PVStringArrayPtr dict(dicts->getSubFieldT<pvd::PVStringArray>(col.field));
+            if(isChanged(*dict, changed))
+                col.dictionary = dict->view();
+        }
+    }
+
+    pvd::PVScalarPtr fdec(root.getSubField<pvd::PVScalar>("decimation"));
+    decimation = fdec ? fdec->getAs<pvd::uint32>() : 1u;
+
+    pvd::PVStructurePtr fbatch(root.getSubField<pvd::PVStructure>("batch"));
+    if(fbatch) {
+        batchId = fbatch->getSubFieldT<pvd::PVScalar>("id")->getAs<pvd::uint32>();
+        batchPart = fbatch->getSubFieldT<pvd::PVScalar>("part")->getAs<pvd::uint32>();
+        batchMore = fbatch->getSubFieldT<pvd::PVScalar>("more")->getAs<pvd::boolean>();
+        pvd::PVScalarPtr fepoch(fbatch->getSubField<pvd::PVScalar>("epoch"));
+        batchEpoch = fepoch ? fepoch->getAs<pvd::uint64>() : 0u;
+    } else {
+        batchId = batchPart = 0u;
+        batchMore = false;
+        batchEpoch = 0u;
+    }
+}
+
+Client::Client(pvac::ClientProvider& provider, const std::string& pvname)
+    :connected(false)
+    ,channel(provider.connect(pvname))
+    ,mon(channel.monitor())
+    ,haveData(false)
+{}
+
+Client::~Client()
+{
+    mon.cancel();
+}
+
+bool Client::next(Table& table, double timeout)
+{
+    while(true) {
+        if(haveData) {
+            if(mon.poll()) {
+                connected = true;
+                table.update(*mon.root, mon.changed);
+                return true;
+            }
+            haveData = false;
+        }
+
+        if(!mon.wait(timeout))
+            return false;
+
+        switch(mon.event.event) {
+        case pvac::MonitorEvent::Fail:
+            throw std::runtime_error(mon.event.message);
+        case pvac::MonitorEvent::Cancel:
+            throw std::runtime_error("Subscription cancelled");
+        case pvac::MonitorEvent::Disconnect:
+            connected = false;
+            table.clear();
+            return true;
+        case pvac::MonitorEvent::Data:
+            haveData = true;
+            break;
+        }
+    }
+}
+
+} // namespace bsas
@@ -0,0 +1,168 @@
+#ifndef BSASCLIENT_H
+#define BSASCLIENT_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdexcept>
+
+#include <epicsTypes.h>
+
+#include <pv/pvData.h>
+#include <pv/sharedVector.h>
+#include <pva/client.h>
+
+#include <shareLib.h>
+
+/* Client side decoding of a bsas *TBL NTTable.
+ *
+ * Columns are exposed as views of the arrays received from the server,
+ * without copying.  The timestamp columns are combined into one key per row.
+ *
+ *   pvac::ClientProvider prov("pva");
+ *   bsas::Client client(prov, "RX:TBL");
+ *   bsas::Table table;
+ *   while(client.next(table, 5.0)) {
+ *       bsas::View<double> X(table["TST:X"].view<double>());
+ *       for(size_t r=0; r<X.size(); r++)
+ *           use(table.keys[r], X[r]);
+ *   }
+ */
+namespace bsas {
+
+// read-only view of contiguous elements.
+// Valid until the Table it came from is next updated.
+template<typename T>
+struct View {
+    typedef T value_type;
+    typedef const T* const_iterator;
+    typedef const T* iterator;
+
+    View() :ptr(0), count(0u) {}
+    View(const T* ptr, size_t count) :ptr(ptr), count(count) {}
+    explicit View(const epics::pvData::shared_vector<const T>& v) :ptr(v.data()), count(v.size()) {}
+
+    const T* data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count==0u; }
+
+    const T& operator[](size_t i) const { return ptr[i]; }
+    const T& at(size_t i) const {
+        if(i>=count)
+            throw std::out_of_range("bsas::View index out of range");
+        return ptr[i];
+    }
+
+    const_iterator begin() const { return ptr; }
+    const_iterator end() const { return ptr+count; }
+
+private:
+    const T* ptr;
+    size_t count;
+};
+
+struct epicsShareClass Column {
+    std::string field, label;
+    // element type
+    epics::pvData::ScalarType type;
+    // array PV.  One cell per row
+    bool isarray;
+    // scalar string column sent as codes into 'dictionary'
+    bool encoded;
+
+    // one element per row, when !isarray
+    epics::pvData::shared_vector<const void> scalars;
+    // one cell per row, when isarray.  NULL or empty for missing values
+    epics::pvData::shared_vector<const epics::pvData::PVUnionPtr> cells;
+    // accumulated dictionary, when encoded.  code 0 is ""
+    epics::pvData::shared_vector<const std::string> dictionary;
+
+    Column();
+
+    // view of scalar column.  throws std::logic_error if T is not the element type
+    template<typename T>
+    View<T> view() const {
+        check(isarray, epics::pvData::ScalarType(epics::pvData::ScalarTypeID<T>::value));
+        return View<T>(epics::pvData::static_shared_vector_cast<const T>(scalars));
+    }
+
+    // view of one array cell.  empty for missing value or type mismatch
+    template<typename T>
+    View<T> cell(size_t row) const {
+        check(!isarray, epics::pvData::ScalarType(epics::pvData::ScalarTypeID<T>::value));
+        const epics::pvData::PVUnionPtr& U = cells.at(row);
+        if(U) {
+            std::tr1::shared_ptr<epics::pvData::PVValueArray<T> > arr(U->get<epics::pvData::PVValueArray<T> >());
+            if(arr)
+                return View<T>(arr->view());
+        }
+        return View<T>();
+    }
+
+    // value of an encoded string column
+    const std::string& string(size_t row) const;
+
+private:
+    void check(bool wrongshape, epics::pvData::ScalarType T) const;
+};
+
+struct epicsShareClass Table {
+    // incremented each time the table type (column list) changes
+    size_t generation;
+    // server sends every 'decimation'th row to slow clients.  1 when not decimated
+    size_t decimation;
+    // large batches of rows are split into several updates with the same batch id.
+    // batchMore is true for all but the last part.
+    epicsUInt32 batchId, batchPart;
+    bool batchMore;
+    // with bsasFlushEpoch set on the server, rows of all tables are batched
+    // by epoch (POSIX time / bsasFlushEpoch).  0 otherwise.
+    epicsUInt64 batchEpoch;
+    // (POSIX seconds<<32) | nanoseconds for each row
+    epics::pvData::shared_vector<const epicsUInt64> keys;
+    std::vector<Column> columns;
+
+    Table();
+
+    size_t rows() const { return keys.size(); }
+
+    // lookup by label (PV name), or NULL
+    const Column* find(const std::string& label) const;
+    // lookup by label (PV name).  throws std::out_of_range
+    const Column& operator[](const std::string& label) const;
+
+    // decode an update.  'changed' as delivered by the monitor.
+    // Dictionaries are retained between updates with the same type.
+    void update(const epics::pvData::PVStructure& root, const epics::pvData::BitSet& changed);
+    void clear();
+
+private:
+    epics::pvData::StructureConstPtr type;
+    typedef std::map<std::string, size_t> index_t;
+    index_t index;
+};
+
+// Subscription to a *TBL PV
+struct epicsShareClass Client {
+    Client(pvac::ClientProvider& provider, const std::string& pvname);
+    ~Client();
+
+    // Wait for the next update, and decode into 'table'.
+    // Returns false on timeout.  On disconnect 'table' is cleared, connected is false, and returns true.
+    // throws std::runtime_error if the subscription fails.
+    bool next(Table& table, double timeout);
+
+    bool connected;
+
+private:
+    pvac::ClientChannel channel;
+    pvac::MonitorSync mon;
+    bool haveData;
+
+    Client(const Client&);
+    Client& operator=(const Client&);
+};
+
+} // namespace bsas
+
+#endif // BSASCLIENT_H
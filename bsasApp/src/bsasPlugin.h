@@ -0,0 +1,54 @@
+#ifndef BSASPLUGIN_H
+#define BSASPLUGIN_H
+
+#include <shareLib.h>
+
+#include "collector.h"
+
+/* In-process Receiver plugins.  Loaded with
+ *
+ *   bsasReceiverLoad("TBL:PREFIX:", "libfoo.so", "args")
+ *
+ * A plugin is a shared library, built against the same bsas headers and EPICS Base,
+ * which defines a factory function
+ *
+ *   Receiver* myFactory(const char *table, const char *args);
+ *
+ * and registers it at file scope with
+ *
+ *   BSAS_RECEIVER_PLUGIN(myFactory)
+ *
+ * 'table' is the prefix given to bsasTableAdd(), and 'args' the string given to bsasReceiverLoad().
+ * A library may be loaded for several tables, with the factory called once for each.
+ * The returned Receiver is owned by bsas, and deleted on exit.  Throw, or return NULL, to fail.
+ *
+ * Receiver::names() and Receiver::slices() are called from a thread dedicated to each Receiver.
+ * names() is called again when the signal list of the table changes.
+ * Values are shared with other Receivers, and must not be modified.
+ * When slices() falls more than bsasPluginQueue batches behind, the oldest batches are dropped.
+ * Dropped batches are counted by 'dbior' and in the plugins.nDropped field of the table STS PV.
+ *
+ * A value may be 'packed' (DBRValue::Holder::packed) if its column has the "compress" option
+ * in the signal list, and the array is at least bsasCompressMinBytes.
+ * Its 'buffer' then holds zlib compressed bytes, not elements, so use
+ * Holder::type() for the element type and Holder::expand() for the elements,
+ * rather than reading 'buffer' directly.  'count' is the number of elements either way.
+ * expand() returns 'buffer' as is for a value which is not packed.
+ */
+
+// incremented on incompatible change to Receiver, DBRValue, or this file
+#define BSAS_PLUGIN_ABI 1
+
+typedef Receiver* (*bsasReceiverFactory)(const char *table, const char *args);
+
+// called by BSAS_RECEIVER_PLUGIN() while the library is being loaded
+epicsShareFunc void bsasReceiverRegister(int abi, bsasReceiverFactory factory);
+
+#define BSAS_RECEIVER_PLUGIN(FN) \
+    namespace { \
+    struct bsasReceiverRegisterPlugin { \
+        bsasReceiverRegisterPlugin() { bsasReceiverRegister(BSAS_PLUGIN_ABI, &FN); } \
+    } bsasReceiverRegisterPluginInstance; \
+    }
+
+#endif // BSASPLUGIN_H
@@ -0,0 +1,308 @@
+/* Standalone collector.  CA client and PVA server, without an IOC, database, or QSRV.
+ *
+ *   bsasd <config file>
+ *
+ * The configuration file has one directive per line.  Blank lines and '#' comments are skipped.
+ *
+ *   var <name> <value>                  set a variable, as 'var' in the IOC shell.  eg. bsasFlushPeriod
+ *                                       Any variable() of bsasSupport.dbd
+ *   table <prefix> [signals file]       serve <prefix>SIG, STS, META, and TBL.
+ *                                       Signal list read from the file, as with bsasTableSet()
+ *   plugin <prefix> <library> [args]    load a Receiver plugin, as with bsasReceiverLoad()
+ *
+ * SIGHUP re-reads the configuration file.  Variables are set again, new tables are added,
+ * and tables no longer listed are removed.  The signal list of a table is replaced only
+ * when its file has changed, so a list put to SIG is kept otherwise.
+ * New plugins are loaded.  Plugins are never unloaded.
+ * If the file has errors, the previous configuration is kept.
+ *
+ * SIGINT or SIGTERM to exit.
+ */
+#include <map>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <signal.h>
+#include <pthread.h>
+
+#include <errlog.h>
+#include <dbDefs.h>
+#include <epicsStdlib.h>
+#include <epicsThread.h>
+
+#include <pv/serverContext.h>
+
+#include "collect_ca.h"
+#include "coordinator.h"
+#include "plugin.h"
+
+namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
+
+/* Defined by epicsExportAddress().  In an IOC, code generated from
+ * the variable() entries of bsasSupport.dbd references these.
+ * bsasdVars.h is generated from the same entries.  cf. Makefile
+ */
+#define BSASD_VAR(TYPE, NAME) extern TYPE * const pvar_##TYPE##_##NAME;
+extern "C" {
+#include "bsasdVars.h"
+}
+#undef BSASD_VAR
+
+namespace {
+
+struct Variable {
+    const char *name;
+    int * const *ival;
+    double * const *dval;
+};
+
+Variable makeVariable(const char *name, int * const *ival)
+{
+    Variable ret = {name, ival, 0};
+    return ret;
+}
+
+Variable makeVariable(const char *name, double * const *dval)
+{
+    Variable ret = {name, 0, dval};
+    return ret;
+}
+
+#define BSASD_VAR(TYPE, NAME) makeVariable(#NAME, &pvar_##TYPE##_##NAME),
+const Variable variables[] = {
+#include "bsasdVars.h"
+};
+#undef BSASD_VAR
+
+const Variable& findVariable(const std::string& name)
+{
+    for(size_t i=0; i<NELEMENTS(variables); i++) {
+        if(name==variables[i].name)
+            return variables[i];
+    }
+    throw std::runtime_error("Unknown variable "+name);
+}
+
+void setVariable(const std::string& name, const std::string& value)
+{
+    const Variable& var = findVariable(name);
+    int err;
+    if(var.ival) {
+        epicsInt32 ival;
+        err = epicsParseInt32(value.c_str(), &ival, 0, 0);
+        if(!err)
+            **var.ival = ival;
+    } else {
+        double dval;
+        err = epicsParseDouble(value.c_str(), &dval, 0);
+        if(!err)
+            **var.dval = dval;
+    }
+    if(err)
+        throw std::runtime_error("Invalid value for "+name+" : "+value);
+}
+
+struct Config {
+    typedef std::vector<std::pair<std::string, std::string> > vars_t;
+    vars_t vars;
+
+    struct Table {
+        std::string signals; // file name.  may be empty
+        // library -> args
+        typedef std::vector<std::pair<std::string, std::string> > plugins_t;
+        plugins_t plugins;
+    };
+    typedef std::map<std::string, Table> tables_t;
+    tables_t tables;
+
+    // throws std::runtime_error
+    explicit Config(const std::string& fname)
+    {
+        std::ifstream strm(fname.c_str());
+        if(!strm.is_open())
+            throw std::runtime_error("Unable to open: "+fname);
+
+        std::string line;
+        for(unsigned lineno=1u; std::getline(strm, line); lineno++) {
+            std::istringstream L(line);
+            std::string cmd, arg0, arg1;
+            L>>cmd;
+
+            if(cmd.empty() || cmd[0]=='#')
+                continue; // blank line or comment
+
+            L>>arg0>>arg1;
+            std::string rest;
+            std::getline(L, rest);
+            size_t start = rest.find_first_not_of(" \t");
+            rest = start==std::string::npos ? std::string() : rest.substr(start);
+
+            std::ostringstream where;
+            where<<fname<<":"<<lineno<<" : ";
+
+            if(cmd=="var" && !arg1.empty() && rest.empty()) {
+                findVariable(arg0); // fail early
+                vars.push_back(std::make_pair(arg0, arg1));
+
+            } else if(cmd=="table" && !arg0.empty() && rest.empty()) {
+                if(tables.find(arg0)!=tables.end())
+                    throw std::runtime_error(where.str()+"Duplicate table "+arg0);
+                tables[arg0].signals = arg1;
+
+            } else if(cmd=="plugin" && !arg1.empty()) {
+                tables_t::iterator it(tables.find(arg0));
+                if(it==tables.end())
+                    throw std::runtime_error(where.str()+"plugin for table "+arg0+" before 'table "+arg0+"'");
+                it->second.plugins.push_back(std::make_pair(arg1, rest));
+
+            } else {
+                throw std::runtime_error(where.str()+"Expected 'var <name> <value>', 'table <prefix> [signals file]', or 'plugin <prefix> <library> [args]'");
+            }
+        }
+
+        if(!strm.eof())
+            throw std::runtime_error("Error reading: "+fname);
+    }
+};
+
+struct Daemon {
+    CAContext& ctxt;
+    pvas::StaticProvider& provider;
+
+    struct Table {
+        std::tr1::shared_ptr<Coordinator> coord;
+        // signal list last read from file
+        Collector::names_t signals;
+        // "library args" already loaded
+        std::set<std::string> plugins;
+    };
+    typedef std::map<std::string, Table> tables_t;
+    tables_t tables;
+
+    Daemon(CAContext& ctxt, pvas::StaticProvider& provider) :ctxt(ctxt), provider(provider) {}
+
+    void apply(const Config& conf)
+    {
+        for(Config::vars_t::const_iterator it(conf.vars.begin()), end(conf.vars.end()); it!=end; ++it)
+            setVariable(it->first, it->second);
+
+        for(tables_t::iterator it(tables.begin()), end(tables.end()); it!=end;) {
+            tables_t::iterator cur(it++);
+            if(conf.tables.find(cur->first)==conf.tables.end()) {
+                errlogPrintf("Remove table %s\n", cur->first.c_str());
+                tables.erase(cur); // joins workers, removes PVs
+            }
+        }
+
+        for(Config::tables_t::const_iterator it(conf.tables.begin()), end(conf.tables.end()); it!=end; ++it) {
+            const std::string& prefix = it->first;
+            try {
+                Table& table = tables[prefix];
+
+                if(!table.coord) {
+                    errlogPrintf("Add table %s\n", prefix.c_str());
+                    std::tr1::shared_ptr<Coordinator> C(new Coordinator(ctxt, provider, prefix));
+                    std::tr1::shared_ptr<Coordinator::SignalsHandler> H(new Coordinator::SignalsHandler(C));
+                    C->pv_signals->setHandler(H);
+                    table.coord = C;
+                }
+
+                if(!it->second.signals.empty()) {
+                    Collector::names_t signals(Coordinator::readSignals(it->second.signals));
+                    if(signals!=table.signals) {
+                        errlogPrintf("%sSIG <- %s, %zu signals\n", prefix.c_str(), it->second.signals.c_str(), signals.size());
+                        table.coord->setSignals(signals);
+                        table.signals = signals;
+                    }
+                }
+
+                for(size_t i=0; i<it->second.plugins.size(); i++) {
+                    const std::string& lib = it->second.plugins[i].first;
+                    const std::string& args = it->second.plugins[i].second;
+                    const std::string key(lib+" "+args);
+
+                    if(table.plugins.find(key)!=table.plugins.end())
+                        continue;
+
+                    std::tr1::shared_ptr<PluginReceiver> plugin(loadReceiverPlugin(prefix, lib, args));
+                    table.coord->addPlugin(plugin);
+                    table.plugins.insert(key);
+                }
+
+            } catch(std::exception& e) {
+                errlogPrintf("Error configuring table %s : %s\n", prefix.c_str(), e.what());
+            }
+        }
+    }
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    if(argc!=2) {
+        fprintf(stderr, "Usage: %s <config file>\n", argv[0]);
+        return 1;
+    }
+    const std::string conffile(argv[1]);
+
+    // Handled by sigwait() below.  Blocked before any thread is created, so that all inherit.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, 0);
+
+    int ret = 0;
+    try {
+        epics::auto_ptr<Config> conf(new Config(conffile));
+
+        // before any Collector or CA context is created.  eg. bsasRealTime
+        for(Config::vars_t::const_iterator it(conf->vars.begin()), end(conf->vars.end()); it!=end; ++it)
+            setVariable(it->first, it->second);
+
+        pvas::StaticProvider provider("bsas");
+        // lower prio than the Collector workers
+        CAContext ctxt(epicsThreadPriorityMedium);
+
+        pva::ServerContext::shared_pointer server(pva::ServerContext::create(pva::ServerContext::Config()
+                                                                             .provider(provider.provider())));
+        {
+            Daemon daemon(ctxt, provider);
+            daemon.apply(*conf);
+            errlogPrintf("bsasd running with %zu tables\n", daemon.tables.size());
+
+            while(true) {
+                int sig = 0;
+                if(sigwait(&sigs, &sig))
+                    continue;
+
+                if(sig!=SIGHUP)
+                    break;
+
+                errlogPrintf("Reload %s\n", conffile.c_str());
+                try {
+                    conf.reset(new Config(conffile));
+                    daemon.apply(*conf);
+                } catch(std::exception& e) {
+                    errlogPrintf("Reload failed, keeping previous configuration : %s\n", e.what());
+                }
+            }
+
+            errlogPrintf("bsasd exiting\n");
+            provider.close(true); // disconnect any PVA clients
+        } // joins workers, cancels CA subscriptions
+
+        server->shutdown();
+
+    } catch(std::exception& e) {
+        errlogPrintf("Error: %s\n", e.what());
+        ret = 1;
+    }
+    errlogFlush();
+    return ret;
+}
@@ -6,12 +6,15 @@
 
 #include <errlog.h>
 #include <epicsThread.h>
+#include <epicsAtomic.h>
 #include <db_access.h>
 #include <cadef.h>
 #include <pv/reftrack.h>
 
 #include "collector.h"
 #include "collect_ca.h"
+#include "compress.h"
+#include "realtime.h"
 
 #include <epicsExport.h>
 
@@ -21,6 +24,13 @@ int collectorCaDebug;
 
 double collectorCaScalarMaxRate = 140.0;
 double collectorCaArrayMaxRate = 1.5;
+// max. distinct DBF_STRING values remembered per PV
+int collectorCaStringIntern = 256;
+// numeric scalar values per shared block.  <=0 allocates each value separately
+int collectorCaScalarSlab = 256;
+// seconds.  disconnects of channels of one server this close to the first are one transition.
+// <=0 treats each disconnect separately
+double collectorCaHostWindow = 0.5;
 
 namespace {
 
@@ -40,6 +50,22 @@ struct eca_error : public std::runtime_error
     }
 };
 
+// copy fixed size, possibly not nil terminated, string
+std::string fixedString(const char *s, size_t max)
+{
+    const char *end = static_cast<const char*>(memchr(s, '\0', max));
+    return std::string(s, end ? end-s : max);
+}
+
+// common to all numeric DBR_CTRL_*
+template<typename DBR>
+void fillMeta(Subscription::Meta& meta, const DBR* dbr)
+{
+    meta.units = fixedString(dbr->units, MAX_UNITS_SIZE);
+    meta.displayLow = dbr->lower_disp_limit;
+    meta.displayHigh = dbr->upper_disp_limit;
+}
+
 void onError(exception_handler_args args)
 {
     errlogPrintf("Collector CA exception on %s : %s on %s:%u\n%s",
@@ -52,17 +78,134 @@ void onError(exception_handler_args args)
 
 size_t DBRValue::Holder::num_instances;
 
+size_t DBRValue::Holder::num_bytes;
+
 DBRValue::Holder::Holder()
     :sevr(4), stat(LINK_ALARM), count(1u)
+    ,packed(false)
+    ,packed_type(pvd::pvByte)
+    ,tracked(0u)
 {
     REFTRACE_INCREMENT(num_instances);
     ts.secPastEpoch = 0;
     ts.nsec = 0;
+    arrival = ts;
 }
 
 DBRValue::Holder::~Holder()
 {
     REFTRACE_DECREMENT(num_instances);
+    epicsAtomicSubSizeT(&num_bytes, tracked);
+}
+
+void DBRValue::Holder::track()
+{
+    epicsAtomicSubSizeT(&num_bytes, tracked);
+    tracked = buffer.size();
+    epicsAtomicAddSizeT(&num_bytes, tracked);
+}
+
+pvd::shared_vector<const void> DBRValue::Holder::expand() const
+{
+    if(!packed)
+        return buffer;
+
+    pvd::shared_vector<void> out(pvd::ScalarTypeFunc::allocArray(packed_type, count));
+    Compressor::unpack(buffer.data(), buffer.size(), out.data(), out.size());
+    return pvd::freeze(out);
+}
+
+pvd::shared_vector<const void> ScalarSlab::add(pvd::ScalarType type, const void *value, size_t nelem)
+{
+    const size_t esize = pvd::ScalarTypeFunc::elementSize(type);
+
+    if(block.empty() || block.original_type()!=type || used+esize > block.size()) {
+        block = pvd::ScalarTypeFunc::allocArray(type, std::max(nelem, size_t(1u)));
+        used = 0u;
+    }
+
+    memcpy(static_cast<char*>(block.data())+used, value, esize);
+
+    // not freeze(), which would require that no earlier elements are still referenced
+    pvd::shared_vector<const void> ret(pvd::const_shared_vector_cast<const void>(block));
+    ret.slice(used, esize);
+    used += esize;
+    return ret;
+}
+
+HostGroup::HostGroup(const std::string& host)
+    :host(host)
+    ,nChannels(0u)
+    ,nConnected(0u)
+    ,nDown(0u)
+    ,nLost(0u)
+{
+    downAt.secPastEpoch = 0;
+    downAt.nsec = 0;
+    upAt = restoredAt = downAt;
+}
+
+void HostGroup::connected(bool join)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    Guard G(mutex);
+    if(join)
+        nChannels++;
+    nConnected++;
+
+    if(nDown && epicsTimeLessThan(&upAt, &downAt))
+        upAt = now;
+    if(nDown && nConnected>=nChannels && epicsTimeLessThan(&restoredAt, &downAt))
+        restoredAt = now;
+}
+
+DBRValue HostGroup::disconnected(const epicsTimeStamp& last)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    // never older than an update already queued, which would make the disconnect late
+    epicsTimeStamp ts(now);
+    if(!epicsTimeLessThan(&last, &ts)) {
+        ts = last;
+        if(++ts.nsec >= 1000000000u) {
+            ts.nsec = 0u;
+            ts.secPastEpoch++;
+        }
+    }
+
+    Guard G(mutex);
+    if(nConnected)
+        nConnected--;
+
+    if(!lost.valid() || collectorCaHostWindow<=0.0
+            || epicsTimeDiffInSeconds(&now, &downAt) > collectorCaHostWindow) {
+        // new transition
+        lost = DBRValue(new DBRValue::Holder);
+        lost->ts = ts;
+        downAt = now;
+        nDown++;
+        nLost = 0u;
+
+    } else if(!epicsTimeLessThan(&last, &lost->ts)) {
+        // this channel updated after the shared disconnect time.
+        // Same transition, but later members share a newer update.
+        lost = DBRValue(new DBRValue::Holder);
+        lost->ts = ts;
+    }
+    nLost++;
+    return lost;
+}
+
+void HostGroup::leave(bool wasConnected)
+{
+    Guard G(mutex);
+    if(nChannels)
+        nChannels--;
+    if(wasConnected && nConnected)
+        nConnected--;
 }
 
 size_t CAContext::num_instances;
@@ -79,6 +222,13 @@ CAContext::CAContext(unsigned int prio, bool fake)
     // the CA context we create will inherit our priority
     epicsThreadSetPriority(me, prio);
 
+    // and scheduling policy
+    epics::auto_ptr<realtime::SavedSched> sched;
+    if(bsasRealTime) {
+        sched.reset(new realtime::SavedSched);
+        realtime::enterFIFO(prio, "CA context");
+    }
+
     struct ca_client_context *current = ca_current_context();
     if(current)
         ca_detach_context();
@@ -125,6 +275,24 @@ CAContext::~CAContext()
         ca_attach_context(current);
 }
 
+std::tr1::shared_ptr<HostGroup> CAContext::group(const std::string& host) const
+{
+    Guard G(hostsLock);
+    std::tr1::shared_ptr<HostGroup>& grp = hosts[host];
+    if(!grp)
+        grp.reset(new HostGroup(host));
+    return grp;
+}
+
+void CAContext::groups(std::vector<std::tr1::shared_ptr<const HostGroup> >& out) const
+{
+    Guard G(hostsLock);
+    out.clear();
+    out.reserve(hosts.size());
+    for(hosts_t::const_iterator it(hosts.begin()), end(hosts.end()); it!=end; ++it)
+        out.push_back(it->second);
+}
+
 CAContext::Attach::Attach(const CAContext &ctxt)
     :previous(ca_current_context())
 {
@@ -147,25 +315,30 @@ size_t Subscription::num_instances;
 Subscription::Subscription(const CAContext &context,
                            size_t column,
                            const std::string& pvname,
-                           Collector &collector)
+                           Collector &collector,
+                           bool compress)
     :pvname(pvname)
     ,context(context)
     ,collector(collector)
     ,column(column)
     ,chid(0)
     ,evid(0)
+    ,compress(compress)
     ,connected(false)
     ,nDisconnects(0u)
     ,nErrors(0u)
     ,nUpdates(0u)
     ,nUpdateBytes(0u)
     ,nOverflows(0u)
+    ,nPackedIn(0u)
+    ,nPackedOut(0u)
     ,lDisconnects(0u)
     ,lErrors(0u)
     ,lUpdates(0u)
     ,lUpdateBytes(0u)
     ,lOverflows(0u)
     ,limit(16u) // arbitrary, will be overwritten during first data update
+    ,meta_changed(false)
 {
     REFTRACE_INCREMENT(num_instances);
 
@@ -205,11 +378,17 @@ void Subscription::close()
 
     int err = ca_clear_channel(chid); // implies ca_clear_subscription
     // any callbacks are complete now;
+    std::tr1::shared_ptr<HostGroup> grp;
+    bool wasConnected;
     {
         Guard G(mutex);
         chid = 0;
         evid = 0;
+        grp.swap(group);
+        wasConnected = connected;
     }
+    if(grp)
+        grp->leave(wasConnected);
     eca_error::check(err);
 }
 
@@ -259,6 +438,58 @@ void Subscription::_push(DBRValue& v)
     values.back().swap(v);
 }
 
+void Subscription::disconnect(DBRValue& v)
+{
+    bool notify;
+    {
+        Guard G(mutex);
+        connected = false;
+        nDisconnects++;
+
+        notify = !compress && values.empty();
+        if(!compress)
+            _push(v);
+    }
+
+    if(compress)
+        collector.compressor->add(this, v, true); // keeps its place after earlier values
+    else if(notify)
+        collector.notEmpty(this);
+}
+
+void Subscription::deliver(DBRValue& v)
+{
+    bool notify;
+    {
+        Guard G(mutex);
+
+        if(v->packed) {
+            nPackedIn += v->count * pvd::ScalarTypeFunc::elementSize(v->packed_type);
+            nPackedOut += v->buffer.size();
+        }
+
+        notify = values.empty();
+        _push(v);
+    }
+    if(notify)
+        collector.notEmpty(this);
+}
+
+// assume locked
+pvd::shared_vector<const void> Subscription::_intern(const std::string& val)
+{
+    interned_t::iterator it(interned.find(val));
+    if(it==interned.end()) {
+        if(interned.size() >= size_t(std::max(0, collectorCaStringIntern))) {
+            // not a state PV after all.  start over
+            interned.clear();
+        }
+        pvd::shared_vector<std::string> temp(1, val);
+        it = interned.insert(std::make_pair(val, pvd::static_shared_vector_cast<const void>(pvd::freeze(temp)))).first;
+    }
+    return it->second;
+}
+
 void Subscription::onConnect (struct connection_handler_args args)
 {
     Subscription *self = static_cast<Subscription*>(ca_puser(args.chid));
@@ -272,48 +503,53 @@ void Subscription::onConnect (struct connection_handler_args args)
             short promoted = dbf_type_to_DBR_TIME(native);
             unsigned long maxcnt = ca_element_count(args.chid);
 
-            if(native==DBF_STRING) {
-                errlogPrintf("%s DBF_STRING not supported, ignoring\n", self->pvname.c_str());
-                return;
-            }
-
             // subscribe 0 triggers dynamic array size
             int err = ca_create_subscription(promoted, 0, args.chid, DBE_VALUE|DBE_ALARM, &onEvent, self, &self->evid);
             eca_error::check(err);
 
+            // (re)fetch meta-data once per connect
+            err = ca_array_get_callback(dbf_type_to_DBR_CTRL(native), 1, args.chid, &onCtrl, self);
+            eca_error::check(err);
+
+            std::tr1::shared_ptr<HostGroup> grp(self->context.group(ca_host_name(args.chid))), prev;
             {
                 Guard G(self->mutex);
                 self->last_event.secPastEpoch = 0;
                 self->last_event.nsec = 0;
                 self->connected = true;
                 self->limit = std::max(size_t(4u), size_t(bsasFlushPeriod*(maxcnt!=1u ? collectorCaArrayMaxRate : collectorCaScalarMaxRate)));
+                prev = self->group;
+                self->group = grp;
             }
+            if(prev && prev!=grp)
+                prev->leave(false); // moved to another server
+            grp->connected(prev!=grp);
 
         } else if(args.op==CA_OP_CONN_DOWN) {
 
-            if(!self->evid) return; // unsupported DBF_STRING
-
             const int err = ca_clear_subscription(self->evid);
             self->evid = 0;
 
-            DBRValue val(new DBRValue::Holder);
-            epicsTimeGetCurrent(&val->ts);
-
-            bool notify;
+            std::tr1::shared_ptr<HostGroup> grp;
+            epicsTimeStamp last;
             {
                 Guard G(self->mutex);
-                notify = self->values.empty();
-
-                self->connected = false;
-                self->nDisconnects++;
-
-                self->_push(val);
+                grp = self->group;
+                last = self->last_event;
             }
 
-            if(notify) {
-                self->collector.notEmpty(self);
+            DBRValue val;
+            if(grp) {
+                // shared with other channels lost at the same time
+                val = grp->disconnected(last);
+            } else {
+                // no group until the first CA_OP_CONN_UP
+                val = DBRValue(new DBRValue::Holder);
+                epicsTimeGetCurrent(&val->ts);
             }
 
+            self->disconnect(val);
+
             eca_error::check(err);
 
         } else {
@@ -365,9 +601,13 @@ void Subscription::onEvent (struct event_handler_args args)
         // dbr_time_double includes space for the first value, but we don't want to copy this now
         memcpy(&meta, args.dbr, offsetof(dbr_time_double, value));
 
-        pvd::shared_vector<void> buf;
-        if(type!=pvd::pvString) {
-            buf = pvd::ScalarTypeFunc::allocArray(type, count);
+        pvd::shared_vector<const void> cbuf;
+        if(type!=pvd::pvString && count==1u && collectorCaScalarSlab>0) {
+            Guard G(self->mutex);
+            cbuf = self->slab.add(type, dbr_value_ptr(args.dbr, args.type), collectorCaScalarSlab);
+
+        } else if(type!=pvd::pvString) {
+            pvd::shared_vector<void> buf(pvd::ScalarTypeFunc::allocArray(type, count));
 
             if(buf.size() != elem_size*count)
                 throw std::logic_error("DBR buffer size computation error");
@@ -376,27 +616,40 @@ void Subscription::onEvent (struct event_handler_args args)
                    dbr_value_ptr(args.dbr, args.type),
                    buf.size());
 
-        } else {
-            // TODO: not currently used
+            cbuf = pvd::freeze(buf);
+
+        } else if(count==1) {
+            // scalar strings (eg. state/mode PVs) usually cycle through a few values
+            const dbr_string_t *sval = static_cast<const dbr_string_t*>(dbr_value_ptr(args.dbr, args.type));
+            std::string val(fixedString(sval[0], MAX_STRING_SIZE));
 
             Guard G(self->mutex);
+            cbuf = self->_intern(val);
 
-            self->nErrors++;
-            self->nOverflows++;
-            if(collectorCaDebug>0) {
-                errlogPrintf("%s DBF_STRING not supported, ignoring\n", self->pvname.c_str());
-            }
-            return;
+        } else {
+            const dbr_string_t *sval = static_cast<const dbr_string_t*>(dbr_value_ptr(args.dbr, args.type));
+            pvd::shared_vector<std::string> arr(count);
+
+            for(size_t i=0; i<count; i++)
+                arr[i] = fixedString(sval[i], MAX_STRING_SIZE);
+
+            cbuf = pvd::static_shared_vector_cast<const void>(pvd::freeze(arr));
         }
 
         DBRValue val(new DBRValue::Holder);
         val->sevr = meta.severity;
         val->stat = meta.status;
         val->ts = meta.stamp;
+        epicsTimeGetCurrent(&val->arrival);
         val->count = count;
-        val->buffer = pvd::freeze(buf);
+        val->buffer = cbuf;
+        if(type!=pvd::pvString)
+            val->track(); // interned strings are shared
+
+        // large arrays are queued to the Compressor, which will deliver() later
+        const bool pack = self->compress && count!=1u && type!=pvd::pvString && self->collector.compressor;
 
-        bool notify;
+        bool notify = false, queued = false;
         {
             Guard G(self->mutex);
 
@@ -423,12 +676,15 @@ void Subscription::onEvent (struct event_handler_args args)
 
 
             if(epicsTimeDiffInSeconds(&meta.stamp, &self->last_event) > 0.0) {
-                notify = self->values.empty();
+                if(pack) {
+                    queued = true;
+                } else {
+                    notify = self->values.empty();
 
-                self->_push(val);
+                    self->_push(val);
+                }
             } else {
                 self->nErrors++;
-                notify = false;
 
                 if(collectorCaDebug>2) {
                     errlogPrintf("%s ignoring non-monotonic TS\n", self->pvname.c_str());
@@ -437,7 +693,13 @@ void Subscription::onEvent (struct event_handler_args args)
             self->last_event = meta.stamp;
         }
 
-        if(notify) {
+        if(queued) {
+            if(!self->collector.compressor->add(self, val)) {
+                Guard G(self->mutex);
+                self->nOverflows++;
+            }
+
+        } else if(notify) {
             self->collector.notEmpty(self);
         }
 
@@ -449,8 +711,63 @@ void Subscription::onEvent (struct event_handler_args args)
     }
 }
 
+void Subscription::onCtrl (struct event_handler_args args)
+{
+    Subscription *self = static_cast<Subscription*>(args.usr);
+    if(collectorCaDebug>1)
+        errlogPrintf("%s ctrl dbr:%ld\n", ca_name(args.chid), args.type);
+    try {
+        if(args.status!=ECA_NORMAL)
+            throw eca_error(args.status, "Get DBR_CTRL");
+
+        Meta meta;
+
+        switch(args.type) {
+        case DBR_CTRL_DOUBLE: {
+            const dbr_ctrl_double *dbr = static_cast<const dbr_ctrl_double*>(args.dbr);
+            fillMeta(meta, dbr);
+            meta.precision = dbr->precision;
+        }
+            break;
+        case DBR_CTRL_FLOAT: {
+            const dbr_ctrl_float *dbr = static_cast<const dbr_ctrl_float*>(args.dbr);
+            fillMeta(meta, dbr);
+            meta.precision = dbr->precision;
+        }
+            break;
+        case DBR_CTRL_LONG:  fillMeta(meta, static_cast<const dbr_ctrl_long*>(args.dbr)); break;
+        case DBR_CTRL_SHORT: fillMeta(meta, static_cast<const dbr_ctrl_short*>(args.dbr)); break;
+        case DBR_CTRL_CHAR:  fillMeta(meta, static_cast<const dbr_ctrl_char*>(args.dbr)); break;
+        case DBR_CTRL_ENUM: {
+            const dbr_ctrl_enum *dbr = static_cast<const dbr_ctrl_enum*>(args.dbr);
+            for(short i=0; i<dbr->no_str && i<MAX_ENUM_STATES; i++) {
+                meta.choices.push_back(fixedString(dbr->strs[i], MAX_ENUM_STRING_SIZE));
+            }
+        }
+            break;
+        default:
+            break; // eg. DBR_CTRL_STRING has no meta-data
+        }
+
+        Guard G(self->mutex);
+        if(!(meta==self->meta)) {
+            self->meta = meta;
+            self->meta_changed = true;
+        }
+
+    } catch(std::exception& err) {
+        errlogPrintf("Unexpected exception in Subscription::onCtrl() for \"%s\" : %s\n", ca_name(args.chid), err.what());
+
+        Guard G(self->mutex);
+        self->nErrors++;
+    }
+}
+
 extern "C" {
 epicsExportAddress(int, collectorCaDebug);
 epicsExportAddress(double, collectorCaScalarMaxRate);
 epicsExportAddress(double, collectorCaArrayMaxRate);
+epicsExportAddress(int, collectorCaStringIntern);
+epicsExportAddress(int, collectorCaScalarSlab);
+epicsExportAddress(double, collectorCaHostWindow);
 }
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <deque>
+#include <map>
+#include <vector>
 
 #include <epicsTime.h>
 #include <epicsMutex.h>
@@ -25,14 +27,30 @@ struct Collector;
 struct DBRValue {
     struct Holder {
         static size_t num_instances;
+        // sum of tracked buffer sizes of all instances
+        static size_t num_bytes;
 
         epicsTimeStamp ts; // in epics epoch
+        epicsTimeStamp arrival; // when received from CA.  zero if not
         epicsUInt16 sevr, // [0-3] or 4 (Disconnect)
                     stat; // status code a la Base alarm.h
         epicsUInt32 count;
         epics::pvData::shared_vector<const void> buffer; // contains DBF_* mapped to pvd:pv* code
+        // when true, buffer holds 'count' elements of 'packed_type' after compression.  cf. compress.h
+        bool packed;
+        epics::pvData::ScalarType packed_type;
         Holder();
         ~Holder();
+
+        // add buffer size to num_bytes.  Call after assigning buffer
+        void track();
+
+        // element type, even when packed
+        inline epics::pvData::ScalarType type() const { return packed ? packed_type : buffer.original_type(); }
+        // uncompressed buffer.  May allocate.
+        epics::pvData::shared_vector<const void> expand() const;
+    private:
+        size_t tracked;
     };
 private:
     std::tr1::shared_ptr<Holder> held;
@@ -53,6 +71,51 @@ public:
     }
 };
 
+// Successive scalar values of one type packed into shared blocks.
+// Each value is a one element view, so values do not need an allocation of their own,
+// and successive values are adjacent in memory.  cf. collectorCaScalarSlab
+struct ScalarSlab {
+    epics::pvData::shared_vector<void> block;
+    size_t used; // bytes
+
+    ScalarSlab() :used(0u) {}
+
+    // copy one element of 'type' from 'value'.  Starts a new block of 'nelem' elements
+    // when full, or when the type changes.  Elements already handed out are never modified.
+    epics::pvData::shared_vector<const void> add(epics::pvData::ScalarType type, const void *value, size_t nelem);
+};
+
+// Channels connected through one CA server, as named by ca_host_name().  eg. one IOC.
+// When a server goes away, all of its channels disconnect together.
+// Disconnects within collectorCaHostWindow of the first are one down transition,
+// and share one disconnect update.  So the Collector sees one slice instead of one per channel.
+struct HostGroup {
+    const std::string host;
+
+    mutable epicsMutex mutex;
+    // channels last connected through this server, and how many of these are now connected
+    size_t nChannels, nConnected;
+    // down transitions, and channels lost in the latest
+    size_t nDown, nLost;
+    // start of the latest down transition, first reconnect after it,
+    // and when all channels were connected again.
+    epicsTimeStamp downAt, upAt, restoredAt;
+
+    explicit HostGroup(const std::string& host);
+
+    // channel (re)connected through this server.  'join' if not already a member.
+    void connected(bool join);
+    // member channel disconnected.  Returns the disconnect update to queue,
+    // which is newer than 'last', the time of the latest update queued for this channel.
+    DBRValue disconnected(const epicsTimeStamp& last);
+    // channel closed, or now connected through another server
+    void leave(bool wasConnected);
+
+private:
+    // disconnect update of the latest down transition
+    DBRValue lost;
+};
+
 struct CAContext {
     static size_t num_instances;
 
@@ -61,6 +124,11 @@ struct CAContext {
 
     struct ca_client_context *context;
 
+    // find or create the group of a CA server
+    std::tr1::shared_ptr<HostGroup> group(const std::string& host) const;
+    // all groups so far
+    void groups(std::vector<std::tr1::shared_ptr<const HostGroup> >& out) const;
+
     // manage attachment of a context to the current thread
     struct Attach {
         struct ca_client_context *previous;
@@ -68,6 +136,11 @@ struct CAContext {
         ~Attach();
     };
 
+private:
+    typedef std::map<std::string, std::tr1::shared_ptr<HostGroup> > hosts_t;
+    mutable epicsMutex hostsLock;
+    mutable hosts_t hosts;
+
     EPICS_NOT_COPYABLE(CAContext)
 };
 
@@ -86,9 +159,14 @@ struct Subscription {
 
     mutable epicsMutex mutex;
 
+    // compress array values.  cf. compress.h
+    const bool compress;
+
     bool connected;
     // stats counters
     size_t nDisconnects, nErrors, nUpdates, nUpdateBytes, nOverflows;
+    // bytes before and after compression
+    size_t nPackedIn, nPackedOut;
     // previous values of counters for delta
     size_t lDisconnects, lErrors, lUpdates, lUpdateBytes, lOverflows;
     // current buffer limit
@@ -98,10 +176,38 @@ struct Subscription {
 
     std::deque<DBRValue> values;
 
+    // meta-data fetched with DBR_CTRL_* once per (re)connect
+    struct Meta {
+        std::string units;
+        epicsInt16 precision;
+        double displayLow, displayHigh;
+        std::vector<std::string> choices; // enum strings
+        Meta() :precision(0), displayLow(0.0), displayHigh(0.0) {}
+        bool operator==(const Meta& o) const {
+            return units==o.units && precision==o.precision
+                    && displayLow==o.displayLow && displayHigh==o.displayHigh
+                    && choices==o.choices;
+        }
+    };
+    Meta meta;
+    // set when meta changes, cleared when published
+    bool meta_changed;
+
+    // DBF_STRING values seen recently.  Repeated values share one buffer.
+    typedef std::map<std::string, epics::pvData::shared_vector<const void> > interned_t;
+    interned_t interned;
+
+    // numeric scalar values.  access with mutex locked
+    ScalarSlab slab;
+
+    // server of the current, or last, connection.  NULL before first connect
+    std::tr1::shared_ptr<HostGroup> group;
+
     Subscription(const CAContext& context,
                  size_t column,
                  const std::string& pvname,
-                 Collector& collector);
+                 Collector& collector,
+                 bool compress = false);
     ~Subscription();
 
     void close();
@@ -114,13 +220,24 @@ struct Subscription {
     // for test code only
     void push(const DBRValue& v);
 
+    // queue an update after compression
+    void deliver(DBRValue& v);
+
+    // queue a disconnect update.  Behind any values still being compressed
+    void disconnect(DBRValue& v);
+
 private:
     void _push(DBRValue& v);
+    // lookup/add an interned string.  call with mutex locked
+    epics::pvData::shared_vector<const void> _intern(const std::string& val);
 
     static void onConnect (struct connection_handler_args args);
     static void onEvent (struct event_handler_args args);
+    static void onCtrl (struct event_handler_args args);
 
     EPICS_NOT_COPYABLE(Subscription)
 };
 
+extern double collectorCaHostWindow;
+
 #endif // COLLECT_CA_H
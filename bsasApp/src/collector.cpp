@@ -1,12 +1,16 @@
 
 #include <list>
 #include <algorithm>
+#include <sstream>
 
 #include <epicsMath.h>
 #include <errlog.h>
 #include <pv/reftrack.h>
 
 #include "collector.h"
+#include "derived.h"
+#include "compress.h"
+#include "spill.h"
 
 #include <epicsExport.h>
 
@@ -16,32 +20,212 @@ namespace pvd = epics::pvData;
 static double maxEventRate = 20;
 // timeout to flush partial events
 static double maxEventAge = 2.5;
-// holdoff after delivering events
+// minimum lag to blame a column for holding a slice incomplete
+static double bsasBlameLag = 0.01;
+// complete slices without waiting for columns not expected per their learned cadence
+int bsasPredictCadence = 1;
+// holdoff after delivering events.  Upper limit when adaptive
 double bsasFlushPeriod = 2.0;
+// adaptive holdoff.  Target batch size.  <=0 to disable
+int bsasFlushTargetRows = 0;
+int bsasFlushTargetBytes = 4*1024*1024;
+// lower limit of adaptive holdoff
+double bsasFlushMinPeriod = 0.1;
+// align batches of all tables on multiples of this period (seconds).  <=0 to disable
+double bsasFlushEpoch = 0.0;
 
 int collectorDebug;
 
 size_t Collector::num_instances;
 
+namespace {
+// (sec<<32)|nsec  ->  nanoseconds
+inline epicsInt64 keyNS(epicsUInt64 key)
+{
+    return epicsInt64(key>>32u)*1000000000 + epicsInt64(key&0xffffffffu);
+}
+
+// EPICS time in nanoseconds  ->  flush epoch
+epicsUInt64 epochNS(epicsInt64 ns)
+{
+    if(bsasFlushEpoch<=0.0)
+        return 0u;
+    epicsInt64 period = epicsInt64(bsasFlushEpoch*1e9 + 0.5);
+    if(period<=0)
+        return 0u;
+    ns += epicsInt64(POSIX_TIME_AT_EPICS_EPOCH)*1000000000;
+    return ns>0 ? epicsUInt64(ns/period) : 0u;
+}
+}
+
+unsigned Cadence::update(epicsUInt64 key)
+{
+    if(last==0u) {
+        last = key;
+        return 0u;
+    }
+
+    epicsInt64 delta = keyNS(key) - keyNS(last);
+    if(delta<=0)
+        return 0u; // out of order, ignore
+    last = key;
+
+    if(period>0) {
+        // allow for missed updates, and some jitter
+        epicsInt64 n = (delta + period/2)/period,
+                   err = delta - n*period;
+        if(n>=1 && err<=period/8 && err>=-period/8) {
+            if(locked())
+                return unsigned(n-1);
+            if(n==1)
+                lock++;
+            return 0u;
+        }
+    }
+
+    // (re)learn
+    period = delta;
+    lock = 0u;
+    return 0u;
+}
+
+void LagHistogram::clear()
+{
+    for(size_t b=0; b<NBins; b++)
+        bins[b] = 0u;
+}
+
+void LagHistogram::add(double seconds)
+{
+    size_t b = 0u;
+    for(double edge = 1e-3; b<NBins-1u && seconds>=edge; edge*=2.0)
+        b++;
+    bins[b]++;
+}
+
+LagHistogram LagHistogram::since(const LagHistogram& o) const
+{
+    LagHistogram ret;
+    for(size_t b=0; b<NBins; b++)
+        ret.bins[b] = bins[b] - o.bins[b];
+    return ret;
+}
+
+size_t LagHistogram::count() const
+{
+    size_t n = 0u;
+    for(size_t b=0; b<NBins; b++)
+        n += bins[b];
+    return n;
+}
+
+double LagHistogram::quantile(double q) const
+{
+    const size_t total = count();
+    if(total==0u)
+        return 0.0;
+
+    size_t n = 0u;
+    double edge = 1e-3;
+    for(size_t b=0; b<NBins-1u; b++, edge*=2.0) {
+        n += bins[b];
+        if(n >= q*total)
+            return edge;
+    }
+    return epicsINF;
+}
+
+bool Cadence::expected(epicsUInt64 key) const
+{
+    if(!locked())
+        return true;
+
+    epicsInt64 delta = keyNS(key) - keyNS(last);
+    // updates arrive in order.  Nothing more is coming for keys before the latest.
+    return delta > 0 && delta >= period - period/8;
+}
+
 Collector::Collector(CAContext& ctxt, const names_t &names, unsigned int prio)
     :ctxt(ctxt)
     ,receivers_changed(false)
     ,nComplete(0u)
     ,nOverflow(0u)
+    ,nSpilled(0u)
+    ,nSpillBytes(0u)
+    ,nOverrun(0u)
+    ,flushPeriod(bsasFlushPeriod)
+    ,rowRate(0.0)
     ,waiting(false)
     ,run(true)
     ,processor(pvd::Thread::Config(this, &Collector::process)
                .name("BSA Processor")
                .prio(prio))
     ,oldest_key(0u)
+    ,rowAvg(0.0)
+    ,byteAvg(0.0)
+    ,watchdog("BSA Processor")
+    ,spill_failed(false)
 {
     REFTRACE_INCREMENT(num_instances);
 
+    if(bsasRealTime) {
+        realtime::lockMemory();
+        // the most events process_dequeue() will build
+        completed.reserve(5000u);
+    }
+
     pvs.resize(names.size());
 
+    std::vector<std::string> colnames(names.size()), exprs(names.size());
+    std::vector<char> packs(names.size(), 0);
+    bool anypack = false;
+
     for(size_t i=0, N=names.size(); i<N; i++)
     {
-        pvs[i].sub.reset(new Subscription(ctxt, i, names[i], *this));
+        if(!Derived::split(names[i], colnames[i], exprs[i])) {
+            // "PVNAME [option ...]"
+            std::istringstream strm(names[i]);
+            std::string opt;
+            strm>>colnames[i];
+
+            while(strm>>opt) {
+                if(opt=="compress") {
+                    packs[i] = anypack = true;
+                } else {
+                    errlogPrintf("%s : ignoring unknown option '%s'\n", colnames[i].c_str(), opt.c_str());
+                }
+            }
+        }
+        pvs[i].name = colnames[i];
+    }
+
+    if(anypack && !Compressor::available()) {
+        errlogPrintf("Built without compression support.  Ignoring 'compress'\n");
+    } else if(anypack) {
+        compressor.reset(new Compressor(prio));
+    }
+
+    for(size_t i=0, N=names.size(); i<N; i++)
+    {
+        if(exprs[i].empty()) {
+            pvs[i].sub.reset(new Subscription(ctxt, i, colnames[i], *this, packs[i] && compressor));
+            continue;
+        }
+
+        try {
+            std::tr1::shared_ptr<Derived> D(new Derived(exprs[i], colnames));
+
+            for(size_t j=0; j<D->inputs.size(); j++) {
+                size_t in = D->inputs[j];
+                if(!exprs[in].empty() && in>=i)
+                    throw std::runtime_error("may only reference derived columns listed before");
+            }
+
+            pvs[i].derived = D;
+        } catch(std::exception& e) {
+            // column will always be empty
+            errlogPrintf("Derived column %s error : %s\n", colnames[i].c_str(), e.what());
+        }
     }
 
     processor.start();
@@ -56,9 +240,13 @@ Collector::~Collector()
 void Collector::close()
 {
     for(size_t i=0, N=pvs.size(); i<N; i++) {
-        pvs[i].sub->close();
+        if(pvs[i].sub)
+            pvs[i].sub->close();
     }
 
+    if(compressor)
+        compressor->close(); // no more CA callbacks, so no more add()
+
     {
         Guard G(mutex);
         run = false;
@@ -92,7 +280,7 @@ void Collector::add_receiver(Receiver* recv)
 
         names.reserve(pvs.size());
         for(size_t i=0, N=pvs.size(); i<N; i++) {
-            names.push_back(pvs[i].sub->pvname);
+            names.push_back(pvs[i].name);
         }
     }
     recv->names(names);
@@ -107,9 +295,13 @@ void Collector::remove_receiver(Receiver* recv)
 
 void Collector::process()
 {
+    if(bsasRealTime)
+        realtime::enterFIFO(epicsThreadGetPrioritySelf(), "BSA Processor");
+
     Guard G(mutex);
 
     epicsTimeGetCurrent(&now);
+    lastFlush = now;
 
     while(run) {
         waiting = false; // set if input queues emptied
@@ -124,8 +316,12 @@ void Collector::process()
         now_key <<= 32;
         now_key |= now.nsec;
 
-        process_dequeue();
-        process_test();
+        watchdog.start();
+        process_dequeue(G);
+        watchdog.mark("dequeue");
+        process_test(G);
+        watchdog.mark("test");
+        process_hold();
 
         if(receivers_changed) {
             // copy for use while unlocked
@@ -134,33 +330,218 @@ void Collector::process()
         }
 
         bool willwait = waiting;
+        // wake to release a held epoch which has aged, even if no more updates arrive
+        const bool holding = !held.empty();
+        double period = flushPeriod;
+        bool overrun;
         {
             nComplete += completed.size();
             UnGuard U(G);
 
-            if(!completed.empty()) {
-                for(receivers_t::iterator it(receivers_shadow.begin()), end(receivers_shadow.end()); it!=end; ++it) {
-                    (*it)->slices(completed);
-                }
-                epicsThreadSleep(bsasFlushPeriod);
+            const bool flush = !completed.empty();
+            if(flush) {
+                process_derived();
+                watchdog.mark("derived");
+
+                period = process_rate();
+
+                process_deliver();
+                watchdog.mark("deliver");
+
+                completed.clear(); // release cells before sleeping
+                watchdog.mark("release");
             }
+            overrun = watchdog.finish();
+
+            if(flush)
+                epicsThreadSleep(period);
 
-            if(willwait)
+            if(willwait && holding)
+                wakeup.wait(maxEventAge);
+            else if(willwait)
                 wakeup.wait();
             epicsTimeGetCurrent(&now);
         }
+        flushPeriod = period;
+        rowRate = rowAvg;
+        if(overrun)
+            nOverrun++;
+    }
+}
+
+// With bsasFlushEpoch, hold back completed rows of the newest epoch until it is closed,
+// so that each epoch is delivered whole.  An epoch is closed once a row in a later
+// epoch completes, or when any further row in it would be older than maxEventAge.
+void Collector::process_hold()
+{
+    if(!held.empty()) {
+        // held rows are older than anything newly completed
+        held.reserve(held.size()+completed.size());
+        for(size_t r=0, R=completed.size(); r<R; r++) {
+            held.push_back(Receiver::slices_t::value_type());
+            held.back().first = completed[r].first;
+            held.back().second.swap(completed[r].second);
+        }
+        completed.swap(held);
+        held.clear();
+    }
+
+    if(bsasFlushEpoch<=0.0 || completed.empty())
+        return;
+
+    const epicsUInt64 epoch = flushEpoch(completed.back().first);
+
+    if(flushEpochBefore(now_key, maxEventAge) > epoch)
+        return; // aged out.  deliver all
+
+    size_t begin = completed.size();
+    while(begin>0u && flushEpoch(completed[begin-1u].first)==epoch)
+        begin--;
+
+    held.resize(completed.size()-begin);
+    for(size_t r=0, R=held.size(); r<R; r++) {
+        held[r].first = completed[begin+r].first;
+        held[r].second.swap(completed[begin+r].second);
+    }
+    completed.resize(begin);
+
+    if(collectorDebug>3)
+        errlogPrintf("## hold %zu rows of open epoch %llu\n", held.size(), (unsigned long long)epoch);
+}
+
+// unlocked.  Pass completed slices to Receivers.  May steal cells from 'completed'
+void Collector::process_deliver()
+{
+    if(bsasFlushEpoch<=0.0 || flushEpoch(completed.front().first)==flushEpoch(completed.back().first)) {
+        for(receivers_t::iterator it(receivers_shadow.begin()), end(receivers_shadow.end()); it!=end; ++it) {
+            (*it)->slices(completed);
+        }
+        return;
+    }
+
+    // cut at epoch boundaries, so that all tables batch the same key ranges
+    Receiver::slices_t part;
+    for(size_t begin=0u, N=completed.size(); begin<N;) {
+        const epicsUInt64 epoch = flushEpoch(completed[begin].first);
+        size_t next = begin+1u;
+        while(next<N && flushEpoch(completed[next].first)==epoch)
+            next++;
+
+        part.resize(next-begin);
+        for(size_t r=0u; r<next-begin; r++) {
+            part[r].first = completed[begin+r].first;
+            part[r].second.swap(completed[begin+r].second);
+        }
+
+        for(receivers_t::iterator it(receivers_shadow.begin()), end(receivers_shadow.end()); it!=end; ++it) {
+            (*it)->slices(part);
+        }
+        begin = next;
+    }
+}
+
+// update arrival rates from the batch about to be delivered, and choose the next holdoff.
+// called from processor thread while unlocked
+double Collector::process_rate()
+{
+    epicsTimeStamp T;
+    epicsTimeGetCurrent(&T);
+    double dt = epicsTimeDiffInSeconds(&T, &lastFlush);
+    lastFlush = T;
+
+    size_t nbytes = 0u;
+    if(bsasFlushTargetBytes>0) {
+        for(size_t r=0, R=completed.size(); r<R; r++)
+            nbytes += sliceBytes(completed[r]);
+    }
+
+    if(dt>0.0) {
+        // smooth over a few batches
+        double rrate = completed.size()/dt,
+               brate = nbytes/dt;
+        if(rowAvg==0.0 && byteAvg==0.0) {
+            rowAvg = rrate;
+            byteAvg = brate;
+        } else {
+            rowAvg += 0.25*(rrate - rowAvg);
+            byteAvg += 0.25*(brate - byteAvg);
+        }
     }
+
+    double period = adaptPeriod(rowAvg, byteAvg);
+
+    if(collectorDebug>1)
+        errlogPrintf("## flush %zu rows, %zu bytes after %.3f sec.  next %.3f sec\n",
+                     completed.size(), nbytes, dt, period);
+    return period;
 }
 
-void Collector::process_dequeue()
+double Collector::adaptPeriod(double rowRate, double byteRate)
+{
+    double period = bsasFlushPeriod;
+
+    if(bsasFlushTargetRows>0 && rowRate>0.0)
+        period = std::min(period, bsasFlushTargetRows/rowRate);
+    if(bsasFlushTargetBytes>0 && byteRate>0.0)
+        period = std::min(period, bsasFlushTargetBytes/byteRate);
+
+    // deliver about one epoch per flush, rather than a burst of several.  cf. process_deliver()
+    if(bsasFlushEpoch>0.0)
+        period = std::min(period, bsasFlushEpoch);
+
+    // bsasFlushPeriod takes precedence over bsasFlushMinPeriod
+    return std::min(bsasFlushPeriod, std::max(bsasFlushMinPeriod, period));
+}
+
+epicsUInt64 flushEpoch(epicsUInt64 key)
+{
+    return epochNS(keyNS(key));
+}
+
+epicsUInt64 flushEpochBefore(epicsUInt64 key, double age)
+{
+    // in nanoseconds.  Subtracting (sec<<32)|nsec keys would borrow into the seconds wrongly
+    return epochNS(keyNS(key) - epicsInt64(age*1e9));
+}
+
+size_t sliceBytes(const Receiver::slices_t::value_type& s)
+{
+    size_t nbytes = 8u; // timestamp
+    for(size_t c=0, C=s.second.size(); c<C; c++) {
+        const DBRValue& val = s.second[c];
+        if(val.valid())
+            nbytes += val->count * pvd::ScalarTypeFunc::elementSize(val->type());
+        else
+            nbytes += 8u;
+    }
+    return nbytes;
+}
+
+void Collector::process_dequeue(Guard& G)
 {
     // process input queues
     bool nothing = false; // true if all queues empty
     // break if:
     // * nothing to do
     // * # of potentially complete events exceeds limit
+    // Not scaled by the adaptive holdoff.  Partial slices may wait up to maxEventAge however short it is.
     unsigned maxEvents = std::max(10.0, std::min(maxEventRate*bsasFlushPeriod, 5000.0));
-    while(!nothing && events.size() < maxEvents) {
+    // Spill rounds in one pass.  A sustained burst must not keep this loop from process_test()
+    const unsigned maxSpillRounds = 4u;
+    unsigned nspill = 0u;
+    bool yield = false; // leave the rest queued for the next pass
+    while(!nothing) {
+        if(events.size() >= maxEvents) {
+            // make room by spilling the oldest half, if enabled
+            if(nspill >= maxSpillRounds) {
+                yield = true;
+                break;
+            } else if(!process_spill(G, events.size() - maxEvents/2u)) {
+                break;
+            }
+            nspill++;
+        }
+
         nothing = true;
 
         for(size_t i=0, N=pvs.size(); i<N; i++) {
@@ -183,16 +564,35 @@ void Collector::process_dequeue()
 
             pv.connected = val->sevr<=3;
 
+            if(!pv.connected) {
+                pv.cadence = Cadence();
+
+            } else {
+                if(key > oldest_key) {
+                    // still pending
+                } else if(pv.cadence.locked() && !pv.cadence.expected(key)) {
+                    // slice already completed without this update
+                    pv.nMiss++;
+                    if(collectorDebug>0)
+                        errlogPrintf("## %s missed cadence at %llx\n", pv.sub->pvname.c_str(), key);
+                } else {
+                    pv.nLate++;
+                }
+                pv.nSrcGap += pv.cadence.update(key);
+            }
+
             if(collectorDebug>3) {
                 errlogPrintf("## %s event:%llx sevr %u\n", pv.sub->pvname.c_str(), key, val->sevr);
             }
 
-            if(!pv.connected || key > oldest_key) {
-                // data event
+            if(key > oldest_key) {
+                // data or disconnect event
 
                 // create/update a slice
 
                 events_t::mapped_type& slice = events[key]; // implicitly allocs new slice
+                if(slice.empty() && spill.get())
+                    spill->take(key, slice); // late column for a spilled slice.  re-merge.  One slice, so copied while locked
                 slice.resize(pvs.size());
 
                 if(slice[i].valid()) {
@@ -205,14 +605,16 @@ void Collector::process_dequeue()
                 }
 
             } else if(pv.connected) {
-                // disconnect event
+                // late data event.  counted above
             } else if(collectorDebug>0) {
-                errlogPrintf("## %s ignore leftovers of %llx\n", pvs[i].sub->pvname.c_str(), key);
+                // disconnect shared with other channels of a server (cf. HostGroup), for a slice already flushed.
+                // Only the change of state matters.
+                errlogPrintf("## %s disconnect at flushed %llx\n", pvs[i].sub->pvname.c_str(), key);
             }
         }
     }
 
-    if(!nothing) {
+    if(!nothing && !yield) {
         if(collectorDebug>0) {
             errlogPrintf("## Overflow process_dequeue() after building %zu events\n", events.size());
         }
@@ -232,7 +634,7 @@ void Collector::process_dequeue()
     waiting = nothing; // wait if we emptied all queues
 }
 
-void Collector::process_test()
+void Collector::process_test(Guard& G)
 {
     epicsUInt64 max_age = maxEventAge;
     max_age <<= 32;
@@ -263,7 +665,8 @@ void Collector::process_test()
             // test if all data available or disconnected
             bool complete = true;
             for(size_t i=0, N=pvs.size(); complete && i<N; i++) {
-                complete = !pvs[i].connected || slice[i].valid();
+                complete = !pvs[i].connected || slice[i].valid()
+                        || (bsasPredictCadence && !pvs[i].cadence.expected(it->first));
 
                 if(!complete && collectorDebug > (e<=4 && events.size()>4 ? 4 : 1)) {
                     errlogPrintf("## test slice %llx found incomplete %s %sconn %svalid\n",
@@ -284,6 +687,17 @@ void Collector::process_test()
 
     completed.clear(); // paranoia, should already be empty
 
+    if(spill.get() && !spill->empty()) {
+        // read back spilled slices which will be flushed, to be delivered in key order.
+        // Those after the most recent partial slice stay spilled.
+        // 'events' and 'spill' are only used by this thread, so copy without blocking notEmpty()
+        UnGuard U(G);
+        while(!spill->empty() && (first_partial==events.end() || spill->front() < first_partial->first)) {
+            const epicsUInt64 key = spill->front();
+            spill->take(key, events[key]);
+        }
+    }
+
     // 'it' points to first element _not_ to remove
 
     if(collectorDebug>3) {
@@ -307,11 +721,49 @@ void Collector::process_test()
         assert(cur->first > oldest_key);
         oldest_key = cur->first;
 
-        completed.push_back(*cur);
+        // find first and last arrival
+        const epicsTimeStamp *first = 0, *last = 0;
+        size_t lastcol = 0u;
+
+        for(size_t i=0, N=pvs.size(); i<N; i++) {
+            const DBRValue& cell = cur->second[i];
+            if(!cell.valid()) {
+                if(pvs[i].connected && pvs[i].cadence.expected(cur->first))
+                    pvs[i].nAged++;
+                continue;
+            }
+            if(cell->arrival.secPastEpoch==0u)
+                continue; // not from CA
+
+            if(!first || epicsTimeLessThan(&cell->arrival, first))
+                first = &cell->arrival;
+            if(!last || epicsTimeGreaterThan(&cell->arrival, last)) {
+                last = &cell->arrival;
+                lastcol = i;
+            }
+        }
+
+        if(first) {
+            for(size_t i=0, N=pvs.size(); i<N; i++) {
+                const DBRValue& cell = cur->second[i];
+                if(cell.valid() && cell->arrival.secPastEpoch!=0u)
+                    pvs[i].lag.add(epicsTimeDiffInSeconds(&cell->arrival, first));
+            }
+            if(epicsTimeDiffInSeconds(last, first) > bsasBlameLag)
+                pvs[lastcol].nBlame++;
+        }
+
+        // steal cells rather than copy
+        completed.push_back(Receiver::slices_t::value_type());
+        completed.back().first = cur->first;
+        completed.back().second.swap(cur->second);
 
         events.erase(cur);
     }
 
+    if(events.size()>4)
+        process_spill(G, events.size()-4u);
+
     if(collectorDebug>0 && events.size()>4) {
         errlogPrintf("## Overflow process_test() drop %zu after completing %zu events\n",
                      events.size(), completed.size());
@@ -325,9 +777,72 @@ void Collector::process_test()
     }
 }
 
+bool Collector::process_spill(Guard& G, size_t n)
+{
+    if(bsasSpillMB<=0 || spill_failed)
+        return false;
+
+    bool ok = true;
+    size_t nslices = 0u, nbytes = 0u;
+    {
+        // 'events' and 'spill' are only used by this thread, so copy without blocking notEmpty()
+        UnGuard U(G);
+
+        if(!spill.get()) {
+            try {
+                spill.reset(new SpillFile(size_t(bsasSpillMB)<<20u));
+            } catch(std::exception& e) {
+                errlogPrintf("Spilling disabled : %s\n", e.what());
+                spill_failed = true;
+                return false;
+            }
+        }
+
+        for(; n && !events.empty(); n--) {
+            events_t::iterator oldest(events.begin());
+            const size_t before = spill->used();
+
+            if(!spill->put(oldest->first, oldest->second)) {
+                if(collectorDebug>0)
+                    errlogPrintf("## spill full with %zu slices, %zu bytes\n", spill->size(), spill->used());
+                ok = false;
+                break;
+            }
+
+            nslices++;
+            nbytes += spill->used() - before;
+            events.erase(oldest);
+        }
+    }
+
+    nSpilled += nslices;
+    nSpillBytes += nbytes;
+    return ok;
+}
+
+// unlocked.  pvs is not modified after construction
+void Collector::process_derived()
+{
+    for(size_t i=0, N=pvs.size(); i<N; i++) {
+        if(!pvs[i].derived) continue;
+
+        try {
+            pvs[i].derived->evaluate(completed, i);
+        } catch(std::exception& e) {
+            errlogPrintf("Derived column %s error : %s\n", pvs[i].name.c_str(), e.what());
+        }
+    }
+}
+
 extern "C" {
 epicsExportAddress(double, maxEventRate);
 epicsExportAddress(double, maxEventAge);
 epicsExportAddress(int, collectorDebug);
+epicsExportAddress(double, bsasBlameLag);
+epicsExportAddress(int, bsasPredictCadence);
 epicsExportAddress(double, bsasFlushPeriod);
+epicsExportAddress(int, bsasFlushTargetRows);
+epicsExportAddress(int, bsasFlushTargetBytes);
+epicsExportAddress(double, bsasFlushMinPeriod);
+epicsExportAddress(double, bsasFlushEpoch);
 }
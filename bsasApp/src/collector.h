@@ -11,6 +11,7 @@
 #include <pv/sharedPtr.h>
 
 #include "collect_ca.h"
+#include "realtime.h"
 
 struct Receiver {
     typedef std::vector<std::pair<epicsUInt64, std::vector<DBRValue> > > slices_t;
@@ -19,6 +20,48 @@ struct Receiver {
     virtual void slices(const slices_t& s) =0;
 };
 
+struct Derived;
+struct Compressor;
+struct SpillFile;
+
+// log2 histogram of a lag.  Bin 0 is <1ms, bin b is [2^(b-1), 2^b) ms.  The last is open.
+struct LagHistogram
+{
+    enum {NBins = 12};
+    size_t bins[NBins];
+
+    LagHistogram() { clear(); }
+    void clear();
+    void add(double seconds);
+    // this - o
+    LagHistogram since(const LagHistogram& o) const;
+    size_t count() const;
+    // upper bound (in seconds) of the bin which holds the q quantile.  0 if empty.
+    // Infinity for the last bin.
+    double quantile(double q) const;
+};
+
+// Update period of one column, learned from the timestamps of successive updates.
+// eg. a PV updating on every 12th pulse.
+struct Cadence
+{
+    // key of latest update
+    epicsUInt64 last;
+    // nanoseconds.  0 until learned
+    epicsInt64 period;
+    // number of successive intervals matching period
+    unsigned lock;
+
+    Cadence() :last(0u), period(0), lock(0u) {}
+
+    // returns the number of updates skipped since the last, when locked
+    unsigned update(epicsUInt64 key);
+    bool locked() const { return lock>=3u; }
+    // false if no update with this key is expected, given the learned period.
+    // Always true until locked.
+    bool expected(epicsUInt64 key) const;
+};
+
 struct Collector
 {
     static size_t num_instances;
@@ -34,11 +77,43 @@ struct Collector
 
     epicsMutex mutex;
 
+    // NULL unless some column has the "compress" option
+    std::tr1::shared_ptr<Compressor> compressor;
+
     struct PV {
+        // column name.  PV name, or name of derived column
+        std::string name;
+        // NULL for derived column
         std::tr1::shared_ptr<Subscription> sub;
+        // NULL unless derived column.  Also NULL if expression is invalid.
+        std::tr1::shared_ptr<const Derived> derived;
         bool ready;
         bool connected;
-        PV() :ready(false), connected(false) {}
+        Cadence cadence;
+        // Accounting of lost updates.  n* counters, and l* values when last published.
+        // updates which arrived after a slice was completed without them,
+        // because cadence predicted they would not.
+        size_t nMiss, lMiss;
+        // updates skipped by the source, or dropped before reaching us, per cadence
+        size_t nSrcGap, lSrcGap;
+        // updates which arrived after their slice was completed, and were discarded
+        size_t nLate, lLate;
+        // slices completed without an expected update.
+        // Aged out, or passed over by a newer complete slice.
+        size_t nAged, lAged;
+        // slices which this column was last to complete,
+        // more than bsasBlameLag after the first column arrived
+        size_t nBlame, lBlame;
+        // lag behind the first arrival for each completed slice
+        LagHistogram lag, llag;
+        PV()
+            :ready(false), connected(false)
+            ,nMiss(0u), lMiss(0u)
+            ,nSrcGap(0u), lSrcGap(0u)
+            ,nLate(0u), lLate(0u)
+            ,nAged(0u), lAged(0u)
+            ,nBlame(0u), lBlame(0u)
+        {}
     };
     typedef std::vector<PV> pvs_t;
     pvs_t pvs;
@@ -48,6 +123,13 @@ struct Collector
     bool receivers_changed;
 
     size_t nComplete, nOverflow;
+    // pending slices written to the spill file, and bytes written.  cf. bsasSpillMB
+    size_t nSpilled, nSpillBytes;
+    // processor loop passes longer than bsasWatchdogPeriod.  Only counted when bsasRealTime
+    size_t nOverrun;
+
+    // current holdoff after delivering events, and smoothed rate of completed rows
+    double flushPeriod, rowRate;
 
     epicsEvent wakeup;
 
@@ -66,6 +148,9 @@ struct Collector
     // only for unittest code
     inline Subscription* subscription(size_t column) { return pvs[column].sub.get(); }
 
+    // holdoff which would collect the target batch size at these rates (per second)
+    static double adaptPeriod(double rowRate, double byteRate);
+
 private:
     // locals for processor thread
 
@@ -74,18 +159,50 @@ private:
 
     receivers_t receivers_shadow;
 
-    epicsTimeStamp now;
+    epicsTimeStamp now,
+                   lastFlush;
     epicsUInt64 now_key,
                 oldest_key; // oldest key sent to Receviers
+    // smoothed arrival rates, per second
+    double rowAvg, byteAvg;
+
+    LoopWatchdog watchdog;
     Receiver::slices_t completed;
+    // completed rows of the newest flush epoch, not yet delivered.  cf. bsasFlushEpoch
+    Receiver::slices_t held;
+
+    // NULL until first needed, or if disabled
+    epics::auto_ptr<SpillFile> spill;
+    bool spill_failed;
+    // move up to 'n' of the oldest pending slices to the spill file.  false if not all could be.
+    // Unlocks 'G' while copying.
+    bool process_spill(Guard& G, size_t n);
 
     void process();
-    void process_dequeue();
-    void process_test();
+    void process_dequeue(Guard& G);
+    void process_test(Guard& G);
+    void process_hold();
+    void process_derived();
+    double process_rate();
+    void process_deliver();
 
     EPICS_NOT_COPYABLE(Collector)
 };
 
+// estimate of the size of the values in one slice, as sent to clients
+size_t sliceBytes(const Receiver::slices_t::value_type& s);
+
+// flush epoch containing key.  POSIX time divided by bsasFlushEpoch.  0 when disabled.
+// Each batch delivered to Receivers holds one whole epoch.
+epicsUInt64 flushEpoch(epicsUInt64 key);
+// flush epoch of the time 'age' seconds before key.  0 when disabled.
+epicsUInt64 flushEpochBefore(epicsUInt64 key, double age);
+
 extern double bsasFlushPeriod;
+extern int bsasPredictCadence;
+extern int bsasFlushTargetRows;
+extern int bsasFlushTargetBytes;
+extern double bsasFlushMinPeriod;
+extern double bsasFlushEpoch;
 
 #endif // COLLECTOR_H
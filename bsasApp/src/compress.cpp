@@ -0,0 +1,179 @@
+
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <errlog.h>
+#include <pv/reftrack.h>
+
+#ifdef BSAS_USE_ZLIB
+#  include <zlib.h>
+#endif
+
+#include "compress.h"
+
+#include <epicsExport.h>
+
+namespace pvd = epics::pvData;
+
+// don't bother compressing smaller arrays (bytes)
+static int bsasCompressMinBytes = 1024;
+// zlib level.  1 (fastest) to 9 (smallest)
+static int bsasCompressLevel = 1;
+
+namespace {
+// when the worker falls this far behind, pass values through uncompressed
+const size_t maxQueue = 1024u;
+// and this far behind, drop new values
+const size_t dropQueue = 4u*maxQueue;
+}
+
+size_t Compressor::num_instances;
+
+bool Compressor::available()
+{
+#ifdef BSAS_USE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Compressor::pack(const pvd::shared_vector<const void>& in,
+                      pvd::shared_vector<const void>& out)
+{
+#ifdef BSAS_USE_ZLIB
+    if(in.size() < size_t(std::max(0, bsasCompressMinBytes)))
+        return false;
+
+    uLongf len = compressBound(in.size());
+    std::vector<Bytef> scratch(len);
+
+    int err = compress2(&scratch[0], &len,
+                        static_cast<const Bytef*>(in.data()), in.size(),
+                        std::max(1, std::min(9, bsasCompressLevel)));
+    if(err!=Z_OK || len >= in.size() - in.size()/8u)
+        return false; // error or saves less than 1/8th
+
+    // copy so that only the compressed size is retained
+    pvd::shared_vector<pvd::uint8> temp(len);
+    memcpy(temp.data(), &scratch[0], len);
+    out = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Compressor::unpack(const void *in, size_t inlen, void *out, size_t outlen)
+{
+#ifdef BSAS_USE_ZLIB
+    uLongf len = outlen;
+    int err = uncompress(static_cast<Bytef*>(out), &len,
+                         static_cast<const Bytef*>(in), inlen);
+    if(err!=Z_OK || len!=outlen)
+        throw std::runtime_error("Corrupt compressed value");
+#else
+    throw std::logic_error("Built without compression support");
+#endif
+}
+
+Compressor::Compressor(unsigned int prio)
+    :run(true)
+    ,worker(pvd::Thread::Config(this, &Compressor::process)
+            .name("BSA Compress")
+            .prio(prio))
+{
+    REFTRACE_INCREMENT(num_instances);
+    worker.start();
+}
+
+Compressor::~Compressor()
+{
+    REFTRACE_DECREMENT(num_instances);
+    close();
+}
+
+void Compressor::close()
+{
+    {
+        Guard G(mutex);
+        if(!run) return;
+        run = false;
+    }
+    wakeup.signal();
+    worker.exitWait();
+
+    Guard G(mutex);
+    queue.clear();
+}
+
+bool Compressor::add(Subscription *sub, DBRValue& val, bool force)
+{
+    bool wakeme;
+    {
+        Guard G(mutex);
+        if(!run) return true; // closing.  not an overflow
+        if(!force && queue.size() >= dropQueue)
+            return false;
+
+        wakeme = queue.empty();
+        queue.push_back(std::make_pair(sub, DBRValue()));
+        queue.back().second.swap(val);
+    }
+    if(wakeme)
+        wakeup.signal();
+    return true;
+}
+
+void Compressor::process()
+{
+    Guard G(mutex);
+
+    while(run) {
+        if(queue.empty()) {
+            UnGuard U(G);
+            wakeup.wait();
+            continue;
+        }
+
+        Subscription *sub = queue.front().first;
+        DBRValue val;
+        val.swap(queue.front().second);
+        queue.pop_front();
+
+        const bool behind = queue.size() > maxQueue;
+
+        UnGuard U(G);
+
+        try {
+            pvd::shared_vector<const void> packed;
+
+            if(!behind && !val->buffer.empty() && pack(val->buffer, packed)) {
+                DBRValue P(new DBRValue::Holder);
+                P->ts = val->ts;
+                P->arrival = val->arrival;
+                P->sevr = val->sevr;
+                P->stat = val->stat;
+                P->count = val->count;
+                P->packed = true;
+                P->packed_type = val->buffer.original_type();
+                P->buffer = packed;
+                P->track();
+
+                val.swap(P);
+            }
+        } catch(std::exception& e) {
+            errlogPrintf("%s : error compressing : %s\n", sub->pvname.c_str(), e.what());
+        }
+
+        sub->deliver(val);
+    }
+}
+
+extern "C" {
+epicsExportAddress(int, bsasCompressMinBytes);
+epicsExportAddress(int, bsasCompressLevel);
+}
@@ -0,0 +1,58 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <deque>
+
+#include <epicsEvent.h>
+#include <pv/thread.h>
+
+#include "collect_ca.h"
+
+/* Compression of array values while they wait in Subscription::values
+ * and Collector::events for a slice to complete.
+ *
+ * Enabled per column by adding the "compress" option to a signal list entry.
+ *  eg. "TST:IMAGE compress"
+ *
+ * Values are compressed on a worker thread, and uncompressed
+ * by DBRValue::Holder::expand() as needed by receivers.
+ */
+struct Compressor
+{
+    static size_t num_instances;
+
+    // false if built without a codec (see BSAS_ZLIB in CONFIG_SITE)
+    static bool available();
+
+    // compress 'in'.  Returns false if not worthwhile.
+    static bool pack(const epics::pvData::shared_vector<const void>& in,
+                     epics::pvData::shared_vector<const void>& out);
+    // uncompress exactly 'outlen' bytes.  throws on error.
+    static void unpack(const void *in, size_t inlen, void *out, size_t outlen);
+
+    explicit Compressor(unsigned int prio);
+    ~Compressor();
+
+    void close();
+
+    // queue for compression.  Passed to sub->deliver() when done.
+    // Returns false, dropping 'val', when too far behind.  Unless 'force', as for disconnect updates.
+    // called from CA callback
+    bool add(Subscription *sub, DBRValue& val, bool force=false);
+
+private:
+    epicsMutex mutex;
+    epicsEvent wakeup;
+    bool run;
+
+    typedef std::deque<std::pair<Subscription*, DBRValue> > queue_t;
+    queue_t queue;
+
+    epics::pvData::Thread worker;
+
+    void process();
+
+    EPICS_NOT_COPYABLE(Compressor)
+};
+
+#endif // COMPRESS_H
@@ -1,4 +1,7 @@
 
+#include <algorithm>
+#include <fstream>
+
 #include <epicsStdio.h>
 
 #include <pv/reftrack.h>
@@ -28,11 +31,52 @@ pvd::StructureConstPtr type_status(pvd::getFieldCreate()->createFieldBuilder()
                                        ->addArray("nDiscon", pvd::pvULong)
                                        ->addArray("nError", pvd::pvULong)
                                        ->addArray("nOFlow", pvd::pvULong)
+                                       ->addArray("nMiss", pvd::pvULong)
+                                       ->addArray("nSrcGap", pvd::pvULong)
+                                       ->addArray("nLate", pvd::pvULong)
+                                       ->addArray("nAged", pvd::pvULong)
+                                       ->addArray("nBlame", pvd::pvULong)
+                                       ->addArray("lag50", pvd::pvDouble)
+                                       ->addArray("lag99", pvd::pvDouble)
+                                   ->endNested()
+                                   ->addNestedStructure("clients") // subscribers to TBL
+                                       ->add("count", pvd::pvULong)
+                                       ->add("maxLag", pvd::pvULong)
+                                       ->add("nDecimated", pvd::pvULong)
+                                       ->add("nDropped", pvd::pvULong)
+                                   ->endNested()
+                                   ->addNestedStructure("flush") // adaptive holdoff
+                                       ->add("period", pvd::pvDouble)
+                                       ->add("rowRate", pvd::pvDouble)
+                                   ->endNested()
+                                   ->addNestedStructure("plugins") // in-process Receivers.  cf. bsasReceiverLoad()
+                                       ->add("count", pvd::pvULong)
+                                       ->add("nDropped", pvd::pvULong)
+                                   ->endNested()
+                                   ->addNestedStructure("spill") // pending slices moved to disk.  cf. bsasSpillMB
+                                       ->add("nSlices", pvd::pvULong)
+                                       ->add("nBytes", pvd::pvULong)
                                    ->endNested()
                                    ->add("alarm", pvd::getStandardField()->alarm())
                                    ->add("timeStamp", pvd::getStandardField()->timeStamp())
                                    ->createStructure());
 
+pvd::StructureConstPtr type_meta(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->setId("epics:nt/NTTable:1.0")
+                                 ->addArray("labels", pvd::pvString)
+                                 ->addNestedStructure("value")
+                                     ->addArray("PV", pvd::pvString)
+                                     ->addArray("units", pvd::pvString)
+                                     ->addArray("precision", pvd::pvShort)
+                                     ->addArray("displayLow", pvd::pvDouble)
+                                     ->addArray("displayHigh", pvd::pvDouble)
+                                     ->addNestedUnionArray("choices")
+                                         ->addArray("arr", pvd::pvString)
+                                     ->endNested()
+                                 ->endNested()
+                                 ->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                 ->createStructure());
+
 } // namespace
 
 size_t Coordinator::num_instances;
@@ -43,6 +87,7 @@ Coordinator::Coordinator(CAContext &ctxt, pvas::StaticProvider &provider, const
     ,prefix(prefix)
     ,pv_signals(pvas::SharedPV::buildReadOnly())
     ,pv_status(pvas::SharedPV::buildReadOnly())
+    ,pv_meta(pvas::SharedPV::buildReadOnly())
     ,handler(pvd::Thread::Config(this, &Coordinator::handle)
              .prio(epicsThreadPriorityLow)
              .autostart(false)
@@ -64,6 +109,13 @@ Coordinator::Coordinator(CAContext &ctxt, pvas::StaticProvider &provider, const
         labels.push_back("#Discon");
         labels.push_back("#Error");
         labels.push_back("#OFlow");
+        labels.push_back("#Miss");
+        labels.push_back("#SrcGap");
+        labels.push_back("#Late");
+        labels.push_back("#Aged");
+        labels.push_back("#Blame");
+        labels.push_back("Lag50");
+        labels.push_back("Lag99");
 
         pvd::PVStringArrayPtr flabel(root_status->getSubFieldT<pvd::PVStringArray>("labels"));
         flabel->replace(pvd::freeze(labels));
@@ -71,8 +123,26 @@ Coordinator::Coordinator(CAContext &ctxt, pvas::StaticProvider &provider, const
     }
     pv_status->open(*root_status, changed);
 
+    root_meta = pvd::getPVDataCreate()->createPVStructure(type_meta);
+    changed.clear();
+    {
+        pvd::shared_vector<std::string> labels;
+        labels.push_back("PV");
+        labels.push_back("units");
+        labels.push_back("precision");
+        labels.push_back("displayLow");
+        labels.push_back("displayHigh");
+        labels.push_back("choices");
+
+        pvd::PVStringArrayPtr flabel(root_meta->getSubFieldT<pvd::PVStringArray>("labels"));
+        flabel->replace(pvd::freeze(labels));
+        changed.set(flabel->getFieldOffset());
+    }
+    pv_meta->open(*root_meta, changed);
+
     provider.add(prefix+"SIG", pv_signals);
     provider.add(prefix+"STS", pv_status);
+    provider.add(prefix+"META", pv_meta);
 
     handler.start();
 }
@@ -87,8 +157,82 @@ Coordinator::~Coordinator()
     wakeup.signal();
     handler.exitWait();
 
+    // bsasd removes tables on reload
+    provider.remove(prefix+"TBL");
+    provider.remove(prefix+"SIG");
+    provider.remove(prefix+"STS");
+    provider.remove(prefix+"META");
+
+    for(size_t i=0; collector.get() && i<plugins.size(); i++)
+        collector->remove_receiver(plugins[i].get());
+
     table_receiver.reset();
     collector.reset(); // joins collector worker and cancels CA subscriptions
+
+    plugins.clear(); // joins plugin workers
+}
+
+void Coordinator::addPlugin(const std::tr1::shared_ptr<PluginReceiver>& plugin)
+{
+    {
+        Guard G(mutex);
+        plugins.push_back(plugin);
+        plugins_added.push_back(plugin);
+    }
+    wakeup.signal();
+}
+
+void Coordinator::setSignals(const Collector::names_t& names)
+{
+    {
+        Guard G(mutex);
+        signals = names;
+        signals_changed = true;
+    }
+    wakeup.signal();
+
+    pvd::PVStructurePtr root(pvd::getPVDataCreate()->createPVStructure(type_signals));
+    pvd::BitSet changed;
+
+    pvd::PVStringArrayPtr fvalue(root->getSubFieldT<pvd::PVStringArray>("value"));
+    fvalue->replace(names);
+    changed.set(fvalue->getFieldOffset());
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    root->getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch")->putFrom<pvd::int64>(now.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH);
+    root->getSubFieldT<pvd::PVScalar>("timeStamp.nanoseconds")->putFrom<pvd::int32>(now.nsec);
+    changed.set(root->getSubFieldT("timeStamp")->getFieldOffset());
+
+    pv_signals->post(*root, changed);
+}
+
+Collector::names_t Coordinator::readSignals(const std::string& filename)
+{
+    pvd::shared_vector<std::string> signals;
+
+    std::ifstream strm(filename.c_str());
+    if(!strm.is_open())
+        throw std::runtime_error("Unable to open: "+filename);
+
+    std::string line;
+    while(std::getline(strm, line)) {
+        size_t prefix = line.find_first_not_of(" \t");
+        size_t suffix = line.find_last_not_of(" \t");
+
+        if(prefix>=line.size() || prefix>suffix) {
+            continue; // blank line
+        } else if(line.at(prefix)=='#') {
+            continue; // comment
+        }
+
+        signals.push_back(line.substr(prefix, suffix-prefix+1));
+    }
+
+    if(!strm.eof())
+        throw std::runtime_error("Error processing: "+filename);
+
+    return pvd::freeze(signals);
 }
 
 void Coordinator::handle()
@@ -104,26 +248,45 @@ void Coordinator::handle()
         if(changing) {
             // handle change of PV list
             Collector::names_t temp(signals);
+            plugins_t plugs(plugins);
+            plugins_added.clear();
 
             UnGuard U(G);
 
             provider.remove(prefix+"TBL");
 
+            for(size_t i=0; collector.get() && i<plugs.size(); i++)
+                collector->remove_receiver(plugs[i].get());
+
             table_receiver.reset();
             collector.reset();
 
             collector.reset(new Collector(ctxt, temp, epicsThreadPriorityMedium+5));
             table_receiver.reset(new PVAReceiver(*collector));
 
-            provider.add(prefix+"TBL", table_receiver->pv);
+            for(size_t i=0; i<plugs.size(); i++)
+                collector->add_receiver(plugs[i].get());
+
+            provider.add(prefix+"TBL", table_receiver->builder);
             std::cerr<<"Add "<<prefix<<"TBL\n";
 
         }
 
+        if(!plugins_added.empty()) {
+            plugins_t plugs;
+            plugs.swap(plugins_added);
+
+            UnGuard U(G);
+
+            for(size_t i=0; i<plugs.size(); i++)
+                collector->add_receiver(plugs[i].get());
+        }
+
         if(expire || changing) {
             // update status table
 
             Collector::names_t pvnames(signals);
+            plugins_t plugs(plugins);
 
             {
                 UnGuard U(G);
@@ -136,10 +299,40 @@ void Coordinator::handle()
                                                 bytes(pvnames.size()),
                                                 discons(pvnames.size()),
                                                 errors(pvnames.size()),
-                                                oflows(pvnames.size());
+                                                oflows(pvnames.size()),
+                                                misses(pvnames.size()),
+                                                gaps(pvnames.size()),
+                                                lates(pvnames.size()),
+                                                ageds(pvnames.size()),
+                                                blames(pvnames.size());
+                pvd::shared_vector<double> lag50(pvnames.size()),
+                                           lag99(pvnames.size());
 
                 assert(pvnames.size()==collector->pvs.size());
 
+                {
+                    Guard G2(collector->mutex);
+                    for(size_t i=0, N=collector->pvs.size(); i<N; i++) {
+                        Collector::PV& pv = collector->pvs[i];
+                        misses[i] = pv.nMiss - pv.lMiss;
+                        gaps[i] = pv.nSrcGap - pv.lSrcGap;
+                        lates[i] = pv.nLate - pv.lLate;
+                        ageds[i] = pv.nAged - pv.lAged;
+                        blames[i] = pv.nBlame - pv.lBlame;
+
+                        LagHistogram lag(pv.lag.since(pv.llag));
+                        lag50[i] = lag.quantile(0.5);
+                        lag99[i] = lag.quantile(0.99);
+
+                        pv.lMiss = pv.nMiss;
+                        pv.lSrcGap = pv.nSrcGap;
+                        pv.lLate = pv.nLate;
+                        pv.lAged = pv.nAged;
+                        pv.lBlame = pv.nBlame;
+                        pv.llag = pv.lag;
+                    }
+                }
+
                 for(size_t i=0, N=collector->pvs.size(); i<N; i++) {
                     const Collector::PV& pv = collector->pvs[i];
                     if(!pv.sub) {
@@ -200,7 +393,93 @@ void Coordinator::handle()
                 farr->putFrom(pvd::freeze(oflows));
                 changed.set(farr->getFieldOffset());
 
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nMiss");
+                farr->putFrom(pvd::freeze(misses));
+                changed.set(farr->getFieldOffset());
+
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nSrcGap");
+                farr->putFrom(pvd::freeze(gaps));
+                changed.set(farr->getFieldOffset());
+
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nLate");
+                farr->putFrom(pvd::freeze(lates));
+                changed.set(farr->getFieldOffset());
+
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nAged");
+                farr->putFrom(pvd::freeze(ageds));
+                changed.set(farr->getFieldOffset());
+
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.nBlame");
+                farr->putFrom(pvd::freeze(blames));
+                changed.set(farr->getFieldOffset());
+
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.lag50");
+                farr->putFrom(pvd::freeze(lag50));
+                changed.set(farr->getFieldOffset());
+
+                farr = root_status->getSubFieldT<pvd::PVScalarArray>("value.lag99");
+                farr->putFrom(pvd::freeze(lag99));
+                changed.set(farr->getFieldOffset());
+
                 pvd::PVScalarPtr fscale;
+
+                {
+                    PVAReceiver::ClientStats cstats(table_receiver->clientStats());
+
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("clients.count");
+                    fscale->putFrom<pvd::uint64>(cstats.nClients);
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("clients.maxLag");
+                    fscale->putFrom<pvd::uint64>(cstats.maxLag);
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("clients.nDecimated");
+                    fscale->putFrom<pvd::uint64>(cstats.nDecimated);
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("clients.nDropped");
+                    fscale->putFrom<pvd::uint64>(cstats.nDropped);
+                    changed.set(fscale->getFieldOffset());
+                }
+
+                {
+                    size_t ndropped = 0u;
+                    for(size_t i=0; i<plugs.size(); i++) {
+                        Guard G2(plugs[i]->mutex);
+                        ndropped += plugs[i]->nDropped;
+                    }
+
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("plugins.count");
+                    fscale->putFrom<pvd::uint64>(plugs.size());
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("plugins.nDropped");
+                    fscale->putFrom<pvd::uint64>(ndropped);
+                    changed.set(fscale->getFieldOffset());
+                }
+
+                {
+                    double period, rate;
+                    size_t nspilled, nspillbytes;
+                    {
+                        Guard G2(collector->mutex);
+                        period = collector->flushPeriod;
+                        rate = collector->rowRate;
+                        nspilled = collector->nSpilled;
+                        nspillbytes = collector->nSpillBytes;
+                    }
+
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("flush.period");
+                    fscale->putFrom<double>(period);
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("flush.rowRate");
+                    fscale->putFrom<double>(rate);
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("spill.nSlices");
+                    fscale->putFrom<pvd::uint64>(nspilled);
+                    changed.set(fscale->getFieldOffset());
+                    fscale = root_status->getSubFieldT<pvd::PVScalar>("spill.nBytes");
+                    fscale->putFrom<pvd::uint64>(nspillbytes);
+                    changed.set(fscale->getFieldOffset());
+                }
+
                 fscale = root_status->getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch");
                 fscale->putFrom<pvd::uint32>(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
                 changed.set(fscale->getFieldOffset());
@@ -209,6 +488,8 @@ void Coordinator::handle()
                 changed.set(fscale->getFieldOffset());
 
                 pv_status->post(*root_status, changed);
+
+                update_meta(changing);
             }
 
         }
@@ -220,6 +501,100 @@ void Coordinator::handle()
     }
 }
 
+void Coordinator::update_meta(bool force)
+{
+    const size_t N = collector->pvs.size();
+
+    pvd::shared_vector<std::string> names(N), units(N);
+    pvd::shared_vector<pvd::int16> precs(N);
+    pvd::shared_vector<double> lows(N), highs(N);
+    std::vector<pvd::shared_vector<const std::string> > choices(N);
+
+    bool changed = force;
+
+    for(size_t i=0; i<N; i++) {
+        const Collector::PV& pv = collector->pvs[i];
+        names[i] = pv.name;
+        if(!pv.sub) continue;
+
+        Subscription& sub = *pv.sub;
+
+        Guard G(sub.mutex);
+
+        changed |= sub.meta_changed;
+        sub.meta_changed = false;
+
+        units[i] = sub.meta.units;
+        precs[i] = sub.meta.precision;
+        lows[i] = sub.meta.displayLow;
+        highs[i] = sub.meta.displayHigh;
+        if(!sub.meta.choices.empty()) {
+            pvd::shared_vector<std::string> temp(sub.meta.choices.size());
+            std::copy(sub.meta.choices.begin(), sub.meta.choices.end(), temp.begin());
+            choices[i] = pvd::freeze(temp);
+        }
+    }
+
+    if(!changed) return; // only post on change
+
+    pvd::PVDataCreatePtr create(pvd::getPVDataCreate());
+
+    pvd::PVUnionArrayPtr fchoices(root_meta->getSubFieldT<pvd::PVUnionArray>("value.choices"));
+    pvd::UnionConstPtr utype(std::tr1::static_pointer_cast<const pvd::UnionArray>(fchoices->getArray())->getUnion());
+    pvd::ScalarArrayConstPtr arrtype(utype->getField<pvd::ScalarArray>(0));
+
+    pvd::PVUnionArray::svector cells(N); // NULL for PVs w/o enum strings
+    for(size_t i=0; i<N; i++) {
+        if(choices[i].empty()) continue;
+
+        pvd::PVScalarArrayPtr arr(create->createPVScalarArray(arrtype));
+        arr->putFrom(choices[i]);
+
+        pvd::PVUnionPtr U(create->createPVUnion(utype));
+        U->set(0, arr);
+        cells[i] = U;
+    }
+
+    pvd::BitSet bits;
+    pvd::PVScalarArrayPtr farr;
+
+    farr = root_meta->getSubFieldT<pvd::PVScalarArray>("value.PV");
+    farr->putFrom(pvd::freeze(names));
+    bits.set(farr->getFieldOffset());
+
+    farr = root_meta->getSubFieldT<pvd::PVScalarArray>("value.units");
+    farr->putFrom(pvd::freeze(units));
+    bits.set(farr->getFieldOffset());
+
+    farr = root_meta->getSubFieldT<pvd::PVScalarArray>("value.precision");
+    farr->putFrom(pvd::freeze(precs));
+    bits.set(farr->getFieldOffset());
+
+    farr = root_meta->getSubFieldT<pvd::PVScalarArray>("value.displayLow");
+    farr->putFrom(pvd::freeze(lows));
+    bits.set(farr->getFieldOffset());
+
+    farr = root_meta->getSubFieldT<pvd::PVScalarArray>("value.displayHigh");
+    farr->putFrom(pvd::freeze(highs));
+    bits.set(farr->getFieldOffset());
+
+    fchoices->replace(pvd::freeze(cells));
+    bits.set(fchoices->getFieldOffset());
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    pvd::PVScalarPtr fscale;
+    fscale = root_meta->getSubFieldT<pvd::PVScalar>("timeStamp.secondsPastEpoch");
+    fscale->putFrom<pvd::uint32>(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    bits.set(fscale->getFieldOffset());
+    fscale = root_meta->getSubFieldT<pvd::PVScalar>("timeStamp.nanoseconds");
+    fscale->putFrom<pvd::uint32>(now.nsec);
+    bits.set(fscale->getFieldOffset());
+
+    pv_meta->post(*root_meta, bits);
+}
+
 void Coordinator::SignalsHandler::onPut(const pvas::SharedPV::shared_pointer& pv, pvas::Operation& op)
 {
     pvd::PVStringArray::const_shared_pointer value(op.value().getSubFieldT<pvd::PVStringArray>("value"));
@@ -228,14 +603,9 @@ void Coordinator::SignalsHandler::onPut(const pvas::SharedPV::shared_pointer& pv
 
     std::tr1::shared_ptr<Coordinator> self(coordinator.lock());
     if(self) {
-        {
-            Guard G(self->mutex);
-            self->signals = value->view();
-            self->signals_changed = true;
-        }
-        self->wakeup.signal();
+        self->setSignals(value->view()); // also posts
+    } else {
+        pv->post(op.value(), op.changed());
     }
-
-    pv->post(op.value(), op.changed());
     op.complete();
 }
@@ -3,6 +3,7 @@
 
 #include "coordinator.h"
 #include "receiver_pva.h"
+#include "plugin.h"
 
 struct Coordinator
 {
@@ -20,10 +21,17 @@ struct Coordinator
     epics::auto_ptr<Collector> collector;
     epics::auto_ptr<PVAReceiver> table_receiver;
 
+    // attached to each new Collector.  Guarded by mutex
+    typedef std::vector<std::tr1::shared_ptr<PluginReceiver> > plugins_t;
+    plugins_t plugins,
+              plugins_added; // not yet attached to current Collector
+
     pvas::SharedPV::shared_pointer pv_signals,
-                                   pv_status;
+                                   pv_status,
+                                   pv_meta;
 
-    epics::pvData::PVStructurePtr root_status;
+    epics::pvData::PVStructurePtr root_status,
+                                  root_meta;
 
     epics::pvData::Thread handler;
 
@@ -34,7 +42,18 @@ struct Coordinator
     bool running;
     epicsEvent wakeup;
 
+    void addPlugin(const std::tr1::shared_ptr<PluginReceiver>& plugin);
+
+    // replace the signal list, as a put to SIG would
+    void setSignals(const Collector::names_t& names);
+
+    // read a signal list file.  One entry per line.  Blank lines and '#' comments are skipped.
+    // throws std::runtime_error
+    static Collector::names_t readSignals(const std::string& filename);
+
     void handle();
+    // post META if any Subscription::meta has changed (or force)
+    void update_meta(bool force);
 
     struct SignalsHandler : public pvas::SharedPV::Handler {
         const std::tr1::weak_ptr<Coordinator> coordinator;
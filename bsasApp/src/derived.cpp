@@ -0,0 +1,369 @@
+
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <math.h>
+#include <ctype.h>
+
+#include <epicsStdlib.h>
+#include <epicsMath.h>
+
+#include "derived.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+// numeric scalar to double.  false for other types
+bool toDouble(const pvd::shared_vector<const void>& buf, double& out)
+{
+    if(buf.empty())
+        return false;
+
+    const void *P = buf.data();
+    switch(buf.original_type()) {
+#define CASE(TYPE, CTYPE) case pvd::TYPE: out = *static_cast<const CTYPE*>(P); break
+    CASE(pvDouble, double);
+    CASE(pvFloat, float);
+    CASE(pvByte, pvd::int8);
+    CASE(pvUByte, pvd::uint8);
+    CASE(pvShort, pvd::int16);
+    CASE(pvUShort, pvd::uint16);
+    CASE(pvInt, pvd::int32);
+    CASE(pvUInt, pvd::uint32);
+    CASE(pvLong, pvd::int64);
+    CASE(pvULong, pvd::uint64);
+#undef CASE
+    default:
+        return false; // string or boolean
+    }
+    return true;
+}
+
+} // namespace
+
+bool Derived::split(const std::string& entry, std::string& name, std::string& expr)
+{
+    size_t sep = entry.find('=');
+    if(sep==std::string::npos)
+        return false;
+
+    name = entry.substr(0, sep);
+    expr = entry.substr(sep+1);
+
+    // trim
+    size_t end = name.find_last_not_of(" \t");
+    name = end==std::string::npos ? std::string() : name.substr(0, end+1);
+    size_t start = name.find_first_not_of(" \t");
+    if(start!=std::string::npos)
+        name = name.substr(start);
+
+    if(name.empty())
+        throw std::runtime_error("Derived column without name: \""+entry+"\"");
+    return true;
+}
+
+// recursive descent, emitting prog in RPN order
+struct Derived::Parser
+{
+    Derived& self;
+    const std::vector<std::string>& names;
+    const char * const begin;
+    const char *pos;
+    size_t cur_depth;
+
+    Parser(Derived& self, const std::vector<std::string>& names)
+        :self(self)
+        ,names(names)
+        ,begin(self.expr.c_str())
+        ,pos(begin)
+        ,cur_depth(0u)
+    {}
+
+    void fail(const char *msg)
+    {
+        std::ostringstream strm;
+        strm<<msg<<" at position "<<(pos-begin)<<" of \""<<self.expr<<"\"";
+        throw std::runtime_error(strm.str());
+    }
+
+    void skip()
+    {
+        while(*pos==' ' || *pos=='\t')
+            pos++;
+    }
+
+    bool accept(char c)
+    {
+        skip();
+        if(*pos!=c)
+            return false;
+        pos++;
+        return true;
+    }
+
+    void expect(char c, const char *msg)
+    {
+        if(!accept(c))
+            fail(msg);
+    }
+
+    void emit(op_t op, double val =0.0, size_t idx =0u)
+    {
+        Op O;
+        O.op = op;
+        O.val = val;
+        O.idx = idx;
+        self.prog.push_back(O);
+
+        switch(op) {
+        case Const:
+        case Input:
+            cur_depth++;
+            break;
+        case Add: case Sub: case Mul: case Div: case Pow:
+        case Min: case Max:
+            cur_depth--; // pop 2, push 1
+            break;
+        default:
+            break; // unary
+        }
+        self.depth = std::max(self.depth, cur_depth);
+    }
+
+    void parse()
+    {
+        expression();
+        skip();
+        if(*pos!='\0')
+            fail("Unexpected trailing characters");
+        if(self.prog.empty())
+            fail("Empty expression");
+    }
+
+    void expression()
+    {
+        term();
+        while(true) {
+            if(accept('+')) {
+                term();
+                emit(Add);
+            } else if(accept('-')) {
+                term();
+                emit(Sub);
+            } else {
+                break;
+            }
+        }
+    }
+
+    void term()
+    {
+        unary();
+        while(true) {
+            if(accept('*')) {
+                unary();
+                emit(Mul);
+            } else if(accept('/')) {
+                unary();
+                emit(Div);
+            } else {
+                break;
+            }
+        }
+    }
+
+    void unary()
+    {
+        if(accept('-')) {
+            unary();
+            emit(Neg);
+        } else if(accept('+')) {
+            unary();
+        } else {
+            power();
+        }
+    }
+
+    void power()
+    {
+        primary();
+        if(accept('^')) {
+            unary(); // right associative
+            emit(Pow);
+        }
+    }
+
+    void primary()
+    {
+        skip();
+
+        if(accept('(')) {
+            expression();
+            expect(')', "Expected ')'");
+
+        } else if(accept('{')) {
+            const char *start = pos;
+            while(*pos!='\0' && *pos!='}')
+                pos++;
+            std::string name(start, pos-start);
+            expect('}', "Expected '}'");
+
+            std::vector<std::string>::const_iterator it(std::find(names.begin(), names.end(), name));
+            if(it==names.end())
+                fail(("Unknown column '"+name+"'").c_str());
+
+            size_t idx = it-names.begin();
+            emit(Input, 0.0, idx);
+            if(std::find(self.inputs.begin(), self.inputs.end(), idx)==self.inputs.end())
+                self.inputs.push_back(idx);
+
+        } else if(isdigit(*pos) || *pos=='.') {
+            char *end = 0;
+            double val = epicsStrtod(pos, &end);
+            if(end==pos)
+                fail("Invalid number");
+            pos = end;
+            emit(Const, val);
+
+        } else if(isalpha(*pos)) {
+            const char *start = pos;
+            while(isalnum(*pos))
+                pos++;
+            std::string fn(start, pos-start);
+
+            op_t op;
+            bool binary = false;
+            if(fn=="abs") op = Abs;
+            else if(fn=="sqrt") op = Sqrt;
+            else if(fn=="exp") op = Exp;
+            else if(fn=="log") op = Log;
+            else if(fn=="min") { op = Min; binary = true; }
+            else if(fn=="max") { op = Max; binary = true; }
+            else {
+                pos = start;
+                fail(("Unknown function '"+fn+"'").c_str());
+                return;
+            }
+
+            expect('(', "Expected '('");
+            expression();
+            if(binary) {
+                expect(',', "Expected ','");
+                expression();
+            }
+            expect(')', "Expected ')'");
+            emit(op);
+
+        } else {
+            fail("Unexpected character");
+        }
+    }
+};
+
+Derived::Derived(const std::string& expr, const std::vector<std::string>& names)
+    :expr(expr)
+    ,depth(0u)
+{
+    Parser P(*this, names);
+    P.parse();
+}
+
+void Derived::evaluate(Receiver::slices_t& s, size_t out) const
+{
+    const size_t R = s.size();
+    if(R==0u)
+        return;
+
+    // max. severity of inputs, or 4 if any input is missing
+    std::vector<epicsUInt16> sevr(R, 0u), stat(R, 0u);
+
+    // each stack entry holds one value per row
+    std::vector<std::vector<double> > stack(depth, std::vector<double>(R));
+    size_t top = 0u;
+
+    for(size_t p=0, P=prog.size(); p<P; p++) {
+        const Op& op = prog[p];
+
+        switch(op.op) {
+        case Const:
+            std::fill(stack[top].begin(), stack[top].end(), op.val);
+            top++;
+            continue;
+
+        case Input: {
+            std::vector<double>& V = stack[top++];
+
+            for(size_t r=0; r<R; r++) {
+                const DBRValue& cell = s[r].second.at(op.idx);
+
+                if(!cell.valid() || cell->sevr > 3 || cell->count!=1 || !toDouble(cell->buffer, V[r])) {
+                    sevr[r] = 4;
+                    V[r] = epicsNAN;
+
+                } else if(cell->sevr > sevr[r]) {
+                    sevr[r] = cell->sevr;
+                    stat[r] = cell->stat;
+                }
+            }
+        }
+            continue;
+
+        default:
+            break;
+        }
+
+        // unary ops modify top in place.  binary ops combine top into top-1
+        double * const A = &stack[top-1][0];
+        double * const B = top>=2u ? &stack[top-2][0] : 0;
+
+        switch(op.op) {
+        case Neg:  for(size_t r=0; r<R; r++) A[r] = -A[r]; break;
+        case Abs:  for(size_t r=0; r<R; r++) A[r] = fabs(A[r]); break;
+        case Sqrt: for(size_t r=0; r<R; r++) A[r] = sqrt(A[r]); break;
+        case Exp:  for(size_t r=0; r<R; r++) A[r] = exp(A[r]); break;
+        case Log:  for(size_t r=0; r<R; r++) A[r] = log(A[r]); break;
+        case Add:  for(size_t r=0; r<R; r++) B[r] += A[r]; break;
+        case Sub:  for(size_t r=0; r<R; r++) B[r] -= A[r]; break;
+        case Mul:  for(size_t r=0; r<R; r++) B[r] *= A[r]; break;
+        case Div:  for(size_t r=0; r<R; r++) B[r] /= A[r]; break;
+        case Pow:  for(size_t r=0; r<R; r++) B[r] = pow(B[r], A[r]); break;
+        case Min:  for(size_t r=0; r<R; r++) B[r] = std::min(B[r], A[r]); break;
+        case Max:  for(size_t r=0; r<R; r++) B[r] = std::max(B[r], A[r]); break;
+        default:
+            throw std::logic_error("Derived::evaluate() unknown op");
+        }
+
+        switch(op.op) {
+        case Add: case Sub: case Mul: case Div: case Pow:
+        case Min: case Max:
+            top--;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if(top!=1u)
+        throw std::logic_error("Derived::evaluate() stack imbalance");
+
+    const std::vector<double>& result = stack[0];
+
+    for(size_t r=0; r<R; r++) {
+        if(sevr[r] > 3)
+            continue; // leave missing
+
+        DBRValue V(new DBRValue::Holder);
+        V->sevr = sevr[r];
+        V->stat = stat[r];
+        V->ts.secPastEpoch = s[r].first>>32;
+        V->ts.nsec = epicsUInt32(s[r].first);
+        V->count = 1u;
+
+        pvd::shared_vector<double> temp(1, result[r]);
+        V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+
+        s[r].second.at(out).swap(V);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef DERIVED_H
+#define DERIVED_H
+
+#include <string>
+#include <vector>
+
+#include "collector.h"
+
+/* A column computed from other columns of each completed slice.
+ *
+ * Declared in the signal list as "NAME=EXPR" where EXPR references
+ * other columns as {PVNAME}.  eg.
+ *
+ *   XDIFF={BPM1:X}-{BPM2:X}
+ *   QSUM=0.5*({TORO1:Q}+{TORO2:Q})
+ *
+ * Supports + - * / ^ , unary -, parenthesis, and the functions
+ * abs(), sqrt(), exp(), log(), min(,) and max(,)
+ */
+struct Derived
+{
+    // split "NAME=EXPR".  returns false if not a derived column
+    static bool split(const std::string& entry, std::string& name, std::string& expr);
+
+    // compile expression.  Column names resolved against 'names'.
+    // throws std::runtime_error on syntax error or unknown column.
+    Derived(const std::string& expr, const std::vector<std::string>& names);
+
+    const std::string expr;
+
+    enum op_t {
+        Const, Input,
+        Add, Sub, Mul, Div, Pow, Neg,
+        Abs, Sqrt, Exp, Log, Min, Max,
+    };
+    struct Op {
+        op_t op;
+        double val; // Const
+        size_t idx; // Input
+    };
+    // program in reverse polish order
+    std::vector<Op> prog;
+    // column indices referenced
+    std::vector<size_t> inputs;
+    // max. stack depth of prog
+    size_t depth;
+
+    /* Evaluate for all rows of 's', storing result in column 'out'.
+     * A row has a result only when all inputs are valid scalars, not disconnected.
+     * Result severity is the max. of input severities.
+     */
+    void evaluate(Receiver::slices_t& s, size_t out) const;
+
+private:
+    struct Parser;
+};
+
+#endif // DERIVED_H
@@ -1,11 +1,11 @@
 
-#include <fstream>
 
 #include <initHooks.h>
 #include <iocsh.h>
 #include <epicsExit.h>
 #include <drvSup.h>
 #include <epicsStdio.h>
+#include <epicsAtomic.h>
 
 #include <pv/pvAccess.h>
 #include <pva/client.h>
@@ -15,6 +15,8 @@
 #include "collector.h"
 #include "receiver_pva.h"
 #include "coordinator.h"
+#include "compress.h"
+#include "plugin.h"
 
 #include <epicsExport.h>
 
@@ -31,6 +33,9 @@ coordinators_t coordinators;
 
 pvas::StaticProvider::shared_pointer provider;
 
+// plugins loaded before iocInit(), by table prefix
+std::map<std::string, Coordinator::plugins_t> early_plugins;
+
 bool locked;
 
 void bsasExit(void *)
@@ -41,6 +46,7 @@ void bsasExit(void *)
     provider->close(true); // disconnect any PVA clients
 
     coordinators.clear(); // joins workers, cancels CA subscriptions
+    early_plugins.clear();
 
     provider.reset(); // server may still be holding a ref., but drop this one anyway
 
@@ -62,18 +68,26 @@ void bsasHook(initHookState state)
         std::tr1::shared_ptr<Coordinator::SignalsHandler> H(new Coordinator::SignalsHandler(C));
         C->pv_signals->setHandler(H);
         it->second = C;
+
+        Coordinator::plugins_t& plugs = early_plugins[it->first];
+        for(size_t i=0; i<plugs.size(); i++)
+            C->addPlugin(plugs[i]);
     }
+    early_plugins.clear();
 }
 
 void bsas_report(int lvl)
 {
     try {
         /* lvl<=0 shows only table names
-         * lvl==1 shows only PV w/ overflows
-         * lvl==2 shows only PV w/ overflows or disconnected
+         * lvl==1 shows only PV w/ overflows or blame
+         * lvl==2 shows only PV w/ overflows, blame, or disconnected
          * lvl>=3 shows all
          *
          */
+        epicsStdoutPrintf("Retained values %.1f MB\n",
+                          epicsAtomicGetSizeT(&DBRValue::Holder::num_bytes)/1048576.0);
+
         for(coordinators_t::const_iterator it(coordinators.begin()), end(coordinators.end()); it!=end; ++it) {
             epicsStdoutPrintf("Table %s\n", it->first.c_str());
 
@@ -82,7 +96,21 @@ void bsas_report(int lvl)
             Guard G(coord->mutex);
             if(!coord.get()) continue;
 
-            epicsStdoutPrintf("    Overflows=%zu Complete=%zu\n", coord->collector->nOverflow, coord->collector->nComplete);
+            epicsStdoutPrintf("    Overflows=%zu Complete=%zu Overruns=%zu\n",
+                              coord->collector->nOverflow, coord->collector->nComplete, coord->collector->nOverrun);
+            if(coord->collector->nSpilled)
+                epicsStdoutPrintf("    Spilled=%zu slices, %.1f MB\n",
+                                  coord->collector->nSpilled, coord->collector->nSpillBytes/1048576.0);
+            for(size_t i=0, N=coord->plugins.size(); i<N; i++) {
+                PluginReceiver* plug = coord->plugins[i].get();
+                size_t ndropped;
+                {
+                    Guard G2(plug->mutex); // mutex order: Coordinator::mutex -> PluginReceiver::mutex
+                    ndropped = plug->nDropped;
+                }
+                if(ndropped || lvl>=1)
+                    epicsStdoutPrintf("    Plugin %s Dropped=%zu batches\n", plug->name.c_str(), ndropped);
+            }
             if(lvl<1) continue;
 
             // holding Coordinator::mutex prevents signal list change.
@@ -92,9 +120,18 @@ void bsas_report(int lvl)
 
                 const Subscription* sub = coord->collector->pvs[i].sub.get();
 
+                size_t nBlame, nAged;
+                LagHistogram lag;
+                {
+                    Guard G3(coord->collector->mutex); // mutex order: Coordinator::mutex -> Collector::mutex
+                    nBlame = coord->collector->pvs[i].nBlame;
+                    nAged = coord->collector->pvs[i].nAged;
+                    lag = coord->collector->pvs[i].lag;
+                }
+
                 Guard G2(sub->mutex); // mutex order: Coordinator::mutex -> Subscription::mutex
 
-                if(lvl<2 && sub->nOverflows==0) continue;
+                if(lvl<2 && sub->nOverflows==0 && nBlame==0) continue;
                 if(lvl<3 && !sub->connected) continue;
 
                 epicsStdoutPrintf("  %s\t %zu/%zu conn=%c #dis=%zu #err=%zu #up=%zu #MB=%.1f #oflow=%zu\n",
@@ -107,9 +144,51 @@ void bsas_report(int lvl)
                                   sub->nUpdates,
                                   sub->nUpdateBytes/1048576.0,
                                   sub->nOverflows);
+                if(nBlame || nAged || lvl>=3) {
+                    epicsStdoutPrintf("  %s\t #blame=%zu #aged=%zu lag50=%.3f lag99=%.3f sec\n",
+                                      sub->pvname.c_str(),
+                                      nBlame, nAged,
+                                      lag.quantile(0.5), lag.quantile(0.99));
+                }
+                if(sub->nPackedIn) {
+                    epicsStdoutPrintf("  %s\t compressed %.1f -> %.1f MB\n",
+                                      sub->pvname.c_str(),
+                                      sub->nPackedIn/1048576.0,
+                                      sub->nPackedOut/1048576.0);
+                }
             }
         }
 
+        if(lvl<1 || !cactxt) return;
+
+        // lvl<3 shows only servers which have been, or are, down
+        std::vector<std::tr1::shared_ptr<const HostGroup> > groups;
+        cactxt->groups(groups);
+        epicsStdoutPrintf("CA servers %zu\n", groups.size());
+
+        for(size_t i=0; i<groups.size(); i++) {
+            const HostGroup& grp = *groups[i];
+            Guard G(grp.mutex);
+
+            const bool up = grp.nConnected==grp.nChannels;
+            if(lvl<3 && up && !grp.nDown) continue;
+
+            epicsStdoutPrintf("  %s\t %s %zu/%zu #down=%zu\n",
+                              grp.host.c_str(),
+                              up ? "UP" : grp.nConnected ? "PARTIAL" : "DOWN",
+                              grp.nConnected, grp.nChannels, grp.nDown);
+            if(!grp.nDown) continue;
+
+            char buf[40];
+            epicsTimeToStrftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S.%03f", &grp.downAt);
+            epicsStdoutPrintf("  %s\t last down %s lost=%zu", grp.host.c_str(), buf, grp.nLost);
+            if(!epicsTimeLessThan(&grp.upAt, &grp.downAt))
+                epicsStdoutPrintf(" first up after %.3f", epicsTimeDiffInSeconds(&grp.upAt, &grp.downAt));
+            if(!epicsTimeLessThan(&grp.restoredAt, &grp.downAt))
+                epicsStdoutPrintf(" all up after %.3f", epicsTimeDiffInSeconds(&grp.restoredAt, &grp.downAt));
+            epicsStdoutPrintf(" sec\n");
+        }
+
     }catch(std::exception& e) {
         fprintf(stderr, "Error: %s\n", e.what());
     }
@@ -163,6 +242,29 @@ void bsasStatReset(const char *name)
             coord->collector->nOverflow = 0u;
             coord->collector->nComplete = 0u;
 
+            {
+                Guard G3(coord->collector->mutex);
+                coord->collector->nOverrun = 0u;
+                coord->collector->nSpilled = 0u;
+                coord->collector->nSpillBytes = 0u;
+
+                for(size_t i=0, N=coord->collector->pvs.size(); i<N; i++) {
+                    Collector::PV& pv = coord->collector->pvs[i];
+                    pv.nMiss = pv.lMiss = 0u;
+                    pv.nSrcGap = pv.lSrcGap = 0u;
+                    pv.nLate = pv.lLate = 0u;
+                    pv.nAged = pv.lAged = 0u;
+                    pv.nBlame = pv.lBlame = 0u;
+                    pv.lag.clear();
+                    pv.llag.clear();
+                }
+            }
+
+            for(size_t i=0, N=coord->plugins.size(); i<N; i++) {
+                Guard G2(coord->plugins[i]->mutex); // mutex order: Coordinator::mutex -> PluginReceiver::mutex
+                coord->plugins[i]->nDropped = 0u;
+            }
+
             for(size_t i=0, N=coord->collector->pvs.size(); i<N; i++) {
                 if(!coord->collector->pvs[i].sub) continue;
 
@@ -175,6 +277,7 @@ void bsasStatReset(const char *name)
                 sub->nUpdates = sub->lUpdates = 0u;
                 sub->nUpdateBytes = sub->lUpdateBytes = 0u;
                 sub->nOverflows = sub->lOverflows = 0u;
+                sub->nPackedIn = sub->nPackedOut = 0u;
             }
         }
 
@@ -197,40 +300,13 @@ extern "C"
 void bsasTableSet(const char *name, const char *filename)
 {
     try {
-        pvd::shared_vector<std::string> signals;
-        {
-            std::ifstream strm(filename);
-
-            if(!strm.is_open()) {
-                fprintf(stderr, "Unable to open: %s\n", filename);
-                return;
-            }
-
-            std::string line;
-            while(std::getline(strm, line)) {
-                size_t prefix = line.find_first_not_of(" \t");
-                size_t suffix = line.find_last_not_of(" \t");
-
-                if(prefix>=line.size() || prefix>suffix) {
-                    continue; // blank line
-                } else if(line.at(prefix)=='#') {
-                    continue; // comment
-                }
-
-                signals.push_back(line.substr(prefix, suffix-prefix+1));
-            }
-
-            if(!strm.eof()) {
-                fprintf(stderr, "Error processing: %s\n", filename);
-                return;
-            }
-        }
+        Collector::names_t signals(Coordinator::readSignals(filename));
 
         pvac::ClientProvider ctxt("server:bsas");
 
         ctxt.connect(name)
             .put()
-            .set("value", pvd::freeze(signals))
+            .set("value", signals)
             .exec();
 
     }catch(std::exception& e) {
@@ -249,14 +325,56 @@ static void bsasTableSetCallFunc(const iocshArgBuf *args)
     bsasTableSet(args[0].sval, args[1].sval);
 }
 
+extern "C"
+void bsasReceiverLoad(const char *prefix, const char *lib, const char *args)
+{
+    try {
+        if(!prefix || !lib) {
+            fprintf(stderr, "Usage: bsasReceiverLoad <prefix> <library> [args]\n");
+            return;
+        }
+
+        coordinators_t::iterator it(coordinators.find(prefix));
+        if(it==coordinators.end()) {
+            fprintf(stderr, "No table %s.  Call bsasTableAdd() first\n", prefix);
+            return;
+        }
+
+        std::tr1::shared_ptr<PluginReceiver> plugin(loadReceiverPlugin(prefix, lib, args ? args : ""));
+
+        if(it->second)
+            it->second->addPlugin(plugin);
+        else
+            early_plugins[prefix].push_back(plugin); // attached after iocInit()
+
+    }catch(std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+    }
+}
+
+/* bsasReceiverLoad */
+static const iocshArg bsasReceiverLoadArg0 = { "prefix", iocshArgString};
+static const iocshArg bsasReceiverLoadArg1 = { "library", iocshArgString};
+static const iocshArg bsasReceiverLoadArg2 = { "args", iocshArgString};
+static const iocshArg * const bsasReceiverLoadArgs[] = {&bsasReceiverLoadArg0, &bsasReceiverLoadArg1, &bsasReceiverLoadArg2};
+static const iocshFuncDef bsasReceiverLoadFuncDef = {
+    "bsasReceiverLoad",3,bsasReceiverLoadArgs};
+static void bsasReceiverLoadCallFunc(const iocshArgBuf *args)
+{
+    bsasReceiverLoad(args[0].sval, args[1].sval, args[2].sval);
+}
+
 static void bsasRegistrar()
 {
     epics::registerRefCounter("DBRValue", &DBRValue::Holder::num_instances);
+    epics::registerRefCounter("DBRValue bytes", &DBRValue::Holder::num_bytes);
+    epics::registerRefCounter("Compressor", &Compressor::num_instances);
     epics::registerRefCounter("CAContext", &CAContext::num_instances);
     epics::registerRefCounter("Subscription", &Subscription::num_instances);
     epics::registerRefCounter("Collector", &Collector::num_instances);
     epics::registerRefCounter("Coordinator", &Coordinator::num_instances);
     epics::registerRefCounter("PVAReceiver", &PVAReceiver::num_instances);
+    epics::registerRefCounter("PluginReceiver", &PluginReceiver::num_instances);
 
     // register our (empty) provider before the PVA server is started
 
@@ -267,6 +385,7 @@ static void bsasRegistrar()
     iocshRegister(&bsasTableAddFuncDef, bsasTableAddCallFunc);
     iocshRegister(&bsasStatResetFuncDef, bsasStatResetCallFunc);
     iocshRegister(&bsasTableSetFuncDef, bsasTableSetCallFunc);
+    iocshRegister(&bsasReceiverLoadFuncDef, bsasReceiverLoadCallFunc);
     initHookRegister(&bsasHook);
 }
 
@@ -0,0 +1,176 @@
+
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+
+#include <errlog.h>
+#include <epicsFindSymbol.h>
+#include <pv/reftrack.h>
+
+#include "plugin.h"
+
+#include <epicsExport.h>
+
+namespace pvd = epics::pvData;
+
+// limit on batches queued for each plugin Receiver
+static int bsasPluginQueue = 4;
+
+namespace {
+
+epicsMutex pluginLock;
+// factories registered by the library currently being loaded
+std::vector<bsasReceiverFactory> registered;
+// library name -> factory
+typedef std::map<std::string, bsasReceiverFactory> loaded_t;
+loaded_t loaded;
+
+} // namespace
+
+void bsasReceiverRegister(int abi, bsasReceiverFactory factory)
+{
+    if(abi!=BSAS_PLUGIN_ABI) {
+        errlogPrintf("Ignoring bsas plugin built for ABI %d, not %d.  Rebuild.\n", abi, BSAS_PLUGIN_ABI);
+        return;
+    }
+    Guard G(pluginLock); // recursive.  Already held by loadReceiverPlugin()
+    registered.push_back(factory);
+}
+
+PluginReceiver* loadReceiverPlugin(const std::string& table, const std::string& lib, const std::string& args)
+{
+    bsasReceiverFactory factory;
+    {
+        Guard G(pluginLock);
+
+        loaded_t::iterator it(loaded.find(lib));
+        if(it==loaded.end()) {
+            registered.clear();
+
+            if(!epicsLoadLibrary(lib.c_str())) {
+                const char *err = epicsLoadError();
+                throw std::runtime_error(lib+" : "+(err ? err : "unable to load"));
+            }
+
+            if(registered.size()!=1u)
+                throw std::runtime_error(lib+" : must register one factory with BSAS_RECEIVER_PLUGIN()");
+
+            it = loaded.insert(std::make_pair(lib, registered[0])).first;
+            registered.clear();
+        }
+        factory = it->second;
+    }
+
+    epics::auto_ptr<Receiver> R((*factory)(table.c_str(), args.c_str()));
+    if(!R.get())
+        throw std::runtime_error(lib+" : factory failed for "+table);
+
+    return new PluginReceiver(R.release(), lib);
+}
+
+size_t PluginReceiver::num_instances;
+
+PluginReceiver::PluginReceiver(Receiver *inner, const std::string &name)
+    :name(name)
+    ,nDropped(0u)
+    ,inner(inner)
+    ,nbatches(0u)
+    ,running(true)
+    ,worker(pvd::Thread::Config(this, &PluginReceiver::run)
+            .prio(epicsThreadPriorityMedium)
+            <<"BSAS "<<name)
+{
+    REFTRACE_INCREMENT(num_instances);
+}
+
+PluginReceiver::~PluginReceiver()
+{
+    REFTRACE_DECREMENT(num_instances);
+    close();
+}
+
+void PluginReceiver::close()
+{
+    {
+        Guard G(mutex);
+        if(!running)
+            return;
+        running = false;
+    }
+    wakeup.signal();
+    worker.exitWait();
+}
+
+void PluginReceiver::names(const std::vector<std::string>& n)
+{
+    {
+        Guard G(mutex);
+        queue.push_back(Item());
+        queue.back().isnames = true;
+        queue.back().names = n;
+    }
+    wakeup.signal();
+}
+
+void PluginReceiver::slices(const slices_t& s)
+{
+    {
+        Guard G(mutex);
+
+        while(nbatches >= size_t(std::max(1, bsasPluginQueue))) {
+            // drop oldest batch.  Keep column list changes
+            for(std::deque<Item>::iterator it(queue.begin()), end(queue.end()); it!=end; ++it) {
+                if(!it->isnames) {
+                    queue.erase(it);
+                    break;
+                }
+            }
+            nbatches--;
+            nDropped++;
+        }
+
+        queue.push_back(Item());
+        queue.back().isnames = false;
+        queue.back().slices = s; // shares values
+        nbatches++;
+    }
+    wakeup.signal();
+}
+
+void PluginReceiver::run()
+{
+    Guard G(mutex);
+
+    while(true) {
+        if(queue.empty()) {
+            if(!running)
+                break;
+            UnGuard U(G);
+            wakeup.wait();
+            continue;
+        }
+
+        Item item;
+        item.isnames = queue.front().isnames;
+        item.names.swap(queue.front().names);
+        item.slices.swap(queue.front().slices);
+        queue.pop_front();
+        if(!item.isnames)
+            nbatches--;
+
+        UnGuard U(G);
+
+        try {
+            if(item.isnames)
+                inner->names(item.names);
+            else
+                inner->slices(item.slices);
+        } catch(std::exception& e) {
+            errlogPrintf("%s : error %s\n", name.c_str(), e.what());
+        }
+    }
+}
+
+extern "C" {
+epicsExportAddress(int, bsasPluginQueue);
+}
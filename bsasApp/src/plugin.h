@@ -0,0 +1,57 @@
+#ifndef PLUGIN_H
+#define PLUGIN_H
+
+#include <deque>
+
+#include <epicsEvent.h>
+#include <pv/thread.h>
+
+#include "bsasPlugin.h"
+
+// Runs a plugin Receiver on its own thread.
+// Batches are queued by reference.  Values are not copied.
+struct PluginReceiver : public Receiver
+{
+    static size_t num_instances;
+
+    // takes ownership of 'inner'
+    PluginReceiver(Receiver *inner, const std::string& name);
+    virtual ~PluginReceiver();
+
+    // deliver anything queued, then join worker
+    void close();
+
+    virtual void names(const std::vector<std::string>& n);
+    virtual void slices(const slices_t& s);
+
+    // library name
+    const std::string name;
+
+    epicsMutex mutex;
+    // batches dropped as the plugin fell behind
+    size_t nDropped;
+
+private:
+    epics::auto_ptr<Receiver> inner;
+
+    struct Item {
+        bool isnames;
+        std::vector<std::string> names;
+        slices_t slices;
+    };
+    std::deque<Item> queue;
+    size_t nbatches; // slices items in queue
+    bool running;
+
+    epicsEvent wakeup;
+    epics::pvData::Thread worker;
+
+    void run();
+
+    EPICS_NOT_COPYABLE(PluginReceiver)
+};
+
+// load 'lib', once, and create a Receiver from its factory.  throws on error.
+PluginReceiver* loadReceiverPlugin(const std::string& table, const std::string& lib, const std::string& args);
+
+#endif // PLUGIN_H
@@ -0,0 +1,161 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __linux__
+#  include <sys/mman.h>
+#  include <sched.h>
+#  include <pthread.h>
+#  include <malloc.h>
+#endif
+
+#include <errlog.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+
+#include "realtime.h"
+
+#include <epicsExport.h>
+
+int bsasRealTime;
+// heap to prefault when locking memory
+static int bsasRealTimeHeapMB = 64;
+// report processor loop passes longer than this
+static double bsasWatchdogPeriod = 0.1;
+
+namespace {
+epicsMutex lockMutex;
+bool locked;
+}
+
+namespace realtime {
+
+void lockMemory()
+{
+    {
+        epicsGuard<epicsMutex> G(lockMutex);
+        if(locked)
+            return;
+        locked = true;
+    }
+
+#ifdef __linux__
+    if(mlockall(MCL_CURRENT|MCL_FUTURE)) {
+        errlogPrintf("bsas real-time: mlockall() error %d.  Check memlock limit\n", errno);
+        return;
+    }
+
+    // keep freed memory in the (locked) heap, rather than returning it to the OS
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    // prefault heap
+    if(bsasRealTimeHeapMB>0) {
+        size_t nbytes = size_t(bsasRealTimeHeapMB)<<20u;
+        char *temp = (char*)malloc(nbytes);
+        if(temp) {
+            memset(temp, 0, nbytes);
+            free(temp);
+        }
+    }
+#else
+    errlogPrintf("bsas real-time: memory locking not implemented for this target\n");
+#endif
+}
+
+void enterFIFO(unsigned int prio, const char *who)
+{
+#ifdef __linux__
+    int pmin = sched_get_priority_min(SCHED_FIFO),
+        pmax = sched_get_priority_max(SCHED_FIFO);
+
+    sched_param param;
+    param.sched_priority = pmin + (pmax-pmin)*int(prio)/99;
+
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if(err)
+        errlogPrintf("bsas real-time: %s unable to set SCHED_FIFO %d (error %d).  Check rtprio limit\n",
+                     who, param.sched_priority, err);
+#else
+    (void)prio;
+    errlogPrintf("bsas real-time: %s SCHED_FIFO not implemented for this target\n", who);
+#endif
+}
+
+SavedSched::SavedSched()
+    :policy(0)
+    ,priority(0)
+    ,valid(false)
+{
+#ifdef __linux__
+    sched_param param;
+    valid = pthread_getschedparam(pthread_self(), &policy, &param)==0;
+    priority = param.sched_priority;
+#endif
+}
+
+SavedSched::~SavedSched()
+{
+#ifdef __linux__
+    if(valid) {
+        sched_param param;
+        param.sched_priority = priority;
+        (void)pthread_setschedparam(pthread_self(), policy, &param);
+    }
+#endif
+}
+
+} // namespace realtime
+
+LoopWatchdog::LoopWatchdog(const char *name)
+    :name(name)
+{
+    stages.reserve(8u);
+}
+
+void LoopWatchdog::start()
+{
+    if(!bsasRealTime)
+        return;
+    stages.clear();
+    epicsTimeGetCurrent(&begin);
+    prev = begin;
+}
+
+void LoopWatchdog::mark(const char *stage)
+{
+    if(!bsasRealTime)
+        return;
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    stages.push_back(std::make_pair(stage, epicsTimeDiffInSeconds(&now, &prev)));
+    prev = now;
+}
+
+bool LoopWatchdog::finish()
+{
+    if(!bsasRealTime || stages.empty())
+        return false;
+
+    double total = epicsTimeDiffInSeconds(&prev, &begin);
+    if(total <= bsasWatchdogPeriod)
+        return false;
+
+    size_t worst = 0u;
+    for(size_t i=1; i<stages.size(); i++) {
+        if(stages[i].second > stages[worst].second)
+            worst = i;
+    }
+
+    errlogPrintf("%s overrun %.3f > %.3f sec.  %s took %.3f sec\n",
+                 name, total, bsasWatchdogPeriod,
+                 stages[worst].first, stages[worst].second);
+    return true;
+}
+
+extern "C" {
+epicsExportAddress(int, bsasRealTime);
+epicsExportAddress(int, bsasRealTimeHeapMB);
+epicsExportAddress(double, bsasWatchdogPeriod);
+}
@@ -0,0 +1,59 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <vector>
+
+#include <epicsTime.h>
+
+/* Opt-in real-time operation.  Set bsasRealTime=1 before iocInit().
+ *
+ * - Lock all current and future memory, and prefault some heap (bsasRealTimeHeapMB).
+ * - Run the Collector processor and CA client threads as SCHED_FIFO.
+ * - Report processor loop passes longer than bsasWatchdogPeriod, and the stage which took longest.
+ *
+ * Only implemented for Linux.  Needs CAP_SYS_NICE and CAP_IPC_LOCK,
+ * or suitable rtprio and memlock limits.  Failures are reported, and otherwise ignored.
+ */
+extern int bsasRealTime;
+
+namespace realtime {
+
+// mlockall() and prefault.  Only acts once per process.
+void lockMemory();
+
+// switch the calling thread to SCHED_FIFO, mapping EPICS priority [0, 99] to the FIFO range.
+// Threads created after this will inherit, unless Base is configured with USE_POSIX_THREAD_PRIORITY_SCHEDULING
+void enterFIFO(unsigned int prio, const char *who);
+
+// save scheduling of the calling thread, and restore when destroyed
+struct SavedSched {
+    SavedSched();
+    ~SavedSched();
+private:
+    int policy, priority;
+    bool valid;
+    SavedSched(const SavedSched&);
+    SavedSched& operator=(const SavedSched&);
+};
+
+} // namespace realtime
+
+// time the stages of one pass through a loop
+struct LoopWatchdog
+{
+    explicit LoopWatchdog(const char *name);
+
+    // begin a pass
+    void start();
+    // end of named stage.  'stage' must be a string constant
+    void mark(const char *stage);
+    // end a pass.  Report, and return true, if it took longer than bsasWatchdogPeriod
+    bool finish();
+
+private:
+    const char *name;
+    epicsTimeStamp begin, prev;
+    std::vector<std::pair<const char*, double> > stages;
+};
+
+#endif // REALTIME_H
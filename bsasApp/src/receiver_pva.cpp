@@ -1,4 +1,9 @@
 
+#include <algorithm>
+#include <map>
+
+#include <string.h>
+
 #include <epicsMath.h>
 #include <errlog.h>
 
@@ -10,12 +15,22 @@
 #include <epicsExport.h>
 
 namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
 
 int bsasBackFill;
+int bsasStringDictionary;
+// unique values in the dictionary of one column, before it is published expanded instead
+int bsasStringDictionaryMax = 4096;
+// limits on the size of one post.  <=0 for no limit
+int bsasMaxPostRows;
+int bsasMaxPostBytes = 16*1024*1024;
 
 static int receiverPVADebug;
 
 namespace {
+// max. decimation is 1 of 2**maxLevel rows
+const unsigned maxLevel = 6u;
+
 // adjust name to be a valid field name.  [A-Za-z_][A-Za-z0-9_]*
 void mangleName(std::string& name)
 {
@@ -55,52 +70,207 @@ struct NumericScalarCopier : public PVAReceiver::ColCopy
     }
     virtual ~NumericScalarCopier() {}
 
-    virtual void copy(const PVAReceiver::slices_t &s, size_t coln)
+    // true when every cell is a valid value of our type, each adjacent to the previous
+    // in one block.  eg. successive updates of one PV, cf. ScalarSlab
+    bool contiguous(const PVAReceiver::slices_t &s, size_t begin, size_t end, size_t coln) const
+    {
+        const PVAReceiver::Column& column = receiver.columns[coln];
+        if(begin==end || column.ftype!=(pvd::ScalarType)pvd::ScalarTypeID<value_type>::value)
+            return false;
+
+        const DBRValue& first = s[begin].second.at(coln);
+        if(!first.valid())
+            return false;
+        const void *owner = first->buffer.dataPtr().get();
+        const char *next = static_cast<const char*>(first->buffer.data());
+
+        for(size_t r=begin; r<end; r++, next += sizeof(value_type)) {
+            const DBRValue& cell = s[r].second.at(coln);
+            if(!cell.valid() || cell->sevr > 3 || cell->count!=1 || cell->type()!=column.ftype
+                    || cell->buffer.dataPtr().get()!=owner || cell->buffer.data()!=next)
+                return false;
+        }
+        return true;
+    }
+
+    virtual void copy(const PVAReceiver::slices_t &s, size_t begin, size_t end, size_t coln)
     {
-        pvd::shared_vector<value_type> scratch(s.size(), default_value<value_type>::is());
         PVAReceiver::Column& column = receiver.columns.at(coln);
 
-        for(size_t r=0, R=s.size(); r<R; r++) {
-            DBRValue cell(s[r].second.at(coln));
+        if(contiguous(s, begin, end, coln)) {
+            // publish a view of the block.  no copy
+            pvd::shared_vector<const value_type> first(pvd::static_shared_vector_cast<const value_type>(s[begin].second[coln]->buffer));
+            field->replace(pvd::shared_vector<const value_type>(first.dataPtr(), first.dataOffset(), end-begin));
+            receiver.changed.set(field->getFieldOffset());
+            column.last = s[end-1u].second[coln];
+            return;
+        }
+
+        pvd::shared_vector<value_type> scratch(end-begin, default_value<value_type>::is());
+        const DBRValue *prev = &column.last;
 
-            if(bsasBackFill && !cell.valid() && column.last.valid()) {
+        for(size_t r=0, R=end-begin; r<R; r++) {
+            // borrowed.  column.last is only updated after the loop
+            const DBRValue *pcell = &s[begin+r].second.at(coln);
+
+            if(bsasBackFill && !pcell->valid() && prev->valid()) {
                 // back fill from previous
-                cell = column.last;
+                pcell = prev;
             }
+            const DBRValue& cell = *pcell;
+            prev = pcell;
 
             if(!cell.valid() || cell->sevr > 3) {
                 // disconnected
-                column.last.swap(cell);
                 continue;
 
-            } else if(cell->count!=1 || cell->buffer.original_type()!=column.ftype) {
-                column.ftype = cell->buffer.original_type();
+            } else if(cell->count!=1 || cell->type()!=column.ftype) {
+                column.ftype = cell->type();
                 column.isarray = cell->count!=1;
                 receiver.state = PVAReceiver::NeedRetype;
-                column.last.reset();
                 if(receiverPVADebug>1) {
                     errlogPrintf("%s triggers type change from scalar %d to %s %d\n",
                                  column.fname.c_str(), column.ftype,
-                                 cell->count==1?"scalar":"array", cell->buffer.original_type());
+                                 cell->count==1?"scalar":"array", cell->type());
                 }
+                column.last.reset();
                 return;
             }
             assert(column.ftype==(pvd::ScalarType)pvd::ScalarTypeID<value_type>::value);
 
-            // could just alias cell->buffer.data()
-            const pvd::shared_vector<const value_type>& elem(pvd::static_shared_vector_cast<const value_type>(cell->buffer));
-            assert(elem.size()==1);
+            assert(cell->buffer.size()==sizeof(value_type));
 
-            scratch[r] = elem[0];
-
-            column.last.swap(cell);
+            scratch[r] = *static_cast<const value_type*>(cell->buffer.data());
         }
 
+        if(prev!=&column.last)
+            column.last = *prev;
+
         field->replace(pvd::freeze(scratch));
         receiver.changed.set(field->getFieldOffset());
     }
 };
 
+// scalar string.  Either expanded, or as codes into a dictionary of unique values.
+struct StringScalarCopier : public PVAReceiver::ColCopy
+{
+    pvd::PVStringArrayPtr field;
+    pvd::PVUIntArrayPtr codes;
+    pvd::PVStringArrayPtr dictfield;
+
+    // value -> code.  Only grows until the next retype, or bsasStringDictionaryMax
+    typedef std::map<std::string, pvd::uint32> dict_t;
+    dict_t dict;
+    std::vector<std::string> dictlist;
+
+    StringScalarCopier(PVAReceiver& receiver, size_t coln) :PVAReceiver::ColCopy(receiver)
+    {
+        const PVAReceiver::Column& column = receiver.columns.at(coln);
+        pvd::PVStructurePtr value(receiver.root->getSubFieldT<pvd::PVStructure>("value"));
+
+        if(!column.encoded) {
+            field = value->getSubFieldT<pvd::PVStringArray>(column.fname);
+        } else {
+            codes = value->getSubFieldT<pvd::PVUIntArray>(column.fname);
+            dictfield = receiver.root
+                    ->getSubFieldT<pvd::PVStructure>("dictionary")
+                    ->getSubFieldT<pvd::PVStringArray>(column.fname);
+            // code 0 is reserved for disconnected/missing.  Not in 'dict', so an empty string gets its own code.
+            dictlist.push_back(default_value<std::string>::is());
+            publish();
+        }
+    }
+    virtual ~StringScalarCopier() {}
+
+    pvd::uint32 lookup(const std::string& val)
+    {
+        dict_t::iterator it(dict.find(val));
+        if(it==dict.end()) {
+            it = dict.insert(std::make_pair(val, pvd::uint32(dictlist.size()))).first;
+            dictlist.push_back(val);
+        }
+        return it->second;
+    }
+
+    void publish()
+    {
+        pvd::shared_vector<std::string> temp(dictlist.size());
+        std::copy(dictlist.begin(), dictlist.end(), temp.begin());
+        dictfield->replace(pvd::freeze(temp));
+        receiver.changed.set(dictfield->getFieldOffset());
+    }
+
+    virtual void copy(const PVAReceiver::slices_t &s, size_t begin, size_t end, size_t coln)
+    {
+        pvd::shared_vector<std::string> scratch(field ? end-begin : 0u, default_value<std::string>::is());
+        pvd::shared_vector<pvd::uint32> scratchcodes(codes ? end-begin : 0u, 0u);
+        PVAReceiver::Column& column = receiver.columns.at(coln);
+        const DBRValue *prev = &column.last;
+        const size_t ndict = dictlist.size();
+
+        for(size_t r=0, R=end-begin; r<R; r++) {
+            // borrowed.  column.last is only updated after the loop
+            const DBRValue *pcell = &s[begin+r].second.at(coln);
+
+            if(bsasBackFill && !pcell->valid() && prev->valid()) {
+                // back fill from previous
+                pcell = prev;
+            }
+            const DBRValue& cell = *pcell;
+            prev = pcell;
+
+            if(!cell.valid() || cell->sevr > 3) {
+                // disconnected
+                continue;
+
+            } else if(cell->count!=1 || cell->type()!=pvd::pvString) {
+                column.ftype = cell->type();
+                column.isarray = cell->count!=1;
+                receiver.state = PVAReceiver::NeedRetype;
+                if(receiverPVADebug>1) {
+                    errlogPrintf("%s triggers type change from scalar string to %s %d\n",
+                                 column.fname.c_str(),
+                                 cell->count==1?"scalar":"array", cell->type());
+                }
+                column.last.reset();
+                return;
+            }
+
+            const std::string& elem = *static_cast<const std::string*>(cell->buffer.data());
+
+            if(codes)
+                scratchcodes[r] = lookup(elem);
+            else
+                scratch[r] = elem;
+        }
+
+        if(prev!=&column.last)
+            column.last = *prev;
+
+        if(codes) {
+            codes->replace(pvd::freeze(scratchcodes));
+            receiver.changed.set(codes->getFieldOffset());
+            // clients must cache the dictionary, which is only sent when extended
+            if(dictlist.size()!=ndict)
+                publish();
+
+            // codes already copied are valid.  Switch to expanded strings from the next post,
+            // rather than re-sending an ever larger dictionary.
+            if(bsasStringDictionaryMax>0 && dict.size() > size_t(bsasStringDictionaryMax)) {
+                column.dictfull = true;
+                receiver.state = PVAReceiver::NeedRetype;
+                if(receiverPVADebug>0) {
+                    errlogPrintf("%s dictionary full with %zu values.  Expanding\n",
+                                 column.fname.c_str(), dict.size());
+                }
+            }
+        } else {
+            field->replace(pvd::freeze(scratch));
+            receiver.changed.set(field->getFieldOffset());
+        }
+    }
+};
+
 struct NumericArrayCopier : public PVAReceiver::ColCopy
 {
     pvd::PVUnionArrayPtr field;
@@ -120,62 +290,167 @@ struct NumericArrayCopier : public PVAReceiver::ColCopy
     }
     virtual ~NumericArrayCopier() {}
 
-    virtual void copy(const PVAReceiver::slices_t &s, size_t coln)
+    virtual void copy(const PVAReceiver::slices_t &s, size_t begin, size_t end, size_t coln)
     {
-        pvd::PVUnionArray::svector scratch(s.size()); // initialized with NULLs
+        pvd::PVUnionArray::svector scratch(end-begin); // initialized with NULLs
         PVAReceiver::Column& column = receiver.columns.at(coln);
+        const DBRValue *prev = &column.last;
 
         pvd::PVDataCreatePtr create(pvd::getPVDataCreate());
 
-        for(size_t r=0, R=s.size(); r<R; r++) {
-            DBRValue cell(s[r].second.at(coln));
+        for(size_t r=0, R=end-begin; r<R; r++) {
+            // borrowed.  column.last is only updated after the loop
+            const DBRValue *pcell = &s[begin+r].second.at(coln);
 
-            if(bsasBackFill && !cell.valid() && column.last.valid()) {
+            if(bsasBackFill && !pcell->valid() && prev->valid()) {
                 // back fill from previous
-                cell = column.last;
+                pcell = prev;
             }
+            const DBRValue& cell = *pcell;
+            prev = pcell;
 
             if(!cell.valid() || cell->sevr > 3) {
                 // disconnected
-                column.last.swap(cell);
                 continue;
 
-            } else if(cell->buffer.original_type()!=column.ftype) {
+            } else if(cell->type()!=column.ftype) {
                 column.ftype = arrtype->getElementType();
                 // always an array.  never switches (back) to scalar
                 receiver.state = PVAReceiver::NeedRetype;
-                column.last.reset();
                 if(receiverPVADebug>1) {
                     errlogPrintf("%s triggers type change from array %d to array %d\n",
                                  column.fname.c_str(), column.ftype,
-                                 cell->buffer.original_type());
+                                 cell->type());
                 }
+                column.last.reset();
                 return;
             }
 
             pvd::PVScalarArrayPtr arr(create->createPVScalarArray(arrtype));
-            arr->putFrom(cell->buffer);
+            arr->putFrom(cell->expand()); // uncompress if packed
 
             pvd::PVUnionPtr U(create->createPVUnion(utype));
             U->set(0, arr);
             scratch[r] = U;
-
-            column.last.swap(cell);
         }
 
+        if(prev!=&column.last)
+            column.last = *prev;
+
         field->replace(pvd::freeze(scratch));
         receiver.changed.set(field->getFieldOffset());
     }
 };
 
+// wraps a SharedPV channel, except for monitors
+struct TableChannel : public pva::Channel
+{
+    const std::tr1::shared_ptr<PVAReceiver::Builder> builder;
+    const pva::Channel::shared_pointer inner;
+
+    TableChannel(const std::tr1::shared_ptr<PVAReceiver::Builder>& builder,
+                 const pva::Channel::shared_pointer& inner)
+        :builder(builder)
+        ,inner(inner)
+    {}
+    virtual ~TableChannel() {}
+
+    virtual void destroy() { inner->destroy(); }
+    virtual std::tr1::shared_ptr<pva::ChannelProvider> getProvider() { return inner->getProvider(); }
+    virtual std::string getRemoteAddress() { return inner->getRemoteAddress(); }
+    virtual ConnectionState getConnectionState() { return inner->getConnectionState(); }
+    virtual std::string getChannelName() { return inner->getChannelName(); }
+    virtual std::tr1::shared_ptr<pva::ChannelRequester> getChannelRequester() { return inner->getChannelRequester(); }
+    virtual void printInfo(std::ostream& out) { inner->printInfo(out); }
+
+    virtual void getField(pva::GetFieldRequester::shared_pointer const & requester, std::string const & subField)
+    {
+        inner->getField(requester, subField);
+    }
+
+    virtual pva::ChannelGet::shared_pointer createChannelGet(pva::ChannelGetRequester::shared_pointer const & requester,
+                                                             pvd::PVStructure::shared_pointer const & pvRequest)
+    {
+        return inner->createChannelGet(requester, pvRequest);
+    }
+
+    virtual pva::ChannelPut::shared_pointer createChannelPut(pva::ChannelPutRequester::shared_pointer const & requester,
+                                                             pvd::PVStructure::shared_pointer const & pvRequest)
+    {
+        return inner->createChannelPut(requester, pvRequest);
+    }
+
+    virtual pva::Monitor::shared_pointer createMonitor(pva::MonitorRequester::shared_pointer const & requester,
+                                                       pvd::PVStructure::shared_pointer const & pvRequest)
+    {
+        return builder->createMonitor(requester, pvRequest);
+    }
+};
+
 } // namespace
 
+std::tr1::shared_ptr<pva::Channel> PVAReceiver::Builder::connect(const std::tr1::shared_ptr<pva::ChannelProvider>& provider,
+                                                                 const std::string& name,
+                                                                 const std::tr1::shared_ptr<pva::ChannelRequester>& requester)
+{
+    pva::Channel::shared_pointer inner(pv->connect(provider, name, requester));
+    pva::Channel::shared_pointer ret(new TableChannel(shared_from_this(), inner));
+    return ret;
+}
+
+void PVAReceiver::Builder::disconnect(bool destroy, const pva::ChannelProvider* provider)
+{
+    pv->disconnect(destroy, provider);
+}
+
+pva::Monitor::shared_pointer PVAReceiver::Builder::createMonitor(const pva::MonitorRequester::shared_pointer& requester,
+                                                                 const pvd::PVStructure::shared_pointer& pvRequest)
+{
+    std::tr1::shared_ptr<pva::MonitorFIFO> mon;
+    {
+        Guard G(mutex);
+
+        if(!receiver) {
+            requester->monitorConnect(pvd::Status::error("Table closed"), pva::Monitor::shared_pointer(), pvd::StructureConstPtr());
+            return pva::Monitor::shared_pointer();
+        }
+
+        mon.reset(new pva::MonitorFIFO(requester, pvRequest));
+
+        std::tr1::shared_ptr<PVAReceiver::Client> C(new PVAReceiver::Client);
+        C->mon = mon;
+
+        Guard G2(receiver->clientsLock); // serialize with post to SharedPV and other clients
+
+        receiver->clients.push_back(C);
+
+        if(pv->isOpen()) {
+            // initial update with current value.  Otherwise opened with the next post
+            pvd::PVStructurePtr current(pv->build());
+            pvd::BitSet valid;
+            pv->fetch(*current, valid);
+
+            C->type = current->getStructure();
+            mon->open(C->type);
+            C->capacity = mon->freeCount();
+            mon->post(*current, valid);
+        }
+    }
+    mon->notify();
+    return mon;
+}
+
 size_t PVAReceiver::num_instances;
 
 PVAReceiver::PVAReceiver(Collector& collector)
     :collector(collector)
     ,pv(pvas::SharedPV::buildReadOnly())
+    ,builder(new Builder(pv, this))
     ,state(NeedRetype)
+    ,maxLag(0u)
+    ,nDecimated(0u)
+    ,nDropped(0u)
+    ,batchid(0u)
 {
     REFTRACE_INCREMENT(num_instances);
     collector.add_receiver(this); // calls our names()
@@ -192,9 +467,158 @@ PVAReceiver::~PVAReceiver()
 void PVAReceiver::close()
 {
     collector.remove_receiver(this);
+    {
+        Guard G(builder->mutex);
+        builder->receiver = 0;
+    }
+    {
+        Guard G(clientsLock);
+        for(clients_t::const_iterator it(clients.begin()), end(clients.end()); it!=end; ++it) {
+            std::tr1::shared_ptr<pva::MonitorFIFO> mon((*it)->mon.lock());
+            if(mon && (*it)->type) {
+                mon->close();
+                mon->notify();
+            }
+        }
+        clients.clear();
+    }
     pv->close();
 }
 
+PVAReceiver::ClientStats PVAReceiver::clientStats()
+{
+    Guard G(clientsLock);
+    ClientStats ret;
+    ret.nClients = clients.size();
+    ret.maxLag = maxLag;
+    ret.nDecimated = nDecimated;
+    ret.nDropped = nDropped;
+    maxLag = nDecimated = nDropped = 0u;
+    return ret;
+}
+
+pvd::PVStructurePtr PVAReceiver::decimate(const pvd::PVStructure& value, size_t stride)
+{
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(value.getStructure()));
+    ret->copyUnchecked(value); // shares array storage
+
+    const pvd::PVFieldPtrArray& cols(ret->getSubFieldT<pvd::PVStructure>("value")->getPVFields());
+
+    for(size_t c=0, C=cols.size(); c<C; c++) {
+        pvd::PVField* fld = cols[c].get();
+
+        if(pvd::PVStringArray *sarr = dynamic_cast<pvd::PVStringArray*>(fld)) {
+            pvd::PVStringArray::const_svector src(sarr->view());
+            pvd::PVStringArray::svector dst((src.size()+stride-1u)/stride);
+            for(size_t i=0, N=dst.size(); i<N; i++)
+                dst[i] = src[i*stride];
+            sarr->replace(pvd::freeze(dst));
+
+        } else if(pvd::PVScalarArray *arr = dynamic_cast<pvd::PVScalarArray*>(fld)) {
+            pvd::ScalarType type = arr->getScalarArray()->getElementType();
+            size_t esize = pvd::ScalarTypeFunc::elementSize(type);
+
+            pvd::shared_vector<const void> src;
+            arr->getAs(src);
+            size_t nsrc = src.size()/esize;
+
+            pvd::shared_vector<void> dst(pvd::ScalarTypeFunc::allocArray(type, (nsrc+stride-1u)/stride));
+            const char *S = static_cast<const char*>(src.data());
+            char *D = static_cast<char*>(dst.data());
+            for(size_t i=0, N=dst.size()/esize; i<N; i++)
+                memcpy(D + i*esize, S + i*stride*esize, esize);
+            arr->putFrom(pvd::freeze(dst));
+
+        } else if(pvd::PVUnionArray *uarr = dynamic_cast<pvd::PVUnionArray*>(fld)) {
+            pvd::PVUnionArray::const_svector src(uarr->view());
+            pvd::PVUnionArray::svector dst((src.size()+stride-1u)/stride);
+            for(size_t i=0, N=dst.size(); i<N; i++)
+                dst[i] = src[i*stride];
+            uarr->replace(pvd::freeze(dst));
+        }
+    }
+
+    pvd::PVScalarPtr fdec(ret->getSubField<pvd::PVScalar>("decimation"));
+    if(fdec)
+        fdec->putFrom<pvd::uint32>(stride);
+
+    return ret;
+}
+
+// call with clientsLock held
+void PVAReceiver::post_clients(const pvd::PVStructure& value, const pvd::BitSet& changed,
+                               pvd::uint32 part, notify_t& notify)
+{
+    const pvd::StructureConstPtr type(value.getStructure());
+    // decimated copies of value, built on demand
+    std::vector<pvd::PVStructurePtr> reduced(maxLevel+1u);
+
+    for(clients_t::iterator it(clients.begin()), end(clients.end()); it!=end; ) {
+        Client& C = **it;
+        std::tr1::shared_ptr<pva::MonitorFIFO> mon(C.mon.lock());
+        if(!mon) {
+            // subscription cancelled
+            it = clients.erase(it);
+            continue;
+        }
+        ++it;
+
+        C.pending |= changed;
+
+        if(C.type!=type) {
+            // first update, or type change
+            if(C.type)
+                mon->close();
+            mon->open(type);
+            C.type = type;
+            C.capacity = mon->freeCount();
+            C.level = 0u;
+            C.skip = false;
+            C.pending.clear();
+            C.pending.set(0); // everything
+        }
+
+        if(part==0u) {
+            const size_t nfree = mon->freeCount();
+            const size_t lag = C.capacity - std::min(C.capacity, nfree);
+            maxLag = std::max(maxLag, lag);
+
+            // decimate more while queue is more than half full.  relax when empty.
+            if(2u*lag > C.capacity)
+                C.level = std::min(C.level+1u, maxLevel);
+            else if(lag==0u && C.level>0u)
+                C.level--;
+
+            // rows of this batch are lost to this client.
+            // Other changed fields are sent with the next batch.
+            C.skip = nfree==0u;
+            if(C.skip)
+                nDropped++;
+        }
+        if(C.skip)
+            continue;
+
+        const pvd::PVStructure *val = &value;
+        if(C.level) {
+            pvd::PVStructurePtr& R = reduced[C.level];
+            if(!R)
+                R = decimate(value, 1u<<C.level);
+            val = R.get();
+        }
+
+        // a batch in progress is never cut short.  Over-fill the queue if necessary.
+        if(mon->tryPost(*val, C.pending, pvd::BitSet(), part>0u)) {
+            C.pending.clear();
+            if(C.level)
+                nDecimated++;
+            notify.push_back(mon);
+        } else {
+            nDropped++;
+            C.skip = true;
+        }
+    }
+}
+
 void PVAReceiver::names(const std::vector<std::string>& pvs)
 {
     columns_t cols(pvs.size());
@@ -228,11 +652,34 @@ void PVAReceiver::names(const std::vector<std::string>& pvs)
     pv->close(); // paranoia?
 }
 
+size_t PVAReceiver::splitPost(const slices_t& s, size_t begin)
+{
+    const size_t maxrows = bsasMaxPostRows > 0 ? size_t(bsasMaxPostRows) : size_t(-1);
+    const size_t maxbytes = bsasMaxPostBytes > 0 ? size_t(bsasMaxPostBytes) : size_t(-1);
+    size_t nbytes = 0u;
+
+    size_t end = begin;
+    for(size_t R=s.size(); end<R && end-begin < maxrows; end++) {
+        // estimate of serialized size
+        size_t rowbytes = sliceBytes(s[end]);
+
+        if(end>begin && nbytes + rowbytes > maxbytes)
+            break; // always at least one row
+        nbytes += rowbytes;
+    }
+    return end;
+}
+
 void PVAReceiver::slices(const slices_t& s)
 {
-    {
-        Guard G(mutex);
+    Guard G(mutex);
 
+    // large batches are split into several posts, numbered by batch.part
+    batchid++;
+    pvd::uint32 part = 0u;
+    size_t begin = 0u;
+
+    do {
         if(state == NeedRetype) {
             state = RetypeInProg;
             if(receiverPVADebug>0) {
@@ -244,9 +691,15 @@ void PVAReceiver::slices(const slices_t& s)
                                          ->addArray("labels", pvd::pvString)
                                          ->addNestedStructure("value"));
 
+            bool anyencoded = false;
             for(size_t i=0, N=columns.size(); i<N; i++) {
                 Column& col = columns[i];
-                if(!col.isarray) {
+                col.encoded = !col.isarray && col.ftype==pvd::pvString && bsasStringDictionary && !col.dictfull;
+                anyencoded |= col.encoded;
+
+                if(col.encoded) {
+                    builder = builder->addArray(col.fname, pvd::pvUInt);
+                } else if(!col.isarray) {
                     builder = builder->addArray(col.fname, col.ftype);
                 } else {
                     builder = builder->addNestedUnionArray(col.fname)
@@ -255,10 +708,34 @@ void PVAReceiver::slices(const slices_t& s)
                 }
             }
 
+            builder = builder->addArray("secondsPastEpoch", pvd::pvUInt)
+                             ->addArray("nanoseconds", pvd::pvUInt)
+                          ->endNested(); // end of .value
+
+            if(anyencoded) {
+                // unique values of string columns, indexed by .value codes
+                builder = builder->addNestedStructure("dictionary");
+                for(size_t i=0, N=columns.size(); i<N; i++) {
+                    if(columns[i].encoded)
+                        builder = builder->addArray(columns[i].fname, pvd::pvString);
+                }
+                builder = builder->endNested();
+            }
+
+            // stride of rows sent to this client.  1 unless decimated
+            builder = builder->add("decimation", pvd::pvUInt);
+
+            // a batch of slices may be split into several updates.
+            // 'more' is set on all but the last part.
+            // 'epoch' is shared with other tables when bsasFlushEpoch is set.  cf. flushEpoch()
+            builder = builder->addNestedStructure("batch")
+                                ->add("id", pvd::pvUInt)
+                                ->add("part", pvd::pvUInt)
+                                ->add("more", pvd::pvBoolean)
+                                ->add("epoch", pvd::pvULong)
+                             ->endNested();
+
             pvd::StructureConstPtr type(builder
-                                            ->addArray("secondsPastEpoch", pvd::pvUInt)
-                                            ->addArray("nanoseconds", pvd::pvUInt)
-                                        ->endNested() // end of .value
                                         //->add("alarm", pvd::getStandardField()->alarm())
                                         //->add("timeStamp", pvd::getStandardField()->timeStamp())
                                         ->createStructure());
@@ -267,6 +744,12 @@ void PVAReceiver::slices(const slices_t& s)
 
             fsec = root->getSubFieldT<pvd::PVUIntArray>("value.secondsPastEpoch");
             fnsec = root->getSubFieldT<pvd::PVUIntArray>("value.nanoseconds");
+            fdecimation = root->getSubFieldT<pvd::PVUInt>("decimation");
+            fdecimation->put(1u);
+            fbatchid = root->getSubFieldT<pvd::PVUInt>("batch.id");
+            fbatchpart = root->getSubFieldT<pvd::PVUInt>("batch.part");
+            fbatchmore = root->getSubFieldT<pvd::PVBoolean>("batch.more");
+            fbatchepoch = root->getSubFieldT<pvd::PVULong>("batch.epoch");
 
             {
                 pvd::PVStringArrayPtr flabels(root->getSubFieldT<pvd::PVStringArray>("labels"));
@@ -285,6 +768,8 @@ void PVAReceiver::slices(const slices_t& s)
                     col.copier.reset(new NumericScalarCopier<pvd::PVIntArray>(*this, c));
                 } else if(!col.isarray && col.ftype==pvd::pvUInt) {
                     col.copier.reset(new NumericScalarCopier<pvd::PVUIntArray>(*this, c));
+                } else if(!col.isarray && col.ftype==pvd::pvString) {
+                    col.copier.reset(new StringScalarCopier(*this, c));
                 } else if(col.isarray) {
                     col.copier.reset(new NumericArrayCopier(*this, c));
                 } else {
@@ -294,6 +779,7 @@ void PVAReceiver::slices(const slices_t& s)
 
             {
                 UnGuard U(G);
+                Guard C(clientsLock);
                 pv->close();
                 pv->open(*root, changed);
             }
@@ -308,10 +794,12 @@ void PVAReceiver::slices(const slices_t& s)
             stateRun.wait();
         }
 
-        pvd::shared_vector<pvd::uint32> sec(s.size()), nsec(s.size());
+        const size_t end = splitPost(s, begin);
+
+        pvd::shared_vector<pvd::uint32> sec(end-begin), nsec(end-begin);
 
-        for(size_t r=0, R=s.size(); r<R; r++) {
-            epicsUInt64 key = s[r].first;
+        for(size_t r=0, R=end-begin; r<R; r++) {
+            epicsUInt64 key = s[begin+r].first;
             sec[r] = (key>>32) + POSIX_TIME_AT_EPICS_EPOCH;
             nsec[r] = key;
         }
@@ -325,20 +813,40 @@ void PVAReceiver::slices(const slices_t& s)
             Column& col = columns[c];
 
             if(col.copier)
-                col.copier->copy(s, c);
+                col.copier->copy(s, begin, end, c);
         }
 
+        fbatchid->put(batchid);
+        fbatchpart->put(part);
+        fbatchmore->put(end < s.size());
+        fbatchepoch->put(end>begin ? flushEpoch(s[begin].first) : 0u);
+        changed.set(fbatchid->getParent()->getFieldOffset());
+        changed.set(fdecimation->getFieldOffset());
+
         {
             UnGuard U(G);
-            pv->post(*root, changed);
+            notify_t notify;
+            {
+                Guard C(clientsLock);
+                pv->post(*root, changed);
+                post_clients(*root, changed, part, notify);
+            }
+            for(size_t i=0, N=notify.size(); i<N; i++)
+                notify[i]->notify();
         }
 
         changed.clear();
-    }
+        begin = end;
+        part++;
 
+    } while(begin < s.size());
 }
 
 extern "C" {
 epicsExportAddress(int, receiverPVADebug);
 epicsExportAddress(int, bsasBackFill);
+epicsExportAddress(int, bsasStringDictionary);
+epicsExportAddress(int, bsasStringDictionaryMax);
+epicsExportAddress(int, bsasMaxPostRows);
+epicsExportAddress(int, bsasMaxPostBytes);
 }
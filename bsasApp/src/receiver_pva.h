@@ -1,12 +1,24 @@
 #ifndef RECEIVER_PVA_H
 #define RECEIVER_PVA_H
 
+#include <list>
+
+#include <pv/pvAccess.h>
 #include <pva/sharedstate.h>
+#include <pva/server.h>
 
 #include "collector.h"
 
 extern "C"
 int bsasBackFill;
+extern "C"
+int bsasStringDictionary;
+extern "C"
+int bsasStringDictionaryMax;
+extern "C"
+int bsasMaxPostRows;
+extern "C"
+int bsasMaxPostBytes;
 
 struct PVAReceiver : public Receiver
 {
@@ -16,8 +28,13 @@ struct PVAReceiver : public Receiver
     virtual ~PVAReceiver();
 
     Collector& collector;
+    // handles GET and introspection of the table PV.  Monitors are handled by 'builder'
     const pvas::SharedPV::shared_pointer pv;
 
+    struct Builder;
+    // to be added to a StaticProvider in place of 'pv'
+    const std::tr1::shared_ptr<Builder> builder;
+
     epicsMutex mutex;
 
     enum state_t {
@@ -32,7 +49,8 @@ struct PVAReceiver : public Receiver
         PVAReceiver& receiver;
         explicit ColCopy(PVAReceiver& receiver) :receiver(receiver) {}
         virtual ~ColCopy() {}
-        virtual void copy(const slices_t& s, size_t coln) =0;
+        // copy rows [begin, end) of column 'coln'
+        virtual void copy(const slices_t& s, size_t begin, size_t end, size_t coln) =0;
     };
 
     struct Column {
@@ -40,11 +58,15 @@ struct PVAReceiver : public Receiver
         std::tr1::shared_ptr<ColCopy> copier;
         bool isarray;
         epics::pvData::ScalarType ftype;
+        // scalar string published as codes into dictionary.<fname>
+        bool encoded;
+        // dictionary grew past bsasStringDictionaryMax.  Published expanded from now on.
+        bool dictfull;
 
         // last populated value, used to backfill
         DBRValue last;
 
-        Column() :isarray(false), ftype(epics::pvData::pvDouble) {}
+        Column() :isarray(false), ftype(epics::pvData::pvDouble), encoded(false), dictfull(false) {}
     };
 
     typedef std::vector<Column> columns_t;
@@ -54,12 +76,85 @@ struct PVAReceiver : public Receiver
 
     epics::pvData::PVStructurePtr root;
     epics::pvData::PVUIntArrayPtr fsec, fnsec;
+    epics::pvData::PVUIntPtr fdecimation;
+    epics::pvData::PVUIntPtr fbatchid, fbatchpart;
+    epics::pvData::PVBooleanPtr fbatchmore;
+    epics::pvData::PVULongPtr fbatchepoch;
     epics::pvData::BitSet changed;
 
+    // one per monitor subscription to the table PV.
+    // Clients with full queues are sent decimated updates.
+    // Decimation, and dropping, are decided at the first part of a batch.
+    // Later parts are queued even if this over-fills the queue, so a client
+    // gets every part of a batch, or none.
+    struct Client {
+        std::tr1::weak_ptr<epics::pvAccess::MonitorFIFO> mon;
+        // type of last open(), NULL before first
+        epics::pvData::StructureConstPtr type;
+        size_t capacity; // queue size
+        // rows are decimated by 2**level
+        unsigned level;
+        // current batch not sent to this client
+        bool skip;
+        // changes not yet sent
+        epics::pvData::BitSet pending;
+        Client() :capacity(0u), level(0u), skip(false) {}
+    };
+    typedef std::list<std::tr1::shared_ptr<Client> > clients_t;
+
+    // guards clients and counters.  May be locked before, but not after, mutex.
+    epicsMutex clientsLock;
+    clients_t clients;
+    // max. client queue usage since previous clientStats()
+    size_t maxLag;
+    // totals of updates sent decimated, and of batches not sent to some client
+    size_t nDecimated, nDropped;
+
+    struct ClientStats {
+        size_t nClients, maxLag, nDecimated, nDropped;
+    };
+    // snapshot.  resets all but nClients
+    ClientStats clientStats();
+
+    // build copy of 'value' with every 'stride'th row of each column
+    static epics::pvData::PVStructurePtr decimate(const epics::pvData::PVStructure& value, size_t stride);
+
     void close();
 
     virtual void names(const std::vector<std::string>& n);
     virtual void slices(const slices_t& s);
+
+    // end of the next post, starting from row 'begin', within bsasMaxPost* limits
+    static size_t splitPost(const slices_t& s, size_t begin);
+
+private:
+    // incremented for each call to slices()
+    epics::pvData::uint32 batchid;
+
+    typedef std::vector<std::tr1::shared_ptr<epics::pvAccess::MonitorFIFO> > notify_t;
+    // 'part' of the current batch
+    void post_clients(const epics::pvData::PVStructure& value, const epics::pvData::BitSet& changed,
+                      epics::pvData::uint32 part, notify_t& notify);
+};
+
+struct PVAReceiver::Builder : public pvas::StaticProvider::ChannelBuilder,
+                              public std::tr1::enable_shared_from_this<PVAReceiver::Builder>
+{
+    epicsMutex mutex;
+    // cleared by PVAReceiver::close()
+    PVAReceiver *receiver;
+    const pvas::SharedPV::shared_pointer pv;
+
+    Builder(const pvas::SharedPV::shared_pointer& pv, PVAReceiver *receiver) :receiver(receiver), pv(pv) {}
+    virtual ~Builder() {}
+
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> connect(const std::tr1::shared_ptr<epics::pvAccess::ChannelProvider>& provider,
+                                                                   const std::string& name,
+                                                                   const std::tr1::shared_ptr<epics::pvAccess::ChannelRequester>& requester);
+    virtual void disconnect(bool destroy, const epics::pvAccess::ChannelProvider* provider);
+
+    epics::pvAccess::Monitor::shared_pointer createMonitor(const epics::pvAccess::MonitorRequester::shared_pointer& requester,
+                                                           const epics::pvData::PVStructure::shared_pointer& pvRequest);
 };
 
 #endif // RECEIVER_PVA_H
@@ -0,0 +1,268 @@
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+
+#if defined(__linux__) || defined(__APPLE__)
+#  include <unistd.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  define USE_MMAP
+#endif
+
+#include <stdexcept>
+#include <sstream>
+
+#include <pv/pvIntrospect.h>
+
+#include "spill.h"
+
+#include <epicsExport.h>
+
+namespace pvd = epics::pvData;
+
+// size of spill file for each Collector, created when first needed.  <=0 to disable
+int bsasSpillMB = 0;
+
+/* Layout of one slice
+ *
+ *   uint32  #columns
+ *   for each column
+ *     uint8   0 - no value, 1 - value follows
+ *     if value
+ *       epicsTimeStamp  ts, arrival
+ *       uint16  sevr, stat
+ *       uint32  count
+ *       int8    buffer ScalarType, or -1 if no buffer
+ *       uint8   packed, packed_type
+ *       uint32  #elements of buffer
+ *       ...     elements.  Each string as uint32 length and chars.
+ *
+ * All in host byte order.  The file is never read by another process.
+ */
+
+namespace {
+
+template<typename T>
+inline void write(char*& pos, const T& val)
+{
+    memcpy(pos, &val, sizeof(val));
+    pos += sizeof(val);
+}
+
+template<typename T>
+inline T read(const char*& pos)
+{
+    T val;
+    memcpy(&val, pos, sizeof(val));
+    pos += sizeof(val);
+    return val;
+}
+
+inline bool typed(const pvd::shared_vector<const void>& buf)
+{
+    int type = buf.original_type();
+    return type>=pvd::pvBoolean && type<=pvd::pvString;
+}
+
+size_t encodedSize(const SpillFile::cells_t& cells)
+{
+    size_t nbytes = 4u;
+    for(size_t c=0, C=cells.size(); c<C; c++) {
+        nbytes += 1u;
+        const DBRValue& val = cells[c];
+        if(!val.valid())
+            continue;
+        nbytes += 2u*sizeof(epicsTimeStamp) + 2u + 2u + 4u + 1u + 2u + 4u;
+
+        if(!typed(val->buffer)) {
+        } else if(val->buffer.original_type()==pvd::pvString) {
+            pvd::shared_vector<const std::string> S(pvd::static_shared_vector_cast<const std::string>(val->buffer));
+            for(size_t i=0, N=S.size(); i<N; i++)
+                nbytes += 4u + S[i].size();
+        } else {
+            nbytes += val->buffer.size();
+        }
+    }
+    return nbytes;
+}
+
+} // namespace
+
+SpillFile::SpillFile(size_t nbytes)
+    :base(0)
+    ,limit(nbytes)
+    ,next(0u)
+{
+#ifdef USE_MMAP
+    const char *dir = getenv("BSAS_SPILL_DIR");
+    std::string fname(dir && dir[0] ? dir : "/tmp");
+    fname += "/bsas-spill-XXXXXX";
+
+    std::vector<char> temp(fname.begin(), fname.end());
+    temp.push_back('\0');
+
+    int fd = mkstemp(&temp[0]);
+    if(fd<0) {
+        std::ostringstream strm;
+        strm<<"Unable to create spill file in "<<fname<<" : "<<strerror(errno);
+        throw std::runtime_error(strm.str());
+    }
+    unlink(&temp[0]);
+
+    // reserve blocks now, rather than fault on a full disk later
+#ifdef __linux__
+    int err = posix_fallocate(fd, 0, off_t(nbytes));
+#else
+    int err = ftruncate(fd, off_t(nbytes)) ? errno : 0;
+#endif
+    void *mem = err ? MAP_FAILED : mmap(0, nbytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(!err && mem==MAP_FAILED)
+        err = errno;
+    close(fd); // mapping keeps the file open
+
+    if(err) {
+        std::ostringstream strm;
+        strm<<"Unable to map "<<nbytes<<" byte spill file : "<<strerror(err);
+        throw std::runtime_error(strm.str());
+    }
+    base = (char*)mem;
+
+#ifdef __linux__
+    // with bsasRealTime, mlockall(MCL_FUTURE) would otherwise pin spilled pages in RAM
+    munlock(base, nbytes);
+#endif
+
+#else
+    (void)limit;
+    throw std::runtime_error("Spill file not supported on this target");
+#endif
+}
+
+SpillFile::~SpillFile()
+{
+#ifdef USE_MMAP
+    munmap(base, limit);
+#endif
+}
+
+bool SpillFile::put(epicsUInt64 key, cells_t& cells)
+{
+    if(index.find(key)!=index.end())
+        return false; // paranoia.  keys are unique in Collector::events
+
+    const size_t nbytes = encodedSize(cells);
+    if(nbytes > limit - next)
+        return false;
+
+    char *pos = base + next;
+
+    write<epicsUInt32>(pos, cells.size());
+    for(size_t c=0, C=cells.size(); c<C; c++) {
+        const DBRValue& val = cells[c];
+        write<epicsUInt8>(pos, val.valid());
+        if(!val.valid())
+            continue;
+
+        write(pos, val->ts);
+        write(pos, val->arrival);
+        write(pos, val->sevr);
+        write(pos, val->stat);
+        write(pos, val->count);
+
+        const pvd::shared_vector<const void>& buf = val->buffer;
+        write<epicsInt8>(pos, typed(buf) ? epicsInt8(buf.original_type()) : -1);
+        write<epicsUInt8>(pos, val->packed);
+        write<epicsUInt8>(pos, val->packed_type);
+
+        if(!typed(buf)) {
+            write<epicsUInt32>(pos, 0u);
+
+        } else if(buf.original_type()==pvd::pvString) {
+            pvd::shared_vector<const std::string> S(pvd::static_shared_vector_cast<const std::string>(buf));
+            write<epicsUInt32>(pos, S.size());
+            for(size_t i=0, N=S.size(); i<N; i++) {
+                write<epicsUInt32>(pos, S[i].size());
+                memcpy(pos, S[i].c_str(), S[i].size());
+                pos += S[i].size();
+            }
+
+        } else {
+            write<epicsUInt32>(pos, buf.size()/pvd::ScalarTypeFunc::elementSize(buf.original_type()));
+            memcpy(pos, buf.data(), buf.size());
+            pos += buf.size();
+        }
+    }
+
+    assert(size_t(pos - base) == next + nbytes);
+
+    index[key] = std::make_pair(next, nbytes);
+    next += nbytes;
+
+    cells.clear();
+    return true;
+}
+
+bool SpillFile::take(epicsUInt64 key, cells_t& cells)
+{
+    index_t::iterator it(index.find(key));
+    if(it==index.end())
+        return false;
+
+    const char *pos = base + it->second.first;
+
+    cells.clear();
+    cells.resize(read<epicsUInt32>(pos));
+
+    for(size_t c=0, C=cells.size(); c<C; c++) {
+        if(!read<epicsUInt8>(pos))
+            continue;
+
+        DBRValue val(new DBRValue::Holder);
+        val->ts = read<epicsTimeStamp>(pos);
+        val->arrival = read<epicsTimeStamp>(pos);
+        val->sevr = read<epicsUInt16>(pos);
+        val->stat = read<epicsUInt16>(pos);
+        val->count = read<epicsUInt32>(pos);
+
+        const epicsInt8 type = read<epicsInt8>(pos);
+        val->packed = read<epicsUInt8>(pos);
+        val->packed_type = pvd::ScalarType(read<epicsUInt8>(pos));
+        const size_t nelem = read<epicsUInt32>(pos);
+
+        if(type<0) {
+            // no buffer
+
+        } else if(type==pvd::pvString) {
+            pvd::shared_vector<std::string> S(nelem);
+            for(size_t i=0; i<nelem; i++) {
+                const size_t len = read<epicsUInt32>(pos);
+                S[i].assign(pos, len);
+                pos += len;
+            }
+            val->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(S));
+
+        } else {
+            pvd::shared_vector<void> buf(pvd::ScalarTypeFunc::allocArray(pvd::ScalarType(type), nelem));
+            memcpy(buf.data(), pos, buf.size());
+            pos += buf.size();
+            val->buffer = pvd::freeze(buf);
+        }
+        val->track();
+
+        cells[c].swap(val);
+    }
+
+    assert(size_t(pos - base) == it->second.first + it->second.second);
+
+    index.erase(it);
+    if(index.empty())
+        next = 0u; // reuse from the start
+
+    return true;
+}
+
+extern "C" {
+epicsExportAddress(int, bsasSpillMB);
+}
@@ -0,0 +1,57 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <map>
+#include <vector>
+#include <string>
+
+#include <epicsTypes.h>
+
+#include "collect_ca.h"
+
+/* Overflow storage for pending slices, when Collector::events grows past its limit.
+ * cf. bsasSpillMB
+ *
+ * Slices are copied into a memory mapped scratch file in $BSAS_SPILL_DIR (default /tmp),
+ * which is unlinked as soon as it is created, so nothing is left behind.
+ * Pages are written back to disk as the OS sees fit.  Space is reused
+ * once every spilled slice has been read back.
+ *
+ * Not thread safe.  Used only by the Collector processor thread.
+ */
+struct SpillFile
+{
+    typedef std::vector<DBRValue> cells_t;
+
+    // creates file of 'nbytes'.  throws std::runtime_error
+    explicit SpillFile(size_t nbytes);
+    ~SpillFile();
+
+    // store 'cells' under 'key', and release them.
+    // Returns false, leaving 'cells' unchanged, if there is not enough space.
+    bool put(epicsUInt64 key, cells_t& cells);
+    // read back and forget the slice with 'key'.  Returns false if not spilled.
+    bool take(epicsUInt64 key, cells_t& cells);
+
+    bool empty() const { return index.empty(); }
+    // number of slices spilled
+    size_t size() const { return index.size(); }
+    // oldest key spilled.  Only when !empty()
+    epicsUInt64 front() const { return index.begin()->first; }
+    // bytes in use
+    size_t used() const { return next; }
+
+private:
+    char *base;
+    size_t limit, next;
+
+    // key -> (offset, length)
+    typedef std::map<epicsUInt64, std::pair<size_t, size_t> > index_t;
+    index_t index;
+
+    EPICS_NOT_COPYABLE(SpillFile)
+};
+
+extern int bsasSpillMB;
+
+#endif // SPILL_H
@@ -0,0 +1,154 @@
+
+#include <testMain.h>
+#include <epicsMath.h>
+#include <errlog.h>
+#include <pv/pvUnitTest.h>
+#include <pv/current_function.h>
+#include <pv/sharedVector.h>
+
+#include "bsasClient.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+// what PVAReceiver would send for columns TST:X (double), TST:WF (float array), and TST:MODE (string)
+struct TestTable {
+    pvd::PVStructurePtr root;
+    pvd::BitSet changed;
+    bsas::Table table;
+
+    TestTable()
+    {
+        pvd::StructureConstPtr type(pvd::getFieldCreate()->createFieldBuilder()
+                                    ->setId("epics:nt/NTTable:1.0")
+                                    ->addArray("labels", pvd::pvString)
+                                    ->addNestedStructure("value")
+                                        ->addArray("TST_X", pvd::pvDouble)
+                                        ->addNestedUnionArray("TST_WF")
+                                            ->addArray("arr", pvd::pvFloat)
+                                        ->endNested()
+                                        ->addArray("TST_MODE", pvd::pvUInt)
+                                        ->addArray("secondsPastEpoch", pvd::pvUInt)
+                                        ->addArray("nanoseconds", pvd::pvUInt)
+                                    ->endNested()
+                                    ->addNestedStructure("dictionary")
+                                        ->addArray("TST_MODE", pvd::pvString)
+                                    ->endNested()
+                                    ->add("decimation", pvd::pvUInt)
+                                    ->createStructure());
+        root = pvd::getPVDataCreate()->createPVStructure(type);
+
+        pvd::shared_vector<std::string> labels(5);
+        labels[0] = "TST:X";
+        labels[1] = "TST:WF";
+        labels[2] = "TST:MODE";
+        labels[3] = "secondsPastEpoch";
+        labels[4] = "nanoseconds";
+        root->getSubFieldT<pvd::PVStringArray>("labels")->replace(pvd::freeze(labels));
+
+        pvd::shared_vector<std::string> dict(2);
+        dict[1] = "A";
+        root->getSubFieldT<pvd::PVStringArray>("dictionary.TST_MODE")->replace(pvd::freeze(dict));
+
+        root->getSubFieldT<pvd::PVUInt>("decimation")->put(1u);
+
+        fill(1.5);
+        changed.set(0); // initial update is complete
+    }
+
+    // two rows
+    void fill(double x)
+    {
+        pvd::shared_vector<double> X(2);
+        X[0] = x;
+        X[1] = x+1.0;
+        root->getSubFieldT<pvd::PVDoubleArray>("value.TST_X")->replace(pvd::freeze(X));
+
+        pvd::PVUnionArrayPtr fwf(root->getSubFieldT<pvd::PVUnionArray>("value.TST_WF"));
+        pvd::PVUnionArray::svector cells(2); // second is NULL
+        {
+            pvd::PVFloatArray::svector arr(3, 1.0f);
+            pvd::PVFloatArrayPtr farr(pvd::getPVDataCreate()->createPVScalarArray<pvd::PVFloatArray>());
+            farr->replace(pvd::freeze(arr));
+
+            cells[0] = pvd::getPVDataCreate()->createPVUnion(fwf->getUnionArray()->getUnion());
+            cells[0]->set(0, farr);
+        }
+        fwf->replace(pvd::freeze(cells));
+
+        pvd::shared_vector<pvd::uint32> mode(2), sec(2), nsec(2);
+        mode[0] = 1;
+        mode[1] = 0; // missing
+        sec[0] = sec[1] = 100;
+        nsec[0] = 5;
+        nsec[1] = 6;
+        root->getSubFieldT<pvd::PVUIntArray>("value.TST_MODE")->replace(pvd::freeze(mode));
+        root->getSubFieldT<pvd::PVUIntArray>("value.secondsPastEpoch")->replace(pvd::freeze(sec));
+        root->getSubFieldT<pvd::PVUIntArray>("value.nanoseconds")->replace(pvd::freeze(nsec));
+    }
+
+    void test_decode()
+    {
+        table.update(*root, changed);
+
+        testEqual(table.generation, 1u);
+        testEqual(table.decimation, 1u);
+        testEqual(table.rows(), 2u);
+        testEqual(table.columns.size(), 3u);
+        testEqual(table.keys.at(1), (100ull<<32u) | 6u);
+
+        bsas::View<double> X(table["TST:X"].view<double>());
+        testEqual(X.size(), 2u);
+        testEqual(X[1], 2.5);
+        // not a copy
+        testOk1(X.data()==root->getSubFieldT<pvd::PVDoubleArray>("value.TST_X")->view().data());
+
+        const bsas::Column& WF = table["TST:WF"];
+        testOk1(WF.isarray);
+        testEqual(WF.cell<float>(0).size(), 3u);
+        testOk1(WF.cell<float>(1).empty());
+
+        testEqual(table["TST:MODE"].string(0), "A");
+        testEqual(table["TST:MODE"].string(1), "");
+
+        testThrows(std::logic_error, table["TST:X"].view<float>());
+        testThrows(std::logic_error, WF.view<float>());
+        testOk1(!table.find("TST:Y"));
+    }
+
+    // later update without dictionary
+    void test_retain()
+    {
+        table.update(*root, changed);
+
+        changed.clear();
+        changed.set(root->getSubFieldT<pvd::PVStructure>("value")->getFieldOffset());
+        changed.set(root->getSubFieldT<pvd::PVUInt>("decimation")->getFieldOffset());
+        root->getSubFieldT<pvd::PVUInt>("decimation")->put(4u);
+        // what an incremental update may leave in unchanged fields
+        root->getSubFieldT<pvd::PVStringArray>("dictionary.TST_MODE")->replace(pvd::PVStringArray::const_svector());
+        fill(10.0);
+
+        table.update(*root, changed);
+
+        testEqual(table.generation, 1u);
+        testEqual(table.decimation, 4u);
+        testEqual(table["TST:X"].view<double>()[0], 10.0);
+        testEqual(table["TST:MODE"].string(0), "A");
+
+        table.clear();
+        table.update(*root, changed);
+        testEqual(table.generation, 2u);
+    }
+};
+
+} // namespace
+
+MAIN(test_client)
+{
+    testPlan(21);
+    TEST_METHOD(TestTable, test_decode);
+    TEST_METHOD(TestTable, test_retain);
+    return testDone();
+}
@@ -7,6 +7,8 @@
 #include <pv/sharedVector.h>
 
 #include "collector.h"
+#include "spill.h"
+#include "compress.h"
 
 namespace pvd = epics::pvData;
 
@@ -21,9 +23,11 @@ struct TestReceiver : public Receiver
     epicsEvent wakeup;
     std::vector<std::string> mynames;
     Receiver::slices_t myslices;
+    size_t nbatches; // calls to slices()
 
     explicit TestReceiver(Collector& collector)
         :collector(collector)
+        ,nbatches(0u)
     {
         collector.add_receiver(this);
     }
@@ -41,6 +45,7 @@ struct TestReceiver : public Receiver
             myslices.reserve(myslices.size()+s.size());
             for(size_t i=0, N=s.size(); i<N; i++)
                 myslices.push_back(s[i]);
+            nbatches++;
         }
         wakeup.signal();
     }
@@ -83,11 +88,11 @@ struct TestFooBar {
     CAContext ctxt;
     epics::auto_ptr<Collector> collect;
     epics::auto_ptr<TestReceiver> R;
-    TestFooBar()
+    explicit TestFooBar(bool packfoo=false)
         :ctxt(epicsThreadPriorityMedium, true)
     {
         pvd::shared_vector<std::string> names;
-        names.push_back("foo");
+        names.push_back(packfoo ? "foo compress" : "foo");
         names.push_back("bar");
 
         collect.reset(new Collector(ctxt, pvd::freeze(names), epicsThreadPriorityMedium));
@@ -216,16 +221,481 @@ struct TestFooBar {
         testSlice(2, T2, epicsNAN, 6.0);
         testEqual(R->myslices.size(), 3u);
     }
+
+    // a burst while the adaptive holdoff is at its minimum
+    void burst_min_holdoff() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+
+        // give the holdoff a chance to adapt
+        epicsThreadSleep(0.5);
+        {
+            Guard G(collect->mutex);
+            testEqual(collect->flushPeriod, bsasFlushMinPeriod);
+        }
+
+        // more rows than maxEventRate*bsasFlushMinPeriod,
+        // but fewer than the queue limit of each Subscription
+        const size_t N = 15u;
+        epicsTimeStamp T;
+        R->start(T);
+        for(size_t r=0; r<N; r++) {
+            epicsTimeAddSeconds(&T, 1e-6);
+            R->now = T;
+            R->push(0, 10.0+r);
+            R->push(1, 20.0+r);
+        }
+        R->notify(0);
+        R->notify(1);
+
+        for(unsigned i=0; i<50u && R->myslices.size() < 1u+N; i++)
+            R->wakeup.wait(0.1);
+        errlogFlush();
+
+        testEqual(R->myslices.size(), 1u+N);
+        testSlice(N, T, 10.0+N-1u, 20.0+N-1u);
+        testEqual(collect->nOverflow, 0u);
+    }
+
+    // pending slices past the limit of process_dequeue() are spilled, then read back
+    void spill_overflow() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+        epicsThreadSleep(0.1);
+
+        // with bsasFlushPeriod=0, process_dequeue() spills 5 of 10 pending slices.
+        // bar lags foo by 6 updates, so the slices spilled are not all complete.
+        const size_t N = 10u, lag = 6u;
+        std::vector<epicsTimeStamp> T(N);
+        {
+            Guard G(collect->mutex); // processor sees all, or nothing
+
+            for(size_t r=0; r<lag; r++)
+                R->push(1, 0.0); // @T0, already completed.  ignored
+
+            R->start(T[0]);
+            for(size_t r=0; r<N; r++) {
+                if(r)
+                    T[r] = T[r-1];
+                epicsTimeAddSeconds(&T[r], 1e-6);
+                R->now = T[r];
+                R->push(0, 10.0+r);
+                R->push(1, 20.0+r);
+            }
+            R->notify(0);
+            R->notify(1);
+        }
+
+        for(unsigned i=0; i<50u && R->myslices.size() < 1u+N; i++)
+            R->wakeup.wait(0.1);
+        errlogFlush();
+
+        testEqual(R->myslices.size(), 1u+N);
+        testSlice(1, T[0], 10.0, 20.0);
+        testSlice(5, T[4], 14.0, 24.0); // spilled before bar arrived.  re-merged
+        testSlice(N, T[N-1], 10.0+N-1u, 20.0+N-1u);
+
+        bool ordered = true;
+        {
+            Guard G(R->mutex);
+            for(size_t s=1; s<R->myslices.size(); s++)
+                ordered &= R->myslices[s-1].first < R->myslices[s].first;
+        }
+        testOk(ordered, "delivered in key order");
+
+        Guard G(collect->mutex);
+        testEqual(collect->nSpilled, 5u);
+        testEqual(collect->nOverflow, 0u);
+    }
+
+    // the disconnects of two channels of one server share a key, which the first may complete
+    void group_disconn() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+
+        collectorCaHostWindow = 10.0;
+        HostGroup grp("ioc1:5064");
+        grp.connected(true);
+        grp.connected(true);
+        epicsTimeStamp never = {0u, 0u};
+
+        epicsTimeStamp Ta, Tb, Tc;
+        DBRValue A(grp.disconnected(never));
+        Ta = A->ts;
+        collect->subscription(0)->push(A);
+        R->now = Ta;
+        R->push(1, 4.0);
+        R->start(Tb);
+        R->push(1, 6.0);
+        R->notify(0);
+        R->notify(1);
+
+        for(unsigned i=0; i<10u && R->myslices.size() < 3u; i++)
+            R->wakeup.wait(0.1);
+        errlogFlush();
+        testEqual(R->myslices.size(), 3u);
+
+        testDiag("second disconnect, dequeued after Ta was flushed");
+        DBRValue B(grp.disconnected(never));
+        testOk(&A->ts==&B->ts, "shared disconnect");
+        collect->subscription(1)->push(B);
+        R->notify(1);
+
+        testOk1(!R->wakeup.wait(0.5));
+        testEqual(R->myslices.size(), 3u);
+
+        testDiag("'bar' is disconnected, so 'foo' alone completes Tc");
+        R->start(Tc);
+        R->push(0, 7.0);
+        R->notify(0);
+
+        testOk1(R->wakeup.wait(1.0));
+        errlogFlush();
+        testEqual(R->myslices.size(), 4u);
+        testSlice(3, Tc, 7.0, epicsNAN);
+
+        collectorCaHostWindow = 0.5;
+    }
+
+    // a held epoch is released after maxEventAge, without a later epoch
+    void hold_aged() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+        epicsThreadSleep(0.15);
+
+        bsasFlushEpoch = 0.1;
+
+        // both at the start of one epoch
+        epicsTimeStamp T1, T2;
+        R->start(T1);
+        T1.nsec = (T1.nsec/100000000u)*100000000u + 1000u;
+        T2 = T1;
+        T2.nsec += 1000u;
+
+        R->now = T1;
+        R->push(0, 3.0);
+        R->push(1, 4.0);
+        R->now = T2;
+        R->push(0, 5.0);
+        R->push(1, 6.0);
+        R->notify(0);
+        R->notify(1);
+
+        testOk1(!R->wakeup.wait(0.5));
+        testEqual(R->myslices.size(), 1u);
+
+        testDiag("wait until the epoch is older than maxEventAge");
+        epicsThreadSleep(2.5);
+        R->notify(0);
+
+        testOk1(R->wakeup.wait(1.0));
+        errlogFlush();
+
+        testEqual(R->myslices.size(), 3u);
+        testEqual(R->nbatches, 2u);
+        testSlice(1, T1, 3.0, 4.0);
+        testSlice(2, T2, 5.0, 6.0);
+
+        bsasFlushEpoch = 0.0;
+    }
+
+    // rows of the newest epoch are held until a later epoch completes
+    void hold_epoch() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+
+        sync_initial();
+
+        bsasFlushEpoch = 1.0;
+
+        // keys in the future will not age out during this test
+        epicsTimeStamp T1, T2, T3;
+        R->start(T1);
+        T1.secPastEpoch += 2u;
+        T1.nsec = 100000000u;
+        T2 = T1;
+        T2.nsec = 200000000u;
+        T3 = T1;
+        T3.secPastEpoch++;
+        T3.nsec = 0u;
+
+        R->now = T1;
+        R->push(0, 3.0);
+        R->push(1, 4.0);
+        R->now = T2;
+        R->push(0, 5.0);
+        R->push(1, 6.0);
+        R->notify(0);
+        R->notify(1);
+
+        testDiag("T1 and T2 complete, but their epoch is still open");
+        testOk1(!R->wakeup.wait(0.5));
+        testEqual(R->myslices.size(), 1u);
+
+        R->now = T3;
+        R->push(0, 7.0);
+        R->push(1, 8.0);
+        R->notify(0);
+        R->notify(1);
+
+        testDiag("T3 closes the epoch of T1 and T2");
+        testOk1(R->wakeup.wait(1.0));
+        errlogFlush();
+
+        testEqual(R->myslices.size(), 3u);
+        testEqual(R->nbatches, 2u);
+        testSlice(1, T1, 3.0, 4.0);
+        testSlice(2, T2, 5.0, 6.0);
+
+        testDiag("T3 is released when epochs are disabled");
+        bsasFlushEpoch = 0.0;
+        R->notify(0);
+        testOk1(R->wakeup.wait(1.0));
+        errlogFlush();
+
+        testEqual(R->myslices.size(), 4u);
+        testSlice(3, T3, 7.0, 8.0);
+    }
+};
+
+// 'foo' queued through the Compressor
+struct TestPacked : public TestFooBar {
+    TestPacked() :TestFooBar(true) {}
+
+    // a disconnect keeps its place after values still being compressed
+    void disconn_order() {
+        testDiag("==== %s", CURRENT_FUNCTION);
+        if(!collect->compressor) {
+            testSkip(6, "Built without compression support");
+            return;
+        }
+
+        epicsTimeStamp T0, T1, T2, T3;
+        R->start(T0);
+        R->push(0, 1.0);
+        R->notify(0);
+        testOk1(R->wakeup.wait(1.0));
+        R->push(1, 2.0); // @T0, marks 'bar' connected
+        R->notify(1);
+
+        R->start(T1);
+        {
+            pvd::shared_vector<double> arr(8, 0.5);
+            DBRValue V(new DBRValue::Holder);
+            V->ts = T1;
+            V->sevr = V->stat = 0;
+            V->count = arr.size();
+            V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(arr));
+            collect->compressor->add(collect->subscription(0), V);
+        }
+        R->push(1, 4.0);
+        R->notify(1);
+
+        R->start(T2);
+        {
+            DBRValue D(new DBRValue::Holder); // disconnected
+            D->ts = T2;
+            collect->subscription(0)->disconnect(D);
+        }
+
+        testDiag("'foo' is disconnected, so 'bar' alone completes T3");
+        R->start(T3);
+        R->push(1, 6.0);
+        R->notify(1);
+
+        for(unsigned i=0; i<10u && R->myslices.size() < 4u; i++)
+            R->wakeup.wait(0.1);
+        errlogFlush();
+
+        testEqual(R->myslices.size(), 4u);
+        testSlice(1, T1, 0.5, 4.0);
+        testSlice(3, T3, epicsNAN, 6.0);
+    }
 };
 
+// 120Hz pulse n, as a key
+epicsUInt64 pulse(unsigned n)
+{
+    epicsUInt64 ns = 1000000000ull*1000u + n*8333333ull;
+    return ((ns/1000000000u)<<32u) | (ns%1000000000u);
+}
+
+void test_cadence()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    Cadence C;
+    testOk1(C.expected(pulse(1)));
+
+    // 10Hz
+    for(unsigned n=0; n<=48; n+=12)
+        C.update(pulse(n));
+    testOk1(C.locked());
+    testEqual(C.period, 99999996);
+
+    testOk1(!C.expected(pulse(36))); // already arrived
+    testOk1(!C.expected(pulse(49)));
+    testOk1(!C.expected(pulse(58)));
+    testOk1(C.expected(pulse(60)));
+    testOk1(C.expected(pulse(72)));
+
+    // skipped update
+    testEqual(C.update(pulse(72)), 1u);
+    testOk1(C.locked());
+
+    // changes rate
+    C.update(pulse(73));
+    testOk1(!C.locked());
+    testOk1(C.expected(pulse(74)));
+}
+
+void test_lag()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    LagHistogram H;
+    testEqual(H.quantile(0.5), 0.0);
+
+    for(size_t i=0; i<98; i++)
+        H.add(0.0);
+    H.add(0.003); // [2, 4) ms
+    H.add(100.0);
+
+    testEqual(H.count(), 100u);
+    testEqual(H.quantile(0.5), 0.001);
+    testEqual(H.quantile(0.99), 0.004);
+    testOk1(H.quantile(1.0) > 1e300);
+
+    LagHistogram prev(H);
+    H.add(0.0015);
+    testEqual(H.since(prev).count(), 1u);
+    testEqual(H.since(prev).quantile(0.5), 0.002);
+}
+
+void test_epoch()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    epicsUInt64 key = epicsUInt64(1000u)<<32u | 500000000u; // EPICS 1000.5 sec
+
+    testEqual(flushEpoch(key), 0u);
+
+    bsasFlushEpoch = 1.0;
+    testEqual(flushEpoch(key), 631153000u);
+    bsasFlushEpoch = 0.25;
+    testEqual(flushEpoch(key), 4u*631153000u + 2u);
+
+    // 0.6 sec before the end of an epoch, the nsec part is less than that of the age
+    bsasFlushEpoch = 1.0;
+    key = epicsUInt64(1000u)<<32u | 400000000u; // EPICS 1000.4 sec
+    testEqual(flushEpochBefore(key, 2.5), 631152997u); // 997.9 sec
+    bsasFlushEpoch = 0.0;
+}
+
+void test_hostgroup()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    epicsTimeStamp never = {0u, 0u};
+
+    HostGroup G("ioc1:5064");
+    for(size_t i=0; i<3; i++)
+        G.connected(true);
+    testEqual(G.nChannels, 3u);
+    testEqual(G.nConnected, 3u);
+    testEqual(G.nDown, 0u);
+
+    // server goes away
+    DBRValue A(G.disconnected(never)), B(G.disconnected(never));
+    testOk1(A.valid() && A->sevr==4);
+    testOk(&A->ts==&B->ts, "one disconnect update");
+    testEqual(G.nDown, 1u);
+    testEqual(G.nLost, 2u);
+    testEqual(G.nConnected, 1u);
+
+    G.connected(false);
+    testOk1(!epicsTimeLessThan(&G.upAt, &G.downAt));
+    testOk1(epicsTimeLessThan(&G.restoredAt, &G.downAt));
+    G.connected(false);
+    testOk1(!epicsTimeLessThan(&G.restoredAt, &G.downAt));
+
+    collectorCaHostWindow = 0.0;
+    DBRValue C(G.disconnected(never)), D(G.disconnected(never));
+    collectorCaHostWindow = 0.5;
+    testOk(&C->ts!=&D->ts, "separate updates");
+    testEqual(G.nDown, 3u);
+
+    // a member whose latest update is newer than the shared disconnect
+    epicsTimeStamp last(D->ts);
+    last.secPastEpoch++;
+    DBRValue E(G.disconnected(last)), F(G.disconnected(never));
+    testOk1(epicsTimeLessThan(&last, &E->ts));
+    testOk(&E->ts!=&D->ts, "not older than the last update");
+    testOk(&E->ts==&F->ts, "shared by later members");
+    testEqual(G.nDown, 3u);
+
+    G.leave(true);
+    testEqual(G.nChannels, 2u);
+    testEqual(G.nConnected, 0u);
+}
+
+void test_adapt()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    bsasFlushPeriod = 2.0;
+    bsasFlushMinPeriod = 0.1;
+    bsasFlushTargetRows = 120;
+    bsasFlushTargetBytes = 0;
+
+    testEqual(Collector::adaptPeriod(0.0, 0.0), 2.0);  // idle
+    testEqual(Collector::adaptPeriod(10.0, 0.0), 2.0); // slow, limited by latency
+    testEqual(Collector::adaptPeriod(240.0, 0.0), 0.5);
+    testEqual(Collector::adaptPeriod(1e6, 0.0), 0.1);  // burst
+
+    bsasFlushTargetBytes = 1000;
+    testEqual(Collector::adaptPeriod(240.0, 4000.0), 0.25); // whichever is reached first
+
+    bsasFlushEpoch = 0.2;
+    testEqual(Collector::adaptPeriod(10.0, 0.0), 0.2); // one epoch per flush
+    bsasFlushEpoch = 0.0;
+
+    bsasFlushPeriod = 0.0;
+    testEqual(Collector::adaptPeriod(240.0, 4000.0), 0.0);
+
+    bsasFlushTargetRows = bsasFlushTargetBytes = 0;
+}
+
 }
 
 MAIN(test_collector)
 {
     collectorDebug = 5;
+    testPlan(149);
+    test_cadence();
+    test_lag();
+    test_epoch();
+    test_hostgroup();
+    test_adapt();
     bsasFlushPeriod = 0.0;
-    testPlan(22);
     TEST_METHOD(TestFooBar, push_start);
     TEST_METHOD(TestFooBar, push_disconn);
+    TEST_METHOD(TestFooBar, group_disconn);
+    TEST_METHOD(TestFooBar, hold_epoch);
+    TEST_METHOD(TestFooBar, hold_aged);
+    TEST_METHOD(TestPacked, disconn_order);
+    bsasSpillMB = 1;
+    TEST_METHOD(TestFooBar, spill_overflow);
+    bsasSpillMB = 0;
+
+    bsasFlushPeriod = 2.0;
+    bsasFlushMinPeriod = 0.1;
+    bsasFlushTargetRows = 1;
+    TEST_METHOD(TestFooBar, burst_min_holdoff);
+    bsasFlushTargetRows = 0;
+    bsasFlushPeriod = 0.0;
     return testDone();
 }
@@ -0,0 +1,136 @@
+
+#include <testMain.h>
+#include <epicsMath.h>
+#include <errlog.h>
+#include <pv/pvUnitTest.h>
+#include <pv/current_function.h>
+#include <pv/sharedVector.h>
+
+#include "derived.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+// columns A, B, and the result
+struct TestDerived {
+    std::vector<std::string> names;
+    Receiver::slices_t slices;
+
+    TestDerived()
+    {
+        names.push_back("A");
+        names.push_back("B");
+        names.push_back("OUT");
+    }
+
+    template<typename T>
+    void push(size_t r, size_t c, T v, epicsUInt16 sevr=0)
+    {
+        slices.resize(std::max(slices.size(), r+1));
+
+        Receiver::slices_t::value_type& slice = slices[r];
+        slice.first = 0x100000000ull + r;
+        slice.second.resize(3);
+
+        DBRValue V(new DBRValue::Holder);
+        V->sevr = sevr;
+        V->stat = sevr ? 1 : 0;
+        V->ts.secPastEpoch = 1;
+        V->ts.nsec = r;
+        V->count = 1;
+
+        pvd::shared_vector<T> temp(1);
+        temp[0] = v;
+        V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+
+        slice.second.at(c) = V;
+    }
+
+    double result(size_t r)
+    {
+        const DBRValue& V = slices.at(r).second.at(2);
+        if(!V.valid())
+            return -999.0;
+        return pvd::static_shared_vector_cast<const double>(V->buffer)[0];
+    }
+
+    void eval(const char *expr)
+    {
+        for(size_t r=0; r<slices.size(); r++)
+            slices[r].second.at(2).reset();
+
+        Derived D(expr, names);
+        D.evaluate(slices, 2);
+    }
+
+    void test_split()
+    {
+        std::string name, expr;
+
+        testOk1(!Derived::split("TST:PV:1", name, expr));
+        testOk1(Derived::split(" XDIFF ={A}-{B}", name, expr));
+        testEqual(name, "XDIFF");
+        testEqual(expr, "{A}-{B}");
+        testThrows(std::runtime_error, Derived::split("={A}", name, expr));
+    }
+
+    void test_compile()
+    {
+        Derived D("{A} - {B}*{A}", names);
+        testEqual(D.prog.size(), 5u);
+        testEqual(D.inputs.size(), 2u);
+        testEqual(D.depth, 3u);
+
+        testThrows(std::runtime_error, Derived("{C}", names));
+        testThrows(std::runtime_error, Derived("({A}", names));
+        testThrows(std::runtime_error, Derived("{A}+", names));
+        testThrows(std::runtime_error, Derived("foo({A})", names));
+        testThrows(std::runtime_error, Derived("{A} {B}", names));
+        testThrows(std::runtime_error, Derived("", names));
+    }
+
+    void test_eval()
+    {
+        push<double>(0, 0, 3.0);
+        push<double>(0, 1, 1.0, 1);
+        push<double>(1, 0, 4.0);        // B missing
+        push<pvd::int32>(2, 0, 5);      // mixed types
+        push<double>(2, 1, 0.5);
+        push<double>(3, 0, 1.0);
+        push<double>(3, 1, 2.0, 4);     // B disconnected
+
+        eval("{A}-{B}");
+        testEqual(result(0), 2.0);
+        testEqual(slices[0].second[2]->sevr, 1u);
+        testEqual(slices[0].second[2]->ts.nsec, 0u);
+        testOk1(!slices[1].second[2].valid());
+        testEqual(result(2), 4.5);
+        testEqual(slices[2].second[2]->sevr, 0u);
+        testOk1(!slices[3].second[2].valid());
+
+        eval("-{A}+2*{B}^2");
+        testEqual(result(0), -1.0);
+
+        eval("2^3^2 + 0*{A}");
+        testEqual(result(0), 512.0);
+
+        eval("max({A}, {B}) / min({A}, {B})");
+        testEqual(result(0), 3.0);
+
+        eval("sqrt(abs(-{A}-1))");
+        testEqual(result(0), 2.0);
+        testEqual(result(1), sqrt(5.0)); // only uses A
+    }
+};
+
+} // namespace
+
+MAIN(test_derived)
+{
+    testPlan(26);
+    TEST_METHOD(TestDerived, test_split);
+    TEST_METHOD(TestDerived, test_compile);
+    TEST_METHOD(TestDerived, test_eval);
+    return testDone();
+}
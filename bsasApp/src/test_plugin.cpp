@@ -0,0 +1,107 @@
+
+#include <testMain.h>
+#include <epicsThread.h>
+#include <pv/pvUnitTest.h>
+#include <pv/current_function.h>
+
+#include "plugin.h"
+
+namespace {
+
+struct BlockingReceiver : public Receiver
+{
+    epicsMutex mutex;
+    epicsEvent arrived, release;
+    std::vector<std::string> mynames;
+    size_t nslices, nbatches;
+    bool block;
+    epicsThreadId caller;
+
+    BlockingReceiver() :nslices(0u), nbatches(0u), block(false), caller(0) {}
+
+    virtual void names(const std::vector<std::string>& n) {
+        Guard G(mutex);
+        mynames = n;
+    }
+    virtual void slices(const slices_t& s) {
+        bool wait;
+        {
+            Guard G(mutex);
+            nslices += s.size();
+            nbatches++;
+            caller = epicsThreadGetIdSelf();
+            wait = block;
+        }
+        arrived.signal();
+        if(wait)
+            release.wait();
+    }
+};
+
+Receiver::slices_t batch(size_t n)
+{
+    Receiver::slices_t s(n);
+    for(size_t i=0; i<n; i++)
+        s[i].first = i+1u;
+    return s;
+}
+
+void test_deliver()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    BlockingReceiver *inner = new BlockingReceiver;
+    PluginReceiver P(inner, "test");
+
+    std::vector<std::string> names;
+    names.push_back("foo");
+    P.names(names);
+    P.slices(batch(3));
+
+    testOk1(inner->arrived.wait(5.0));
+    {
+        Guard G(inner->mutex);
+        testEqual(inner->mynames.size(), 1u);
+        testEqual(inner->nslices, 3u);
+        testOk(inner->caller!=epicsThreadGetIdSelf(), "delivered on plugin thread");
+    }
+}
+
+void test_drop()
+{
+    testDiag("%s", CURRENT_FUNCTION);
+
+    BlockingReceiver *inner = new BlockingReceiver;
+    inner->block = true;
+    PluginReceiver P(inner, "test");
+
+    P.slices(batch(1));
+    testOk1(inner->arrived.wait(5.0)); // now blocked
+
+    for(size_t i=0; i<6; i++)
+        P.slices(batch(1));
+    {
+        Guard G(P.mutex);
+        testEqual(P.nDropped, 2u); // queue limit 4
+    }
+
+    {
+        Guard G(inner->mutex);
+        inner->block = false;
+    }
+    inner->release.signal();
+    P.close(); // delivers the remainder
+
+    Guard G(inner->mutex);
+    testEqual(inner->nbatches, 5u);
+}
+
+} // namespace
+
+MAIN(test_plugin)
+{
+    testPlan(7);
+    test_deliver();
+    test_drop();
+    return testDone();
+}
@@ -5,13 +5,25 @@
 #include <pv/pvUnitTest.h>
 #include <pv/current_function.h>
 #include <pv/sharedVector.h>
+#include <pv/createRequest.h>
 
 #include "receiver_pva.h"
+#include "compress.h"
 
 namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
 
 namespace {
 
+struct TestRequester : public pva::MonitorRequester {
+    virtual ~TestRequester() {}
+    virtual std::string getRequesterName() { return "TestRequester"; }
+    virtual void monitorConnect(pvd::Status const & status,
+                                pva::Monitor::shared_pointer const & monitor, pvd::StructureConstPtr const & structure) {}
+    virtual void monitorEvent(pva::Monitor::shared_pointer const & monitor) {}
+    virtual void unlisten(pva::Monitor::shared_pointer const & monitor) {}
+};
+
 struct TestPVA {
     CAContext ctxt;
     epics::auto_ptr<Collector> collect;
@@ -50,6 +62,99 @@ struct TestPVA {
         slice.second.at(c) = V;
     }
 
+    void push_string(const epicsTimeStamp& ts, size_t r, size_t c, const char *v)
+    {
+        slices.resize(std::max(slices.size(), r+1));
+
+        Receiver::slices_t::value_type& slice = slices[r];
+        slice.second.resize(2);
+
+        DBRValue V(new DBRValue::Holder);
+        V->sevr = V->stat = 0;
+        V->ts = ts;
+        V->count = 1;
+
+        pvd::shared_vector<std::string> temp(1);
+        temp[0] = v;
+        V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+
+        slice.second.at(c) = V;
+    }
+
+    // column 'bar' is a string, with one missing value
+    void fill_string()
+    {
+        epicsTimeStamp T;
+        epicsTimeGetCurrent(&T);
+        push_scalar(T, 0, 0, 1.0);
+        push_string(T, 0, 1, "A");
+        T.nsec++;
+        push_scalar(T, 1, 0, 2.0);
+        push_string(T, 1, 1, "B");
+        T.nsec++;
+        push_scalar(T, 2, 0, 3.0);
+        T.nsec++;
+        push_scalar(T, 3, 0, 4.0);
+        push_string(T, 3, 1, "A");
+
+        // first update discovers the type change
+        R->slices(slices);
+        R->slices(slices);
+        testShow()<<R->changed<<"\n"<<R->root;
+    }
+
+    void test_string()
+    {
+        fill_string();
+
+        pvd::shared_vector<std::string> arr(4);
+        arr[0] = "A";
+        arr[1] = "B";
+        arr[3] = "A";
+        testFieldEqual<pvd::PVStringArray>(R->root, "value.bar", pvd::freeze(arr));
+        testOk1(!R->root->getSubField("dictionary"));
+    }
+
+    // compressed array is expanded when published
+    void test_packed()
+    {
+        if(!Compressor::available()) {
+            testSkip(3, "Built without compression support");
+            return;
+        }
+
+        pvd::shared_vector<double> raw(256);
+        for(size_t i=0; i<raw.size(); i++)
+            raw[i] = i;
+        pvd::shared_vector<const void> craw(pvd::static_shared_vector_cast<const void>(pvd::freeze(raw))), packed;
+
+        testOk1(Compressor::pack(craw, packed));
+
+        epicsTimeStamp T0;
+        epicsTimeGetCurrent(&T0);
+        push_scalar(T0, 0, 1, 1.0);
+
+        DBRValue V(new DBRValue::Holder);
+        V->sevr = V->stat = 0;
+        V->ts = T0;
+        V->count = 256;
+        V->packed = true;
+        V->packed_type = pvd::pvDouble;
+        V->buffer = packed;
+        slices[0].second.at(0) = V;
+
+        // first update discovers the type change
+        R->slices(slices);
+        R->slices(slices);
+        testShow()<<R->changed<<"\n"<<R->root;
+
+        pvd::PVUnionArray::const_svector cells(R->root->getSubFieldT<pvd::PVUnionArray>("value.foo")->view());
+        testEqual(cells.size(), 1u);
+
+        pvd::PVDoubleArrayPtr arr(cells.at(0)->get<pvd::PVDoubleArray>());
+        testOk1(arr && arr->view()==pvd::static_shared_vector_cast<const double>(craw));
+    }
+
     void test_simple()
     {
         epicsTimeStamp T0;
@@ -80,13 +185,266 @@ struct TestPVA {
             testFieldEqual<pvd::PVDoubleArray>(R->root, "value.bar", pvd::freeze(arr));
         }
     }
+
+    // large batch posted in parts
+    void test_split()
+    {
+        epicsTimeStamp T;
+        epicsTimeGetCurrent(&T);
+        for(size_t r=0; r<3; r++) {
+            push_scalar(T, r, 0, 1.0+r);
+            push_scalar(T, r, 1, 4.0+r);
+            T.nsec++;
+        }
+
+        testEqual(PVAReceiver::splitPost(slices, 0u), 3u);
+
+        // 24 bytes per row
+        bsasMaxPostBytes = 50;
+        testEqual(PVAReceiver::splitPost(slices, 0u), 2u);
+        bsasMaxPostBytes = 0;
+
+        bsasMaxPostRows = 2;
+        testEqual(PVAReceiver::splitPost(slices, 0u), 2u);
+        testEqual(PVAReceiver::splitPost(slices, 2u), 3u);
+
+        R->slices(slices);
+        bsasMaxPostRows = 0;
+        bsasMaxPostBytes = 16*1024*1024;
+        testShow()<<R->root;
+
+        // root now holds the last part
+        {
+            pvd::shared_vector<double> arr(1);
+            arr[0] = 3.0;
+            testFieldEqual<pvd::PVDoubleArray>(R->root, "value.foo", pvd::freeze(arr));
+        }
+        testFieldEqual<pvd::PVUInt>(R->root, "batch.part", 1u);
+        testFieldEqual<pvd::PVBoolean>(R->root, "batch.more", false);
+        testFieldEqual<pvd::PVULong>(R->root, "batch.epoch", 0u); // bsasFlushEpoch not set
+    }
+
+    // a slow client gets every part of a batch, or none
+    void test_fifo()
+    {
+        epicsTimeStamp T;
+        epicsTimeGetCurrent(&T);
+        for(size_t r=0; r<10; r++) {
+            push_scalar(T, r, 0, 1.0+r);
+            push_scalar(T, r, 1, 4.0+r);
+            T.nsec++;
+        }
+        R->slices(slices); // opens with type
+
+        std::tr1::shared_ptr<TestRequester> req(new TestRequester);
+        pva::Monitor::shared_pointer mon(R->builder->createMonitor(req, pvd::createRequest("field()")));
+        mon->start();
+        size_t ninitial = 0u;
+        while(pva::MonitorElement::shared_pointer E = mon->poll()) {
+            ninitial++;
+            mon->release(E);
+        }
+        testEqual(ninitial, 1u);
+        R->clientStats();
+
+        // 10 parts, more than the default queue size of 4.  Client does not poll.
+        bsasMaxPostRows = 1;
+        R->slices(slices);
+        // queue is full.  This batch is not sent at all
+        R->slices(slices);
+        bsasMaxPostRows = 0;
+
+        PVAReceiver::ClientStats stats(R->clientStats());
+        testEqual(stats.nDropped, 1u);
+        testEqual(stats.nDecimated, 0u);
+
+        size_t nparts = 0u, nrows = 0u;
+        bool inorder = true, full = true;
+        pvd::uint32 batch = 0u;
+        while(pva::MonitorElement::shared_pointer E = mon->poll()) {
+            pvd::uint32 part = E->pvStructurePtr->getSubFieldT<pvd::PVUInt>("batch.part")->get();
+            if(nparts==0u)
+                batch = E->pvStructurePtr->getSubFieldT<pvd::PVUInt>("batch.id")->get();
+            inorder &= part==nparts && batch==E->pvStructurePtr->getSubFieldT<pvd::PVUInt>("batch.id")->get();
+            full &= E->pvStructurePtr->getSubFieldT<pvd::PVUInt>("decimation")->get()==1u;
+            nrows += E->pvStructurePtr->getSubFieldT<pvd::PVDoubleArray>("value.foo")->view().size();
+            nparts++;
+            mon->release(E);
+        }
+        testEqual(nparts, 10u);
+        testEqual(nrows, 10u);
+        testOk(inorder, "parts of one batch, in order");
+        testOk(full, "not decimated");
+    }
+
+    // successive values packed in one block are published without a copy
+    void test_slab()
+    {
+        ScalarSlab slab;
+        epicsTimeStamp T;
+        epicsTimeGetCurrent(&T);
+        for(size_t r=0; r<3; r++) {
+            push_scalar(T, r, 1, 4.0+r);
+
+            const double v = 1.0+r;
+            DBRValue V(new DBRValue::Holder);
+            V->sevr = V->stat = 0;
+            V->ts = T;
+            V->count = 1;
+            V->buffer = slab.add(pvd::pvDouble, &v, 4u);
+            slices[r].second.at(0) = V;
+            T.nsec++;
+        }
+        testEqual(slices[0].second[0]->type(), pvd::pvDouble);
+
+        R->slices(slices);
+        pvd::PVDoubleArrayPtr foo(R->root->getSubFieldT<pvd::PVDoubleArray>("value.foo"));
+        testShow()<<R->root;
+
+        testOk1(static_cast<const void*>(foo->view().data())==slab.block.data());
+        testEqual(foo->view().size(), 3u);
+        testEqual(foo->view().at(2), 3.0);
+
+        // missing value.  copied and filled
+        slices[1].second[0].reset();
+        R->slices(slices);
+        testOk1(static_cast<const void*>(foo->view().data())!=slab.block.data());
+        testOk1(isnan(foo->view().at(1)));
+        testEqual(foo->view().at(2), 3.0);
+
+        // values already handed out are kept when the block fills
+        const double v = 4.0;
+        slab.add(pvd::pvDouble, &v, 4u);
+        const pvd::int32 i = 5;
+        pvd::shared_vector<const void> ival(slab.add(pvd::pvInt, &i, 4u));
+        testEqual(ival.original_type(), pvd::pvInt);
+        testEqual(*static_cast<const double*>(slices[2].second[0]->buffer.data()), 3.0);
+    }
+
+    // update for a slow client
+    void test_decimate()
+    {
+        epicsTimeStamp T;
+        epicsTimeGetCurrent(&T);
+        for(size_t r=0; r<3; r++) {
+            push_scalar(T, r, 0, 1.0+r);
+            push_scalar(T, r, 1, 4.0+r);
+            T.nsec++;
+        }
+
+        R->slices(slices);
+
+        pvd::PVStructurePtr dec(PVAReceiver::decimate(*R->root, 2u));
+        testShow()<<dec;
+
+        {
+            pvd::shared_vector<double> arr(2);
+            arr[0] = 1.0;
+            arr[1] = 3.0;
+            testFieldEqual<pvd::PVDoubleArray>(dec, "value.foo", pvd::freeze(arr));
+        }
+        {
+            pvd::shared_vector<double> arr(2);
+            arr[0] = 4.0;
+            arr[1] = 6.0;
+            testFieldEqual<pvd::PVDoubleArray>(dec, "value.bar", pvd::freeze(arr));
+        }
+        testEqual(dec->getSubFieldT<pvd::PVUIntArray>("value.nanoseconds")->view().size(), 2u);
+        testFieldEqual<pvd::PVUInt>(dec, "decimation", 2u);
+        // full rate original unchanged
+        testFieldEqual<pvd::PVUInt>(R->root, "decimation", 1u);
+    }
+};
+
+struct TestDictionary {
+    TestDictionary() { bsasStringDictionary = 1; }
+    ~TestDictionary() { bsasStringDictionary = 0; }
+
+    void test_string()
+    {
+        TestPVA T;
+        T.fill_string();
+
+        {
+            pvd::shared_vector<pvd::uint32> arr(4);
+            arr[0] = 1;
+            arr[1] = 2;
+            arr[2] = 0; // missing
+            arr[3] = 1;
+            testFieldEqual<pvd::PVUIntArray>(T.R->root, "value.bar", pvd::freeze(arr));
+        }
+        {
+            pvd::shared_vector<std::string> arr(3);
+            arr[1] = "A";
+            arr[2] = "B";
+            testFieldEqual<pvd::PVStringArray>(T.R->root, "dictionary.bar", pvd::freeze(arr));
+        }
+    }
+
+    // an empty string is not the same as a missing value
+    void test_empty()
+    {
+        TestPVA T;
+        epicsTimeStamp ts;
+        epicsTimeGetCurrent(&ts);
+        T.push_string(ts, 0, 1, "");
+        T.push_string(ts, 1, 1, "A");
+        T.push_scalar(ts, 2, 0, 1.0);
+
+        T.R->slices(T.slices);
+        T.R->slices(T.slices);
+
+        {
+            pvd::shared_vector<pvd::uint32> arr(3);
+            arr[0] = 1;
+            arr[1] = 2;
+            arr[2] = 0; // missing
+            testFieldEqual<pvd::PVUIntArray>(T.R->root, "value.bar", pvd::freeze(arr));
+        }
+        {
+            pvd::shared_vector<std::string> arr(3);
+            arr[2] = "A";
+            testFieldEqual<pvd::PVStringArray>(T.R->root, "dictionary.bar", pvd::freeze(arr));
+        }
+    }
+
+    // past bsasStringDictionaryMax a column is published expanded
+    void test_full()
+    {
+        bsasStringDictionaryMax = 1;
+        TestPVA T;
+        T.fill_string();
+
+        // this post is still encoded, with a complete dictionary
+        testOk1(!!T.R->root->getSubField<pvd::PVUIntArray>("value.bar"));
+        testEqual(T.R->root->getSubFieldT<pvd::PVStringArray>("dictionary.bar")->view().size(), 3u);
+
+        T.R->slices(T.slices);
+        bsasStringDictionaryMax = 4096;
+
+        pvd::shared_vector<std::string> arr(4);
+        arr[0] = "A";
+        arr[1] = "B";
+        arr[3] = "A";
+        testFieldEqual<pvd::PVStringArray>(T.R->root, "value.bar", pvd::freeze(arr));
+        testOk1(!T.R->root->getSubField("dictionary"));
+    }
 };
 
 } // namespace
 
 MAIN(test_receiver)
 {
-    testPlan(3);
+    testPlan(54);
     TEST_METHOD(TestPVA, test_simple);
+    TEST_METHOD(TestPVA, test_split);
+    TEST_METHOD(TestPVA, test_fifo);
+    TEST_METHOD(TestPVA, test_slab);
+    TEST_METHOD(TestPVA, test_decimate);
+    TEST_METHOD(TestPVA, test_packed);
+    TEST_METHOD(TestPVA, test_string);
+    TEST_METHOD(TestDictionary, test_string);
+    TEST_METHOD(TestDictionary, test_empty);
+    TEST_METHOD(TestDictionary, test_full);
     return testDone();
 }
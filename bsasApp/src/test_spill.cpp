@@ -0,0 +1,113 @@
+
+#include <testMain.h>
+#include <errlog.h>
+#include <pv/pvUnitTest.h>
+#include <pv/current_function.h>
+#include <pv/sharedVector.h>
+
+#include "spill.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+struct TestSpill {
+    SpillFile::cells_t cells;
+
+    template<typename T>
+    void push(const T& v, size_t count=1u, epicsUInt16 sevr=0)
+    {
+        DBRValue V(new DBRValue::Holder);
+        V->sevr = sevr;
+        V->stat = sevr ? 1 : 0;
+        V->ts.secPastEpoch = 1000u;
+        V->ts.nsec = 42u + cells.size();
+        V->arrival = V->ts;
+        V->count = count;
+
+        pvd::shared_vector<T> temp(count, v);
+        V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+        V->track();
+
+        cells.push_back(V);
+    }
+
+    void test_roundtrip()
+    {
+        SpillFile F(1u<<20u);
+        testOk1(F.empty());
+
+        push<double>(1.5);
+        cells.push_back(DBRValue()); // missing
+        push<std::string>("hello", 2u);
+        {
+            DBRValue D(new DBRValue::Holder); // disconnect.  no buffer
+            cells.push_back(D);
+        }
+        push<pvd::int32>(-7, 3u, 2u);
+
+        testOk1(F.put(0x1234u, cells));
+        testEqual(cells.size(), 0u);
+        testEqual(F.size(), 1u);
+        testEqual(F.front(), 0x1234u);
+        testOk1(F.used()>0u);
+
+        testOk1(!F.take(0x1235u, cells));
+        testOk1(F.take(0x1234u, cells));
+        testOk1(F.empty());
+        testEqual(F.used(), 0u);
+
+        testEqual(cells.size(), 5u);
+        testOk1(!cells.at(1).valid());
+
+        testEqual(cells.at(0)->ts.nsec, 42u);
+        testEqual(cells.at(0)->type(), pvd::pvDouble);
+        testEqual(pvd::static_shared_vector_cast<const double>(cells.at(0)->buffer).at(0), 1.5);
+
+        testEqual(cells.at(2)->type(), pvd::pvString);
+        testEqual(cells.at(2)->count, 2u);
+        testEqual(pvd::static_shared_vector_cast<const std::string>(cells.at(2)->buffer).at(1), "hello");
+
+        testEqual(cells.at(3)->sevr, 4u);
+        testOk1(cells.at(3)->buffer.empty());
+
+        pvd::shared_vector<const pvd::int32> I(pvd::static_shared_vector_cast<const pvd::int32>(cells.at(4)->buffer));
+        testEqual(cells.at(4)->sevr, 2u);
+        testEqual(I.size(), 3u);
+        testEqual(I.at(2), -7);
+    }
+
+    void test_full()
+    {
+        SpillFile F(4096u);
+
+        push<double>(0.0, 100u); // 800 bytes
+
+        size_t n = 0u;
+        for(; n<10u; n++) {
+            SpillFile::cells_t temp(cells);
+            if(!F.put(n, temp)) {
+                testEqual(temp.size(), 1u); // unchanged when full
+                break;
+            }
+        }
+        testEqual(n, 4u);
+
+        // space is reused once emptied
+        SpillFile::cells_t temp;
+        for(size_t k=0u; k<n; k++)
+            testOk1(F.take(k, temp));
+        temp = cells;
+        testOk1(F.put(100u, temp));
+    }
+};
+
+} // namespace
+
+MAIN(test_spill)
+{
+    testPlan(30);
+    TEST_METHOD(TestSpill, test_roundtrip);
+    TEST_METHOD(TestSpill, test_full);
+    return testDone();
+}
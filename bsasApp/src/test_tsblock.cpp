@@ -0,0 +1,175 @@
+
+#include <testMain.h>
+#include <epicsMath.h>
+#include <errlog.h>
+#include <pv/pvUnitTest.h>
+#include <pv/current_function.h>
+#include <pv/sharedVector.h>
+
+#include "tsblock.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+struct TestTSBlock {
+    Receiver::slices_t slices;
+
+    // rows at 120Hz starting just before a second boundary
+    void rows(size_t N, size_t ncols)
+    {
+        slices.resize(N);
+        for(size_t r=0; r<N; r++) {
+            epicsUInt64 ns = 999000000ull + r*8333333ull;
+            slices[r].first = ((1000000000ull + ns/1000000000ull)<<32) | (ns%1000000000ull);
+            slices[r].second.resize(ncols);
+        }
+    }
+
+    template<typename T>
+    void push(size_t r, size_t c, T v, epicsUInt16 sevr=0)
+    {
+        DBRValue V(new DBRValue::Holder);
+        V->sevr = sevr;
+        V->stat = sevr ? 1 : 0;
+        V->ts.secPastEpoch = slices[r].first>>32;
+        V->ts.nsec = epicsUInt32(slices[r].first);
+        V->count = 1;
+
+        pvd::shared_vector<T> temp(1);
+        temp[0] = v;
+        V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+
+        slices.at(r).second.at(c) = V;
+    }
+
+    void test_empty()
+    {
+        TSBlock B(slices);
+        testEqual(B.rows(), 0u);
+        testEqual(B.columns(), 0u);
+
+        TSBlock C(B.bytes());
+        testEqual(C.rows(), 0u);
+    }
+
+    void test_keys()
+    {
+        rows(300, 0);
+        slices[17].first += 12345u; // jitter
+
+        TSBlock B(slices);
+        std::vector<epicsUInt64> keys;
+        TSBlock(B.bytes()).keys(keys);
+
+        bool match = keys.size()==slices.size();
+        for(size_t r=0; match && r<keys.size(); r++)
+            match = keys[r]==slices[r].first;
+        testOk(match, "keys round trip");
+        // mostly one byte per delta-of-delta
+        testOk(B.bytes().size() < 400u, "%u bytes", unsigned(B.bytes().size()));
+
+        // not a valid time.  stored as raw keys
+        slices[3].first |= 0xffffffffu;
+        TSBlock(slices).keys(keys);
+        testEqual(keys.at(3), slices[3].first);
+        testEqual(keys.at(4), slices[4].first);
+    }
+
+    void test_values()
+    {
+        rows(4, 3);
+        push<double>(0, 0, 1.5);
+        push<double>(1, 0, 1.5, 2);
+        // row 2 missing
+        push<double>(3, 0, -1e300);
+
+        push<pvd::int64>(0, 1, -5);
+        push<pvd::int64>(1, 1, 0x7fffffffffffffffll);
+        push<pvd::int64>(2, 1, -0x7fffffffffffffffll-1); // wraps around
+        push<pvd::int64>(3, 1, 7);
+
+        push<std::string>(0, 2, "hello");
+
+        TSBlock B(TSBlock(slices).bytes());
+        testEqual(B.columns(), 3u);
+        testOk1(B.retained(0));
+        testEqual(B.type(0), pvd::pvDouble);
+        testEqual(B.type(1), pvd::pvLong);
+        testOk1(!B.retained(2));
+
+        std::vector<double> D;
+        std::vector<epicsUInt16> sevr;
+        B.column(0, D, sevr);
+        testEqual(D.at(0), 1.5);
+        testEqual(D.at(1), 1.5);
+        testOk1(isnan(D.at(2)));
+        testEqual(D.at(3), -1e300);
+        testEqual(sevr.at(1), 2u);
+        testEqual(sevr.at(2), 4u);
+
+        std::vector<epicsInt64> I;
+        B.column(1, I, sevr);
+        testEqual(I.at(0), -5);
+        testEqual(I.at(1), 0x7fffffffffffffffll);
+        testEqual(I.at(2), -0x7fffffffffffffffll-1);
+        testEqual(I.at(3), 7);
+        testEqual(sevr.at(3), 0u);
+
+        testThrows(std::logic_error, B.column(2, D, sevr));
+    }
+
+    // smooth single precision signal, and a counter
+    void test_ratio()
+    {
+        const size_t N = 1200;
+        rows(N, 2);
+        for(size_t r=0; r<N; r++) {
+            push<float>(r, 0, float(sin(r/100.0)));
+            push<pvd::int32>(r, 1, pvd::int32(r));
+        }
+
+        TSBlock B(slices);
+        size_t raw = N*(8u + 2u*(8u+2u)); // key, value and severity
+        testOk(B.bytes().size()*2u < raw, "%u of %u bytes", unsigned(B.bytes().size()), unsigned(raw));
+
+        std::vector<double> D;
+        std::vector<epicsUInt16> sevr;
+        B.column(0, D, sevr);
+        bool match = true;
+        for(size_t r=0; match && r<N; r++)
+            match = D[r]==float(sin(r/100.0));
+        testOk(match, "values round trip");
+    }
+
+    void test_corrupt()
+    {
+        rows(10, 1);
+        for(size_t r=0; r<10; r++)
+            push<double>(r, 0, r);
+
+        pvd::shared_vector<const pvd::uint8> bytes(TSBlock(slices).bytes());
+
+        pvd::shared_vector<const pvd::uint8> trunc(bytes);
+        trunc.slice(0, bytes.size()-3);
+        testThrows(std::runtime_error, TSBlock B(trunc));
+
+        pvd::shared_vector<pvd::uint8> bad(bytes.size());
+        std::copy(bytes.begin(), bytes.end(), bad.begin());
+        bad[0] = 'X';
+        testThrows(std::runtime_error, TSBlock B(pvd::freeze(bad)));
+    }
+};
+
+} // namespace
+
+MAIN(test_tsblock)
+{
+    testPlan(28);
+    TEST_METHOD(TestTSBlock, test_empty);
+    TEST_METHOD(TestTSBlock, test_keys);
+    TEST_METHOD(TestTSBlock, test_values);
+    TEST_METHOD(TestTSBlock, test_ratio);
+    TEST_METHOD(TestTSBlock, test_corrupt);
+    return testDone();
+}
@@ -0,0 +1,618 @@
+
+#include <string.h>
+
+#include <stdexcept>
+#include <algorithm>
+
+#include <epicsMath.h>
+
+#include "tsblock.h"
+
+namespace pvd = epics::pvData;
+
+/* Layout
+ *
+ *   "TSB1"
+ *   varint  #rows
+ *   varint  #columns
+ *   uint8   key mode.  0 - nanoseconds, 1 - raw keys (some nsec >= 1e9)
+ *   if #rows>0
+ *     uint64  first key (little endian)
+ *     svarint first delta, then svarint delta-of-delta for each following row
+ *   for each column
+ *     uint8   ScalarType, or 0xff if not retained
+ *     if retained
+ *       bitmap  ceil(#rows/8) bytes, LSB first.  1 for valid rows
+ *       uint8   severity mode.  0 - all 0, 1 - 2 bits per valid row follows
+ *       ...     packed severities, MSB first
+ *       varint  #bytes of values
+ *       ...     values of valid rows, MSB first bit stream
+ *                float:   first value as 64 bits, then XOR coded
+ *                integer: svarint first value, uint8 bit width, then packed zig-zag deltas
+ */
+
+namespace {
+
+const char magic[4] = {'T', 'S', 'B', '1'};
+const pvd::uint8 notRetained = 0xff;
+const epicsUInt64 nsPerSec = 1000000000u;
+
+inline epicsUInt64 zigzag(epicsInt64 v)
+{
+    return (epicsUInt64(v)<<1u) ^ epicsUInt64(v>>63);
+}
+
+inline epicsInt64 unzigzag(epicsUInt64 v)
+{
+    return epicsInt64(v>>1u) ^ -epicsInt64(v&1u);
+}
+
+inline unsigned clz64(epicsUInt64 v)
+{
+#ifdef __GNUC__
+    return v ? __builtin_clzll(v) : 64u;
+#else
+    unsigned n = 0u;
+    for(epicsUInt64 mask = epicsUInt64(1u)<<63; mask && !(v&mask); mask>>=1)
+        n++;
+    return n;
+#endif
+}
+
+inline unsigned ctz64(epicsUInt64 v)
+{
+#ifdef __GNUC__
+    return v ? __builtin_ctzll(v) : 64u;
+#else
+    unsigned n = 0u;
+    for(epicsUInt64 mask = 1u; mask && !(v&mask); mask<<=1)
+        n++;
+    return n;
+#endif
+}
+
+inline epicsUInt64 double2bits(double v)
+{
+    epicsUInt64 ret;
+    memcpy(&ret, &v, sizeof(ret));
+    return ret;
+}
+
+inline double bits2double(epicsUInt64 v)
+{
+    double ret;
+    memcpy(&ret, &v, sizeof(ret));
+    return ret;
+}
+
+struct Writer {
+    std::vector<pvd::uint8>& out;
+    explicit Writer(std::vector<pvd::uint8>& out) :out(out) {}
+
+    void byte(pvd::uint8 b) { out.push_back(b); }
+    void raw64(epicsUInt64 v) {
+        for(unsigned i=0; i<8u; i++)
+            out.push_back(pvd::uint8(v>>(8u*i)));
+    }
+    void varint(epicsUInt64 v) {
+        while(v>=0x80u) {
+            out.push_back(pvd::uint8(v|0x80u));
+            v >>= 7u;
+        }
+        out.push_back(pvd::uint8(v));
+    }
+    void svarint(epicsInt64 v) { varint(zigzag(v)); }
+};
+
+struct Reader {
+    const pvd::uint8 *pos, *end;
+    Reader(const pvd::uint8 *pos, const pvd::uint8 *end) :pos(pos), end(end) {}
+
+    void need(size_t n) {
+        if(size_t(end-pos) < n)
+            throw std::runtime_error("Truncated TSBlock");
+    }
+    pvd::uint8 byte() { need(1u); return *pos++; }
+    epicsUInt64 raw64() {
+        need(8u);
+        epicsUInt64 ret = 0u;
+        for(unsigned i=0; i<8u; i++)
+            ret |= epicsUInt64(pos[i])<<(8u*i);
+        pos += 8u;
+        return ret;
+    }
+    epicsUInt64 varint() {
+        epicsUInt64 ret = 0u;
+        for(unsigned shift=0u; ; shift+=7u) {
+            if(shift>63u)
+                throw std::runtime_error("Invalid varint in TSBlock");
+            pvd::uint8 b = byte();
+            ret |= epicsUInt64(b&0x7fu)<<shift;
+            if(!(b&0x80u))
+                return ret;
+        }
+    }
+    epicsInt64 svarint() { return unzigzag(varint()); }
+    const pvd::uint8* skip(size_t n) {
+        need(n);
+        const pvd::uint8 *ret = pos;
+        pos += n;
+        return ret;
+    }
+};
+
+// MSB first bit stream
+struct BitWriter {
+    std::vector<pvd::uint8>& out;
+    epicsUInt64 acc;
+    unsigned nacc;
+    explicit BitWriter(std::vector<pvd::uint8>& out) :out(out), acc(0u), nacc(0u) {}
+
+    // append the low 'n' bits of 'v'.  n<=64
+    void put(epicsUInt64 v, unsigned n) {
+        while(n) {
+            unsigned take = std::min(n, 64u-nacc);
+            epicsUInt64 chunk = v>>(n-take);
+            if(take<64u) {
+                chunk &= (epicsUInt64(1u)<<take)-1u;
+                acc = (acc<<take) | chunk;
+            } else {
+                acc = chunk;
+            }
+            nacc += take;
+            n -= take;
+            if(nacc==64u) {
+                for(unsigned i=0; i<8u; i++)
+                    out.push_back(pvd::uint8(acc>>(56u-8u*i)));
+                acc = 0u;
+                nacc = 0u;
+            }
+        }
+    }
+    void finish() {
+        if(nacc) {
+            acc <<= 64u-nacc;
+            for(unsigned i=0; i<(nacc+7u)/8u; i++)
+                out.push_back(pvd::uint8(acc>>(56u-8u*i)));
+            acc = 0u;
+            nacc = 0u;
+        }
+    }
+};
+
+struct BitReader {
+    const pvd::uint8 *pos, *end;
+    unsigned acc, nacc;
+    BitReader(const pvd::uint8 *pos, const pvd::uint8 *end) :pos(pos), end(end), acc(0u), nacc(0u) {}
+
+    epicsUInt64 get(unsigned n) {
+        epicsUInt64 ret = 0u;
+        while(n) {
+            if(nacc==0u) {
+                if(pos==end)
+                    throw std::runtime_error("Truncated TSBlock bit stream");
+                acc = *pos++;
+                nacc = 8u;
+            }
+            unsigned take = std::min(n, nacc);
+            ret = (ret<<take) | ((acc>>(nacc-take)) & ((1u<<take)-1u));
+            nacc -= take;
+            n -= take;
+        }
+        return ret;
+    }
+};
+
+bool isFloat(pvd::ScalarType t)
+{
+    return t==pvd::pvDouble || t==pvd::pvFloat;
+}
+
+bool isInteger(pvd::ScalarType t)
+{
+    switch(t) {
+    case pvd::pvBoolean:
+    case pvd::pvByte: case pvd::pvUByte:
+    case pvd::pvShort: case pvd::pvUShort:
+    case pvd::pvInt: case pvd::pvUInt:
+    case pvd::pvLong: case pvd::pvULong:
+        return true;
+    default:
+        return false;
+    }
+}
+
+template<typename T>
+epicsInt64 loadInt(const void *P) { return epicsInt64(*static_cast<const T*>(P)); }
+
+epicsInt64 toInt(const pvd::shared_vector<const void>& buf)
+{
+    const void *P = buf.data();
+    switch(buf.original_type()) {
+    case pvd::pvBoolean: return loadInt<pvd::boolean>(P);
+    case pvd::pvByte:    return loadInt<pvd::int8>(P);
+    case pvd::pvUByte:   return loadInt<pvd::uint8>(P);
+    case pvd::pvShort:   return loadInt<pvd::int16>(P);
+    case pvd::pvUShort:  return loadInt<pvd::uint16>(P);
+    case pvd::pvInt:     return loadInt<pvd::int32>(P);
+    case pvd::pvUInt:    return loadInt<pvd::uint32>(P);
+    case pvd::pvLong:    return loadInt<pvd::int64>(P);
+    case pvd::pvULong:   return loadInt<pvd::uint64>(P);
+    default:
+        throw std::logic_error("TSBlock toInt() not an integer");
+    }
+}
+
+double toDouble(const pvd::shared_vector<const void>& buf)
+{
+    if(buf.original_type()==pvd::pvFloat)
+        return *static_cast<const float*>(buf.data());
+    return *static_cast<const double*>(buf.data());
+}
+
+void encodeFloats(const std::vector<double>& vals, std::vector<pvd::uint8>& out)
+{
+    BitWriter W(out);
+    if(vals.empty())
+        return;
+
+    epicsUInt64 prev = double2bits(vals[0]);
+    W.put(prev, 64u);
+
+    unsigned lead = 65u, trail = 0u; // no window yet
+
+    for(size_t i=1, N=vals.size(); i<N; i++) {
+        epicsUInt64 cur = double2bits(vals[i]);
+        epicsUInt64 x = cur^prev;
+        prev = cur;
+
+        if(!x) {
+            W.put(0u, 1u); // repeat
+
+        } else {
+            unsigned l = std::min(clz64(x), 31u), t = ctz64(x);
+
+            if(lead<=64u && l>=lead && t>=trail) {
+                // fits in previous window
+                W.put(2u, 2u);
+                W.put(x>>trail, 64u-lead-trail);
+            } else {
+                lead = l;
+                trail = t;
+                unsigned len = 64u-l-t;
+                W.put(3u, 2u);
+                W.put(l, 5u);
+                W.put(len-1u, 6u);
+                W.put(x>>t, len);
+            }
+        }
+    }
+    W.finish();
+}
+
+void decodeFloats(const pvd::uint8 *pos, const pvd::uint8 *end, size_t N, double *out)
+{
+    if(N==0u)
+        return;
+
+    BitReader R(pos, end);
+
+    epicsUInt64 prev = R.get(64u);
+    out[0] = bits2double(prev);
+
+    unsigned lead = 0u, trail = 0u;
+
+    for(size_t i=1; i<N; i++) {
+        if(R.get(1u)) {
+            if(R.get(1u)) {
+                lead = unsigned(R.get(5u));
+                unsigned len = unsigned(R.get(6u))+1u;
+                if(lead+len > 64u)
+                    throw std::runtime_error("Invalid TSBlock float window");
+                trail = 64u-lead-len;
+            }
+            prev ^= R.get(64u-lead-trail)<<trail;
+        }
+        out[i] = bits2double(prev);
+    }
+}
+
+void encodeInts(const std::vector<epicsInt64>& vals, std::vector<pvd::uint8>& out)
+{
+    if(vals.empty())
+        return;
+
+    Writer W(out);
+    W.svarint(vals[0]);
+
+    std::vector<epicsUInt64> deltas(vals.size()-1u);
+    epicsUInt64 all = 0u;
+    for(size_t i=1, N=vals.size(); i<N; i++) {
+        // wrap around on overflow
+        deltas[i-1] = zigzag(epicsInt64(epicsUInt64(vals[i]) - epicsUInt64(vals[i-1])));
+        all |= deltas[i-1];
+    }
+
+    unsigned width = 64u-clz64(all);
+    W.byte(pvd::uint8(width));
+
+    BitWriter B(out);
+    for(size_t i=0, N=deltas.size(); i<N; i++)
+        B.put(deltas[i], width);
+    B.finish();
+}
+
+void decodeInts(const pvd::uint8 *pos, const pvd::uint8 *end, size_t N, epicsInt64 *out)
+{
+    if(N==0u)
+        return;
+
+    Reader R(pos, end);
+    out[0] = R.svarint();
+    unsigned width = R.byte();
+    if(width>64u)
+        throw std::runtime_error("Invalid TSBlock integer width");
+
+    BitReader B(R.pos, end);
+    for(size_t i=1; i<N; i++)
+        out[i] = epicsInt64(epicsUInt64(out[i-1]) + epicsUInt64(unzigzag(B.get(width))));
+}
+
+template<typename T> struct missing_value { static T is() { return 0; } };
+template<> struct missing_value<double> { static double is() { return epicsNAN; } };
+
+} // namespace
+
+TSBlock::TSBlock()
+    :nrows(0u)
+    ,keyoffset(0u)
+{}
+
+TSBlock::TSBlock(const Receiver::slices_t& s)
+    :nrows(s.size())
+    ,keyoffset(0u)
+{
+    std::vector<pvd::uint8> out;
+    Writer W(out);
+
+    const size_t ncols = s.empty() ? 0u : s[0].second.size();
+
+    out.insert(out.end(), magic, magic+4);
+    W.varint(nrows);
+    W.varint(ncols);
+
+    bool linear = true;
+    for(size_t r=0; r<nrows; r++)
+        linear &= epicsUInt32(s[r].first) < nsPerSec;
+    W.byte(linear ? 0u : 1u);
+
+    if(nrows) {
+        epicsUInt64 prev = 0u;
+        epicsInt64 prevdelta = 0;
+
+        for(size_t r=0; r<nrows; r++) {
+            epicsUInt64 key = s[r].first;
+            if(linear)
+                key = (key>>32u)*nsPerSec + epicsUInt32(key);
+
+            if(r==0u) {
+                W.raw64(key);
+            } else {
+                epicsInt64 delta = epicsInt64(key - prev);
+                W.svarint(r==1u ? delta : epicsInt64(epicsUInt64(delta) - epicsUInt64(prevdelta)));
+                prevdelta = delta;
+            }
+            prev = key;
+        }
+    }
+
+    std::vector<double> fvals;
+    std::vector<epicsInt64> ivals;
+    std::vector<epicsUInt16> sevrs;
+    std::vector<pvd::uint8> payload;
+
+    for(size_t c=0; c<ncols; c++) {
+        // column type from first valid value
+        pvd::ScalarType type = pvd::pvDouble;
+        bool found = false;
+        for(size_t r=0; r<nrows && !found; r++) {
+            const DBRValue& cell = s[r].second.at(c);
+            if(cell.valid() && cell->sevr<=3 && cell->count==1u) {
+                type = cell->type();
+                found = true;
+            }
+        }
+
+        if(!found || (!isFloat(type) && !isInteger(type))) {
+            W.byte(notRetained);
+            continue;
+        }
+
+        const bool isfloat = isFloat(type);
+        W.byte(pvd::uint8(type));
+
+        fvals.clear();
+        ivals.clear();
+        sevrs.clear();
+        epicsUInt16 maxsevr = 0u;
+
+        size_t bitmap = out.size();
+        out.resize(out.size() + (nrows+7u)/8u, 0u);
+
+        for(size_t r=0; r<nrows; r++) {
+            const DBRValue& cell = s[r].second.at(c);
+            // values of another kind are treated as missing
+            if(!cell.valid() || cell->sevr>3 || cell->count!=1u || cell->packed
+                    || (isfloat ? !isFloat(cell->type()) : !isInteger(cell->type())))
+                continue;
+
+            out[bitmap + r/8u] |= 1u<<(r%8u);
+            sevrs.push_back(cell->sevr);
+            maxsevr = std::max(maxsevr, cell->sevr);
+
+            if(isfloat)
+                fvals.push_back(toDouble(cell->buffer));
+            else
+                ivals.push_back(toInt(cell->buffer));
+        }
+
+        W.byte(maxsevr ? 1u : 0u);
+        if(maxsevr) {
+            BitWriter B(out);
+            for(size_t i=0, N=sevrs.size(); i<N; i++)
+                B.put(sevrs[i], 2u);
+            B.finish();
+        }
+
+        payload.clear();
+        if(isfloat)
+            encodeFloats(fvals, payload);
+        else
+            encodeInts(ivals, payload);
+
+        W.varint(payload.size());
+        out.insert(out.end(), payload.begin(), payload.end());
+    }
+
+    pvd::shared_vector<pvd::uint8> temp(out.size());
+    if(!out.empty())
+        memcpy(temp.data(), &out[0], out.size());
+    encoded = pvd::freeze(temp);
+
+    parse();
+}
+
+TSBlock::TSBlock(const pvd::shared_vector<const pvd::uint8>& encoded)
+    :encoded(encoded)
+    ,nrows(0u)
+    ,keyoffset(0u)
+{
+    parse();
+}
+
+void TSBlock::parse()
+{
+    Reader R(encoded.data(), encoded.data()+encoded.size());
+
+    if(memcmp(R.skip(4u), magic, 4u)!=0)
+        throw std::runtime_error("Not a TSBlock");
+
+    nrows = R.varint();
+    size_t ncols = R.varint();
+    keyoffset = R.pos - encoded.data();
+
+    // walk keys to find the first column
+    R.byte();
+    if(nrows) {
+        R.raw64();
+        for(size_t r=1; r<nrows; r++)
+            R.varint();
+    }
+
+    cols.clear();
+    cols.reserve(ncols);
+
+    for(size_t c=0; c<ncols; c++) {
+        Col col;
+        pvd::uint8 type = R.byte();
+
+        if(type!=notRetained) {
+            col.type = pvd::ScalarType(type);
+            if(!isFloat(col.type) && !isInteger(col.type))
+                throw std::runtime_error("Invalid TSBlock column type");
+            col.retained = true;
+            col.isfloat = isFloat(col.type);
+            col.offset = R.pos - encoded.data();
+
+            const pvd::uint8 *bitmap = R.skip((nrows+7u)/8u);
+            size_t nvalid = 0u;
+            for(size_t r=0; r<nrows; r++)
+                nvalid += (bitmap[r/8u]>>(r%8u))&1u;
+
+            if(R.byte())
+                R.skip((2u*nvalid+7u)/8u);
+            R.skip(R.varint());
+        }
+
+        cols.push_back(col);
+    }
+}
+
+void TSBlock::keys(std::vector<epicsUInt64>& out) const
+{
+    out.resize(nrows);
+    if(!nrows)
+        return;
+
+    Reader R(encoded.data()+keyoffset, encoded.data()+encoded.size());
+    const bool linear = R.byte()==0u;
+
+    epicsUInt64 key = R.raw64();
+    epicsInt64 delta = 0;
+    out[0] = key;
+
+    for(size_t r=1; r<nrows; r++) {
+        epicsInt64 v = R.svarint();
+        delta = r==1u ? v : epicsInt64(epicsUInt64(delta) + epicsUInt64(v));
+        key += epicsUInt64(delta);
+        out[r] = key;
+    }
+
+    if(linear) {
+        for(size_t r=0; r<nrows; r++)
+            out[r] = ((out[r]/nsPerSec)<<32u) | (out[r]%nsPerSec);
+    }
+}
+
+template<typename T>
+void TSBlock::column(size_t c, std::vector<T>& values, std::vector<epicsUInt16>& sevr) const
+{
+    const Col& col = cols.at(c);
+    if(!col.retained)
+        throw std::logic_error("TSBlock column not retained");
+
+    Reader R(encoded.data()+col.offset, encoded.data()+encoded.size());
+
+    const pvd::uint8 *bitmap = R.skip((nrows+7u)/8u);
+    std::vector<size_t> valid;
+    valid.reserve(nrows);
+    for(size_t r=0; r<nrows; r++) {
+        if((bitmap[r/8u]>>(r%8u))&1u)
+            valid.push_back(r);
+    }
+    const size_t nvalid = valid.size();
+
+    values.assign(nrows, missing_value<T>::is());
+    sevr.assign(nrows, 4u);
+
+    if(R.byte()) {
+        size_t nbytes = (2u*nvalid+7u)/8u;
+        const pvd::uint8 *packed = R.skip(nbytes);
+        BitReader B(packed, packed+nbytes);
+        for(size_t i=0; i<nvalid; i++)
+            sevr[valid[i]] = epicsUInt16(B.get(2u));
+    } else {
+        for(size_t i=0; i<nvalid; i++)
+            sevr[valid[i]] = 0u;
+    }
+
+    size_t nbytes = R.varint();
+    const pvd::uint8 *payload = R.skip(nbytes);
+
+    if(col.isfloat) {
+        std::vector<double> temp(nvalid);
+        if(nvalid)
+            decodeFloats(payload, payload+nbytes, nvalid, &temp[0]);
+        for(size_t i=0; i<nvalid; i++)
+            values[valid[i]] = T(temp[i]);
+    } else {
+        std::vector<epicsInt64> temp(nvalid);
+        if(nvalid)
+            decodeInts(payload, payload+nbytes, nvalid, &temp[0]);
+        for(size_t i=0; i<nvalid; i++)
+            values[valid[i]] = T(temp[i]);
+    }
+}
+
+template void TSBlock::column<double>(size_t c, std::vector<double>& values, std::vector<epicsUInt16>& sevr) const;
+template void TSBlock::column<epicsInt64>(size_t c, std::vector<epicsInt64>& values, std::vector<epicsUInt16>& sevr) const;
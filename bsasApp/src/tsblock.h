@@ -0,0 +1,68 @@
+#ifndef TSBLOCK_H
+#define TSBLOCK_H
+
+#include <vector>
+
+#include <epicsTypes.h>
+#include <pv/sharedVector.h>
+#include <pv/pvIntrospect.h>
+
+#include "collector.h"
+
+/* Compact columnar encoding of completed slices, for in-memory retention.
+ *
+ * - Row keys as nanoseconds, delta-of-delta and zig-zag varint encoded.
+ * - A validity bitmap per column.  Severity packed in 2 bits, omitted when all 0.
+ * - Floating point values XOR'd with the previous value (Gorilla style).
+ * - Integer values as bit-packed zig-zag deltas.
+ *
+ * Only scalar numeric columns are retained.  Array and string columns,
+ * and alarm status codes, are not.  Each column is decoded separately.
+ */
+struct TSBlock
+{
+    TSBlock();
+    // encode all rows of 's'
+    explicit TSBlock(const Receiver::slices_t& s);
+    // wrap previously encoded bytes.  throws std::runtime_error if malformed
+    explicit TSBlock(const epics::pvData::shared_vector<const epics::pvData::uint8>& encoded);
+
+    const epics::pvData::shared_vector<const epics::pvData::uint8>& bytes() const { return encoded; }
+
+    size_t rows() const { return nrows; }
+    size_t columns() const { return cols.size(); }
+
+    // false for columns which were not retained
+    bool retained(size_t c) const { return cols.at(c).retained; }
+    // element type of the first valid value of a retained column
+    epics::pvData::ScalarType type(size_t c) const { return cols.at(c).type; }
+
+    // (sec<<32)|nsec in EPICS epoch, as Receiver::slices_t
+    void keys(std::vector<epicsUInt64>& out) const;
+
+    /* decode one column.  Missing values have severity 4, and value NaN or 0.
+     * Implemented for T = double or epicsInt64.
+     * throws std::logic_error if the column was not retained.
+     */
+    template<typename T>
+    void column(size_t c, std::vector<T>& values, std::vector<epicsUInt16>& sevr) const;
+
+private:
+    struct Col {
+        bool retained;
+        bool isfloat;
+        epics::pvData::ScalarType type;
+        // of validity bitmap
+        size_t offset;
+        Col() :retained(false), isfloat(false), type(epics::pvData::pvDouble), offset(0u) {}
+    };
+
+    epics::pvData::shared_vector<const epics::pvData::uint8> encoded;
+    size_t nrows;
+    size_t keyoffset;
+    std::vector<Col> cols;
+
+    void parse();
+};
+
+#endif // TSBLOCK_H
@@ -0,0 +1,160 @@
+/* Compression ratio and speed of TSBlock
+ *
+ *   tsblock_bench [rows.txt] [rows per block]
+ *
+ * rows.txt has one row per line as "sec nsec value value ...",
+ * with "nan" for missing values.  eg. replayed from a file written by h5tablewriter.py with
+ *
+ *   python -c 'import h5py, numpy, sys; F=h5py.File(sys.argv[1], "r");
+ *              C=[F[k][:,0] for k in sorted(F) if k not in ("secondsPastEpoch","nanoseconds")];
+ *              numpy.savetxt(sys.stdout, numpy.column_stack([F["secondsPastEpoch"][:,0], F["nanoseconds"][:,0]]+C))' file.h5
+ *
+ * Without a file, synthetic 120Hz rows with a mix of signal types are used.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <epicsTime.h>
+#include <epicsMath.h>
+
+#include "tsblock.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+template<typename T>
+DBRValue makeValue(T v)
+{
+    DBRValue V(new DBRValue::Holder);
+    V->sevr = V->stat = 0;
+    V->count = 1u;
+    pvd::shared_vector<T> temp(1, v);
+    V->buffer = pvd::static_shared_vector_cast<const void>(pvd::freeze(temp));
+    return V;
+}
+
+void readRows(const char *fname, Receiver::slices_t& rows)
+{
+    std::ifstream F(fname);
+    if(!F.is_open())
+        throw std::runtime_error(std::string("Unable to open ")+fname);
+
+    std::string line;
+    while(std::getline(F, line)) {
+        std::istringstream strm(line);
+        double sec, nsec;
+        if(!(strm>>sec>>nsec))
+            continue;
+
+        Receiver::slices_t::value_type row;
+        row.first = (epicsUInt64(sec - POSIX_TIME_AT_EPICS_EPOCH)<<32) | epicsUInt32(nsec);
+
+        std::string tok;
+        while(strm>>tok) {
+            double v = strtod(tok.c_str(), 0);
+            row.second.push_back(isnan(v) ? DBRValue() : makeValue<double>(v));
+        }
+        rows.push_back(row);
+    }
+}
+
+void synthRows(size_t N, Receiver::slices_t& rows)
+{
+    srand(42);
+    rows.resize(N);
+    for(size_t r=0; r<N; r++) {
+        epicsUInt64 ns = r*8333333ull;
+        rows[r].first = (epicsUInt64(1000000000u + ns/1000000000u)<<32) | (ns%1000000000u);
+
+        std::vector<DBRValue>& cols = rows[r].second;
+        for(size_t c=0; c<10; c++) // slow readbacks, single precision
+            cols.push_back(makeValue<float>(float(sin(r/(100.0+c)))));
+        for(size_t c=0; c<10; c++) // noisy double precision
+            cols.push_back(makeValue<double>(c + rand()/double(RAND_MAX)));
+        for(size_t c=0; c<5; c++) // held setpoints
+            cols.push_back(makeValue<double>(double(c + r/600u)));
+        for(size_t c=0; c<5; c++) // counters
+            cols.push_back(makeValue<pvd::int32>(pvd::int32(r*(c+1))));
+        for(size_t c=0; c<5; c++) // mostly missing
+            cols.push_back(r%7u ? DBRValue() : makeValue<double>(double(r)));
+    }
+}
+
+double since(const epicsTimeStamp& start)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(&now, &start);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    try {
+        Receiver::slices_t rows;
+        if(argc>1)
+            readRows(argv[1], rows);
+        else
+            synthRows(120u*600u, rows);
+
+        size_t blocksize = argc>2 ? strtoul(argv[2], 0, 10) : 1200u;
+        if(blocksize==0u)
+            blocksize = 1200u;
+
+        if(rows.empty())
+            throw std::runtime_error("No rows");
+        const size_t ncols = rows[0].second.size();
+
+        std::vector<TSBlock> blocks;
+        epicsTimeStamp start;
+
+        epicsTimeGetCurrent(&start);
+        for(size_t r=0; r<rows.size(); r+=blocksize) {
+            Receiver::slices_t part(rows.begin()+r, rows.begin()+std::min(rows.size(), r+blocksize));
+            blocks.push_back(TSBlock(part));
+        }
+        double tenc = since(start);
+
+        size_t nbytes = 0u;
+        for(size_t b=0; b<blocks.size(); b++)
+            nbytes += blocks[b].bytes().size();
+
+        std::vector<epicsUInt64> keys;
+        std::vector<double> values;
+        std::vector<epicsUInt16> sevr;
+
+        epicsTimeGetCurrent(&start);
+        for(size_t b=0; b<blocks.size(); b++) {
+            blocks[b].keys(keys);
+            for(size_t c=0; c<blocks[b].columns(); c++) {
+                if(blocks[b].retained(c))
+                    blocks[b].column(c, values, sevr);
+            }
+        }
+        double tdec = since(start);
+
+        // as held in Collector: key, value, and alarm per cell
+        size_t raw = rows.size()*(8u + ncols*(8u+2u+2u));
+
+        std::cout<<"rows       "<<rows.size()<<"\n"
+                 <<"columns    "<<ncols<<"\n"
+                 <<"blocks     "<<blocks.size()<<" of "<<blocksize<<" rows\n"
+                 <<"raw        "<<raw/1048576.0<<" MB\n"
+                 <<"encoded    "<<nbytes/1048576.0<<" MB\n"
+                 <<"ratio      "<<double(raw)/nbytes<<"\n"
+                 <<"encode     "<<rows.size()/tenc/1e6<<" Mrows/s\n"
+                 <<"decode     "<<rows.size()/tdec/1e6<<" Mrows/s ("<<raw/tdec/1048576.0<<" MB/s)\n";
+        return 0;
+
+    } catch(std::exception& e) {
+        std::cerr<<"Error: "<<e.what()<<"\n";
+        return 1;
+    }
+}
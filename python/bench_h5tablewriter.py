@@ -0,0 +1,168 @@
+#!/usr/bin/env python
+"""Throughput of h5tablewriter
+
+Feeds synthetic updates, as decode() returns them, directly to TableWriter.update()
+without a *TBL subscription.  Sweeps column mix, compression, and rotation.
+
+  python bench_h5tablewriter.py --rows 240 --scalars 100,1000 --arrays 0,10 --compression gzip,lzf,none
+
+Each case reports
+
+  rows/s   table rows written per second of wall time
+  MB/s     raw column data (as received) per second
+  file MB  size of completed files, and how many
+  CPU%     process CPU time over wall time.  Includes migration threads.
+  p50/p99/max  latency of one update() call in ms.
+
+and the shortest update interval (sec.) where the slowest update stays below
+the 75% of interval at which the writer logs "Processing time approaches threshold".
+"""
+
+from __future__ import division, print_function, unicode_literals
+
+import os
+import time
+import resource
+import shutil
+import tempfile
+import logging
+import itertools
+
+import numpy
+
+from h5tablewriter import TableWriter
+
+def getargs():
+    from argparse import ArgumentParser
+    A = ArgumentParser(description=__doc__.split('\n')[0])
+    csv = lambda s:[X.strip() for X in s.split(',') if X.strip()]
+    ints = lambda s:[int(X) for X in csv(s)]
+    A.add_argument('--rows', metavar='N', type=ints, default=[240], help='rows per update (2 sec. at 120Hz).  comma separated list')
+    A.add_argument('--scalars', metavar='N', type=ints, default=[100, 1000], help='number of scalar columns.  comma separated list')
+    A.add_argument('--arrays', metavar='N', type=ints, default=[0, 10], help='number of array columns.  comma separated list')
+    A.add_argument('--array-length', metavar='N', type=int, default=1024, help='elements per array cell')
+    A.add_argument('--compression', metavar='SPEC', type=csv, default=['gzip', 'lzf', 'none'], help='as writer config.  comma separated list')
+    A.add_argument('--rotate', metavar='MB', type=ints, default=[0], help='rotate at this scratch file size.  0 never.  comma separated list')
+    A.add_argument('--durability', metavar='SPEC', default='updates:1', help='as writer config')
+    A.add_argument('-n', '--updates', metavar='N', type=int, default=20, help='timed updates per case')
+    A.add_argument('--dir', metavar='DIR', help='scratch and output directory.  Default: a new temporary directory')
+    A.add_argument('-v', '--verbose', action='store_const', const=logging.INFO, default=logging.ERROR)
+    return A.parse_args()
+
+class Source(object):
+    """Synthetic *TBL updates.  120Hz rows, noisy double and counter columns, and waveforms.
+    """
+    def __init__(self, nrows, nscalar, narray, alen):
+        self.nrows, self.nscalar, self.narray, self.alen = nrows, nscalar, narray, alen
+        self.rand = numpy.random.RandomState(42)
+        self.row = 0
+
+    def next(self):
+        N = self.nrows
+        ns = (numpy.arange(self.row, self.row+N, dtype='u8')*8333333) + 1000000000*1000000000
+        self.row += N
+
+        cols = [
+            ('secondsPastEpoch', 'secondsPastEpoch', (ns//1000000000).astype('u4')),
+            ('nanoseconds', 'nanoseconds', (ns%1000000000).astype('u4')),
+        ]
+        for c in range(self.nscalar):
+            if c%4==3: # counters
+                V = numpy.arange(self.row-N, self.row, dtype='i4')*(c+1)
+            else:
+                V = self.rand.normal(c, 1.0, N)
+            cols.append(('C%d'%c, 'BENCH:SCALAR%d'%c, V))
+        for c in range(self.narray):
+            cells = [None if r%7==6 else self.rand.normal(0, 1.0, self.alen).astype('f4') for r in range(N)]
+            cols.append(('A%d'%c, 'BENCH:ARRAY%d'%c, cells))
+        return cols
+
+class BenchWriter(TableWriter):
+    """Completed files are measured and discarded instead of migrated
+    """
+    def __init__(self, *args, **kws):
+        TableWriter.__init__(self, *args, **kws)
+        self.completed = []
+    def _movefile(self, stage2, dsets):
+        # called from migration thread only
+        src = self._repack(stage2, dsets)
+        self.completed.append(os.stat(src).st_size)
+        os.remove(src)
+
+def cputime():
+    R = resource.getrusage(resource.RUSAGE_SELF)
+    return R.ru_utime + R.ru_stime
+
+def nbytes(cols):
+    total = 0
+    for _fld, _lbl, V in cols:
+        if isinstance(V, numpy.ndarray):
+            total += V.nbytes
+        else:
+            total += sum(C.nbytes for C in V if C is not None)
+    return total
+
+def bench(base, args, nrows, nscalar, narray, compression, rotate):
+    dname = tempfile.mkdtemp(dir=base)
+    try:
+        conf = {
+            'tablePV':'BENCH:TBL',
+            'metaPV':'',
+            'outfile':os.path.join(dname, 'unused.h5'),
+            'scratch':os.path.join(dname, 'scratch.h5'),
+            # effectively never, unless rotating by size
+            'temp_limit':str(rotate/1024. if rotate else 2**20),
+            'temp_period':str(2**20),
+            'durability':args.durability,
+            'compression':compression,
+        }
+        src = Source(nrows, nscalar, narray, args.array_length)
+
+        W = BenchWriter(conf, subscribe=False)
+        W.update(src.next()) # initial update is not written
+
+        lat, raw = [], 0
+        cpu0, wall0 = cputime(), time.time()
+        for n in range(args.updates):
+            cols = src.next()
+            raw += nbytes(cols)
+            start = time.time()
+            W.update(cols)
+            lat.append(time.time()-start)
+        with W.lock:
+            W.close()
+        wall, cpu = time.time()-wall0, cputime()-cpu0
+
+        lat = numpy.asarray(lat)*1e3
+        return {
+            'rows/s':nrows*args.updates/wall,
+            'MB/s':raw/wall/2**20,
+            'file MB':sum(W.completed)/2**20,
+            'files':len(W.completed),
+            'CPU%':100.*cpu/wall,
+            'p50':numpy.percentile(lat, 50),
+            'p99':numpy.percentile(lat, 99),
+            'max':lat.max(),
+        }
+    finally:
+        shutil.rmtree(dname, ignore_errors=True)
+
+def main(args):
+    base = args.dir or tempfile.mkdtemp(prefix='bench_h5tw_')
+    try:
+        cols = ['rows', 'scalar', 'array', 'compression', 'rotate', 'rows/s', 'MB/s', 'file MB', 'files', 'CPU%', 'p50', 'p99', 'max', 'interval']
+        print(' '.join('%11s'%C for C in cols))
+        for nrows, nscalar, narray, compression, rotate in itertools.product(args.rows, args.scalars, args.arrays, args.compression, args.rotate):
+            R = bench(base, args, nrows, nscalar, narray, compression, rotate)
+            # the writer warns when an update takes >= 75% of the update interval
+            R['interval'] = R['max']/0.75/1e3
+            print(' '.join(['%11d'%nrows, '%11d'%nscalar, '%11d'%narray, '%11s'%compression, '%11d'%rotate]
+                           +['%11.4g'%R[C] for C in cols[5:]]))
+    finally:
+        if not args.dir:
+            shutil.rmtree(base, ignore_errors=True)
+
+if __name__=='__main__':
+    args = getargs()
+    logging.basicConfig(level=args.verbose)
+    main(args)
@@ -0,0 +1,212 @@
+#!/usr/bin/env python
+"""Client side decoding of a bsas *TBL NTTable.
+
+Columns are handed out as the numpy arrays received by p4p, without copying.
+The timestamp columns are combined into one uint64 key per row.
+
+    def cb(table):
+        if table is None:
+            return # disconnected
+        X = table['TST:X']  # numpy.ndarray
+        print(table.generation, table.keys, X)
+
+    with Context('pva') as ctxt:
+        S = BSASClient(ctxt, 'RX:TBL', cb)
+        ...
+        S.close()
+"""
+
+from __future__ import division, print_function, unicode_literals
+
+import logging
+
+import numpy
+
+from p4p.client.thread import Disconnected
+
+_log = logging.getLogger(__name__)
+
+_timecols = ('secondsPastEpoch', 'nanoseconds')
+_text = (type(b''), type(u''))
+
+def combine_keys(sec, nsec):
+    """(sec<<32)|nsec as numpy.uint64
+    """
+    K = numpy.asarray(sec).astype('u8')
+    K <<= 32
+    K |= numpy.asarray(nsec)
+    return K
+
+class Column(object):
+    """One column of a Table.
+
+    data is a numpy.ndarray (scalar column, or codes of an encoded string column),
+    a list of str (string column), or a list of numpy.ndarray/None (array column).
+    """
+    __slots__ = ('field', 'label', 'isarray', 'encoded', 'data', 'dictionary')
+
+    def __init__(self, field, label, encoded):
+        self.field, self.label, self.encoded = field, label, encoded
+        self.isarray = False
+        self.data = None
+        self.dictionary = None # list of str when encoded.  code 0 is ''
+
+    def strings(self):
+        """Decode an encoded string column.  Returns numpy array of objects.
+        """
+        if not self.encoded:
+            return numpy.asarray(self.data, dtype=object)
+        return numpy.asarray(self.dictionary or [''], dtype=object)[self.data]
+
+class Table(object):
+    """Decoded state of a *TBL PV as of the last update.
+
+    generation is incremented each time the column list changes.
+    decimation is the row stride sent to a slow client, 1 for the full stream.
+    A large batch of rows is split into several updates with the same batch_id,
+    and batch_more set on all but the last.
+    batch_epoch is non-zero when the server aligns batches of all tables (bsasFlushEpoch).
+    """
+    def __init__(self):
+        self.generation = 0
+        self.decimation = 1
+        self.batch_id, self.batch_part, self.batch_more = 0, 0, False
+        self.batch_epoch = 0
+        self.keys = numpy.zeros(0, dtype='u8')
+        self.columns = []
+        self._index = {}
+        self._type = None
+
+    def __len__(self):
+        return len(self.keys)
+
+    def column(self, label):
+        return self.columns[self._index[label]]
+
+    def __getitem__(self, label):
+        return self.column(label).data
+
+    def __contains__(self, label):
+        return label in self._index
+
+    def labels(self):
+        return [C.label for C in self.columns]
+
+    def clear(self):
+        self.keys = numpy.zeros(0, dtype='u8')
+        self.columns = []
+        self._index = {}
+        self._type = None
+        self.decimation = 1
+        self.batch_id, self.batch_part, self.batch_more = 0, 0, False
+        self.batch_epoch = 0
+
+    def update(self, val):
+        """Apply an update from a monitor (p4p.Value).
+        """
+        try:
+            dicts = val['dictionary']
+            encoded = set(dicts.keys())
+        except KeyError:
+            dicts, encoded = None, set()
+
+        fields = list(val.value.keys())
+        labels = list(val.labels)
+        T = (tuple(fields), tuple(labels), tuple(sorted(encoded)))
+
+        if T!=self._type:
+            self.columns = []
+            self._index = {}
+            for fld, lbl in zip(fields, labels):
+                if fld in _timecols:
+                    continue
+                self._index[lbl] = len(self.columns)
+                self.columns.append(Column(fld, lbl, fld in encoded))
+            self._type = T
+            self.generation += 1
+            retype = True
+        else:
+            retype = False
+
+        self.keys = combine_keys(val.value.secondsPastEpoch, val.value.nanoseconds)
+
+        for C in self.columns:
+            V = val.value[C.field]
+            # string columns are also lists, but of str
+            C.isarray = isinstance(V, list) and not (len(V)>0 and isinstance(V[0], _text))
+            C.data = V
+            # the server only sends a dictionary when it grows
+            if C.encoded and (retype or val.changed('dictionary.'+C.field)):
+                C.dictionary = list(dicts[C.field])
+
+        try:
+            self.decimation = int(val['decimation'])
+        except KeyError:
+            self.decimation = 1
+
+        try:
+            B = val['batch']
+            self.batch_id, self.batch_part, self.batch_more = int(B['id']), int(B['part']), bool(B['more'])
+        except KeyError:
+            self.batch_id, self.batch_part, self.batch_more = 0, 0, False
+        try:
+            self.batch_epoch = int(val['batch.epoch'])
+        except KeyError:
+            self.batch_epoch = 0
+
+class BSASClient(object):
+    """Subscribe to a *TBL PV.
+
+    cb(Table) is called for each update, or cb(None) on disconnect.
+    The same Table instance is passed to each call.
+    """
+    def __init__(self, ctxt, pvname, cb):
+        self.pvname, self._cb = pvname, cb
+        self.table = Table()
+        self._S = ctxt.monitor(pvname, self._update, notify_disconnect=True)
+
+    def close(self):
+        self._S.close()
+
+    def __enter__(self):
+        return self
+    def __exit__(self, A, B, C):
+        self.close()
+
+    def _update(self, val):
+        if isinstance(val, (Disconnected, Exception)):
+            _log.debug("%s : %s", self.pvname, val)
+            self.table.clear()
+            self._cb(None)
+        else:
+            self.table.update(val)
+            self._cb(self.table)
+
+def getargs():
+    from argparse import ArgumentParser
+    P = ArgumentParser(description="Print a summary of each update of a *TBL PV")
+    P.add_argument('pvname', help='table PV (eg. RX:TBL)')
+    P.add_argument('-v', '--verbose', action='store_const', const=logging.DEBUG, default=logging.INFO)
+    return P.parse_args()
+
+def main(args):
+    import time
+    from p4p.client.thread import Context
+
+    def show(table):
+        if table is None:
+            print(args.pvname, 'Disconnected')
+        else:
+            print(args.pvname, 'gen', table.generation, 'rows', len(table), 'decimation', table.decimation)
+
+    with Context('pva') as ctxt, BSASClient(ctxt, args.pvname, show):
+        try:
+            while True:
+                time.sleep(100)
+        except KeyboardInterrupt:
+            pass
+
+if __name__=='__main__':
+    args = getargs()
+    logging.basicConfig(level=args.verbose)
+    main(args)
@@ -0,0 +1,293 @@
+#!/usr/bin/env python
+
+from __future__ import division, print_function, unicode_literals
+
+import time
+import signal
+import os
+import logging
+import threading
+import multiprocessing
+
+try:
+    from Queue import Full, Empty
+except ImportError:
+    from queue import Full, Empty
+
+from p4p.client.thread import Context
+
+from h5tablewriter import ConfigParser, TableWriter, SigWake, decode, decode_meta, meta_pv, set_proc_name
+
+_log = logging.getLogger(__name__)
+
+def getargs():
+    from argparse import ArgumentParser
+    A = ArgumentParser(description="""BSAS archiver for many tables.
+
+Each section of the configuration file, other than [DEFAULT],
+describes one table as for h5tablewriter.py
+
+One process subscribes to all *TBL PVs.  Writing and compression
+is spread across a pool of worker processes.  Each table is
+assigned to exactly one worker, which owns its files.
+
+Switches to new files on SIGHUP or SIGUSR1.
+Graceful exit on SIGINT.
+""")
+    A.add_argument('conf', metavar='FILE', help='configuration file')
+    A.add_argument('-v', '--verbose', action='store_const', const=logging.DEBUG, default=logging.INFO)
+    A.add_argument('-q', '--quiet', action='store_const', const=logging.WARN, dest='verbose')
+    A.add_argument('-C', '--check', action='store_true', default=False, help="Exit after reading configuration file")
+    return A.parse_args()
+
+def readconf(fname):
+    conf = ConfigParser({
+        'PWD':os.path.dirname(fname),
+        'scratch':'/tmp/%(tablePV)s.h5',
+    })
+    with open(fname, 'r') as F:
+        conf.readfp(F)
+    return conf
+
+def _worker(wid, fname, sections, inq, outq, level):
+    # in worker process.
+    # Owns the TableWriter (and so the files) for each of 'sections'
+    signal.signal(signal.SIGINT, signal.SIG_IGN) # parent will tell us when to stop
+    signal.signal(signal.SIGHUP, signal.SIG_IGN)
+    signal.signal(signal.SIGUSR1, signal.SIG_IGN)
+    logging.basicConfig(level=level, format='%(processName)s %(levelname)s %(message)s')
+
+    conf = readconf(fname)
+    writers = {}
+    try:
+        for sect in sections:
+            writers[sect] = TableWriter(conf[sect], subscribe=False)
+
+        period = min([W.temp_period for W in writers.values()])/4.
+
+        while True:
+            try:
+                msg = inq.get(timeout=period)
+            except Empty:
+                msg = ('rotate', False)
+
+            if msg[0]=='update':
+                _cmd, sect, seq, trecv, cols = msg
+                start = time.time()
+                try:
+                    writers[sect].update(cols)
+                except:
+                    _log.exception("Error writing %s", sect)
+                end = time.time()
+                outq.put(('done', sect, seq, trecv, start, end))
+
+            elif msg[0]=='meta':
+                _cmd, sect, meta = msg
+                writers[sect].update_meta(meta)
+
+            elif msg[0]=='rotate':
+                for W in writers.values():
+                    with W.lock:
+                        W.flush(force=msg[1])
+
+            elif msg[0]=='stop':
+                break
+
+    finally:
+        for sect, W in writers.items():
+            try:
+                with W.lock:
+                    W.close()
+            except:
+                _log.exception("Error closing %s", sect)
+
+class TableStats(object):
+    """Per-table backpressure/lag counters.  Accessed only with Service.lock held
+    """
+    def __init__(self, sect, pv, wid):
+        self.sect, self.pv, self.wid = sect, pv, wid
+        self.nIn = 0      # updates queued to worker
+        self.nOut = 0     # updates written by worker
+        self.nDrop = 0    # updates dropped as worker queue was full
+        self.nRows = 0    # rows queued
+        self.lag = 0.0    # receive -> written latency of most recent update
+        self.maxLag = 0.0 # largest lag since last report
+        self.busy = 0.0   # worker time spent writing since last report
+        self.dataAge = 0.0 # receive time minus newest row timestamp of most recent update
+
+    @property
+    def pending(self):
+        return self.nIn - self.nOut
+
+class Service(object):
+    def __init__(self, fname, conf, check=False):
+        self.lock = threading.Lock()
+
+        sections = conf.sections()
+        if len(sections)==0:
+            raise RuntimeError("No tables configured in %s"%fname)
+
+        D = conf['DEFAULT']
+        nworkers = int(D.get('workers', '0')) or multiprocessing.cpu_count()
+        nworkers = min(nworkers, len(sections))
+        # max. number of updates for one table waiting for a worker
+        self.depth = int(D.get('queue_depth', '4'))
+        self.report_period = float(D.get('report_period', '60'))
+
+        # validate each section as a worker will
+        for sect in sections:
+            try:
+                TableWriter(conf[sect], check=True, subscribe=False)
+            except KeyboardInterrupt:
+                pass
+
+        if check:
+            raise KeyboardInterrupt()
+
+        self.outq = multiprocessing.Queue()
+        self.inqs, self.workers = [], []
+
+        # assign tables to workers round-robin
+        assign = {}
+        for i, sect in enumerate(sections):
+            assign.setdefault(i%nworkers, []).append(sect)
+
+        self.stats = {}
+        for wid in range(nworkers):
+            Q = multiprocessing.Queue(maxsize=self.depth*len(assign[wid]))
+            P = multiprocessing.Process(name='h5worker%d'%wid, target=_worker,
+                                        args=(wid, fname, assign[wid], Q, self.outq, _log.getEffectiveLevel()))
+            P.daemon = True
+            P.start()
+            self.inqs.append(Q)
+            self.workers.append(P)
+
+            for sect in assign[wid]:
+                self.stats[sect] = TableStats(sect, conf[sect]['tablePV'], wid)
+
+        self.collector = threading.Thread(name='h5 done', target=self._collect)
+        self.collector.daemon = True
+        self.collector.start()
+
+        # workers must be forked before creating a PVA Context
+        self.ctxt = Context('pva', unwrap=False)
+        self.subs = []
+        for sect in sections:
+            S = self.ctxt.monitor(self.stats[sect].pv, self._cb(sect),
+                                  request='field()record[pipeline=True]', notify_disconnect=True)
+            self.subs.append(S)
+
+            metapv = meta_pv(conf[sect])
+            if metapv:
+                S = self.ctxt.monitor(metapv, self._meta_cb(sect), notify_disconnect=True)
+                self.subs.append(S)
+
+    def _meta_cb(self, sect):
+        Q = self.inqs[self.stats[sect].wid]
+        def update(val):
+            meta = decode_meta(val)
+            if meta is not None:
+                Q.put(('meta', sect, meta)) # infrequent, so never dropped
+        return update
+
+    def _cb(self, sect):
+        stats = self.stats[sect]
+        Q = self.inqs[stats.wid]
+        seq = [0]
+        def update(val):
+            # on PVA worker
+            trecv = time.time()
+            cols = decode(val)
+
+            with self.lock:
+                if cols is not None and stats.pending >= self.depth:
+                    stats.nDrop += 1
+                    _log.warn("%s worker behind.  Drop update", sect)
+                    return
+                stats.nIn += 1
+                seq[0] += 1
+                if cols is not None:
+                    stats.nRows += len(cols[-1][2]) # nanoseconds column
+                    try:
+                        sec, nsec = cols[-2][2][-1], cols[-1][2][-1]
+                        stats.dataAge = trecv - (sec + nsec*1e-9)
+                    except IndexError:
+                        pass # empty update
+
+            try:
+                # disconnect must not be lost, so only these block
+                Q.put(('update', sect, seq[0], trecv, cols), block=cols is None)
+            except Full:
+                with self.lock:
+                    stats.nIn -= 1
+                    stats.nDrop += 1
+                _log.warn("%s worker queue full.  Drop update", sect)
+        return update
+
+    def _collect(self):
+        # completion notifications from workers
+        while True:
+            msg = self.outq.get()
+            if msg is None:
+                break
+            _cmd, sect, seq, trecv, start, end = msg
+            with self.lock:
+                S = self.stats[sect]
+                S.nOut += 1
+                S.lag = end - trecv
+                S.maxLag = max(S.maxLag, S.lag)
+                S.busy += end - start
+
+    def rotate(self, force=True):
+        for Q in self.inqs:
+            Q.put(('rotate', force))
+
+    def report(self, interval):
+        with self.lock:
+            for sect in sorted(self.stats):
+                S = self.stats[sect]
+                _log.info("%s worker=%d pending=%d drop=%d rows=%d lag=%.2f maxlag=%.2f age=%.2f busy=%.0f%%",
+                          sect, S.wid, S.pending, S.nDrop, S.nRows, S.lag, S.maxLag, S.dataAge,
+                          100.0*S.busy/interval if interval>0 else 0.)
+                S.maxLag, S.busy = 0.0, 0.0
+
+    def close(self):
+        for S in self.subs:
+            S.close()
+        self.ctxt.close()
+        for Q in self.inqs:
+            Q.put(('stop',))
+        for P in self.workers:
+            P.join()
+        self.outq.put(None)
+        self.collector.join()
+
+    def __enter__(self):
+        return self
+    def __exit__(self, A,B,C):
+        self.close()
+
+def main(args):
+    conf = readconf(args.conf)
+    try:
+        with SigWake() as S:
+            with Service(args.conf, conf, check=args.check) as W:
+                _log.info("Running")
+                last = time.time()
+                while True:
+                    S.wait(W.report_period)
+                    now = time.time()
+                    if now-last >= W.report_period:
+                        W.report(now-last)
+                        last = now
+                    else:
+                        W.rotate() # woken by signal
+    except KeyboardInterrupt:
+        pass
+    _log.info("Done")
+
+if __name__=='__main__':
+    set_proc_name('h5tableservice')
+    args = getargs()
+    logging.basicConfig(level=args.verbose)
+    main(args)
@@ -12,6 +12,10 @@ import errno
 import select
 import logging
 import threading
+import json
+import subprocess
+import fcntl
+from collections import namedtuple
 
 try:
     from ConfigParser import SafeConfigParser as _ConfigParser, NoOptionError
@@ -39,6 +43,11 @@ try:
 except ImportError:
     from configparser import SafeConfigParser as ConfigParser
 
+try:
+    from Queue import Queue
+except ImportError:
+    from queue import Queue
+
 import numpy
 import h5py
 
@@ -47,6 +56,11 @@ from p4p.client.thread import Context, Disconnected
 _log = logging.getLogger(__name__)
 
 ref_dtype = h5py.special_dtype(ref=h5py.Reference)
+str_dtype = h5py.special_dtype(vlen=type(u''))
+_text = (type(b''), type(u''))
+
+# dictionary encoded string column.  dictionary is None when unchanged since previous update
+Encoded = namedtuple('Encoded', ['codes', 'dictionary'])
 
 def getargs():
     from argparse import ArgumentParser
@@ -102,16 +116,144 @@ _mat_class = {
     # TODO: bool and some string types
 }
 
+# from linux/fs.h
+_FICLONE = 0x40049409
+
+def relocate(src, dst):
+    """Move src -> dst without copying file contents when possible.
+
+    Tries, in order, rename(), reflink (eg. between btrfs subvolumes or XFS),
+    and finally a full copy.  dst only appears once complete.
+    """
+    try:
+        os.rename(src, dst)
+        return 'rename'
+    except OSError as e:
+        if e.errno!=errno.EXDEV:
+            raise
+
+    part = dst+'.part'
+    how = 'copy'
+    with open(src, 'rb') as S, open(part, 'wb') as D:
+        try:
+            fcntl.ioctl(D.fileno(), _FICLONE, S.fileno())
+            how = 'reflink'
+        except (IOError, OSError):
+            shutil.copyfileobj(S, D, 2**22)
+        os.fsync(D.fileno())
+    os.rename(part, dst)
+    os.remove(src)
+    return how
+
+def parse_durability(spec):
+    """Returns (nupdates, period) where 0 disables either trigger
+    """
+    kind, _sep, arg = spec.strip().partition(':')
+    if kind=='updates':
+        N = int(arg or '1')
+        if N<1:
+            raise ValueError("durability updates:N must be >= 1")
+        return N, 0.0
+    elif kind=='seconds':
+        T = float(arg)
+        if T<=0:
+            raise ValueError("durability seconds:T must be > 0")
+        return 0, T
+    elif kind=='rotate' and not arg:
+        return 0, 0.0
+    else:
+        raise ValueError("Invalid durability '%s'.  Expect updates:N, seconds:T, or rotate"%spec)
+
+def parse_compression(spec):
+    """Returns create_dataset() keyword arguments for 'gzip', 'gzip=LEVEL', 'lzf', or 'none'
+    """
+    kind, _sep, arg = spec.strip().lower().partition('=')
+    if kind=='none' and not arg:
+        return {}
+    elif kind=='lzf' and not arg: # fast, but only readable through h5py
+        return {'shuffle':True, 'compression':'lzf'}
+    elif kind=='gzip':
+        opts = {'shuffle':True, 'compression':'gzip'}
+        if arg:
+            level = int(arg)
+            if level<0 or level>9:
+                raise ValueError("compression gzip=LEVEL must be in [0, 9]")
+            opts['compression_opts'] = level
+        return opts
+    else:
+        raise ValueError("Invalid compression '%s'.  Expect gzip, gzip=LEVEL, lzf, or none"%spec)
+
+def decode(val):
+    """Unpack a *TBL NTTable update into plain python types.
+
+    Returns None for a disconnect, or a list of (field, label, data) tuples
+    where data is a numpy.ndarray (scalar column), a list of str (string column),
+    an Encoded (dictionary encoded string column),
+    or a list of numpy.ndarray/None (array column).
+    The result may be pickled, eg. to hand off to a worker process.
+    """
+    if isinstance(val, Disconnected):
+        return None
+
+    # should always contain at least the two timestamp columns
+    assert len(val.labels)>0, "Empty labels"
+
+    try:
+        dicts = val['dictionary']
+        encoded = set(dicts.keys())
+    except KeyError:
+        encoded = set()
+
+    cols = []
+    for fld, lbl in zip(val.value.keys(), val.labels):
+        V = val.value[fld]
+        if fld in encoded:
+            # the server only sends a dictionary when it grows
+            V = Encoded(V, list(dicts[fld]) if val.changed('dictionary.'+fld) else None)
+        cols.append((fld, lbl, V))
+    return cols
+
+def decode_meta(val):
+    """Unpack a *META NTTable update.
+
+    Returns a dict mapping PV name to a dict of HDF5 attributes.
+    """
+    if isinstance(val, Disconnected):
+        return None
+
+    V = val.value
+    meta = {}
+    for i, pv in enumerate(V['PV']):
+        attrs = {
+            'units':numpy.string_(V['units'][i].encode('utf-8')),
+            'precision':numpy.asarray(V['precision'][i], dtype='i2'),
+            'displayLow':numpy.asarray(V['displayLow'][i], dtype='f8'),
+            'displayHigh':numpy.asarray(V['displayHigh'][i], dtype='f8'),
+        }
+        choices = V['choices'][i]
+        if choices is not None and len(choices):
+            attrs['choices'] = numpy.asarray([C.encode('utf-8') for C in choices], dtype='S')
+        meta[pv] = attrs
+    return meta
+
+def meta_pv(conf):
+    """Name of *META PV.  By default, derived from *TBL PV name
+    """
+    pv = conf['tablePV']
+    return conf.get('metaPV', pv[:-3]+'META' if pv.endswith('TBL') else '')
+
 class TableWriter(object):
-    context = Context('pva', unwrap=False)
+    context = None # shared by all instances, created on first subscription
 
-    def __init__(self, conf, wakeup=None, check=False):
+    def __init__(self, conf, wakeup=None, check=False, subscribe=True):
         self._wakeup = wakeup
 
         # pull out mandatory config items now
 
         self.pv = conf['tablePV']
 
+        self.metapv = meta_pv(conf)
+
         self.ftemplate = conf['outfile'] # passed through time.strftime()
 
         self.ftemp = conf.get('scratch', '/tmp/bsas_%s.h5'%self.pv)
@@ -126,6 +268,27 @@ class TableWriter(object):
 
         self.group = conf.get('file_group', '/')
 
+        # background re-compaction of completed files with h5repack.
+        #  eg. 'GZIP=9'
+        self.recompress = conf.get('recompress', '')
+        # eg. 4096 rows per chunk
+        self.repack_chunk = int(conf.get('repack_chunk', '0'))
+
+        nmigrate = int(conf.get('migrate_workers', '1'))
+
+        # How often to make written data durable.
+        #   updates:N - after every N updates
+        #   seconds:T - after the first update T seconds from the previous sync
+        #   rotate    - only when closing a file
+        # The default writes less than flushing every update.
+        self.sync_updates, self.sync_period = parse_durability(conf.get('durability', 'seconds:10'))
+
+        # filter for column datasets, and array cells
+        self.compress = parse_compression(conf.get('compression', 'gzip'))
+        self.cell_compress = dict(self.compress)
+        if self.compress.get('compression')=='gzip':
+            self.cell_compress.setdefault('compression_opts', 9)
+
         if check:
             raise KeyboardInterrupt()
 
@@ -135,25 +298,59 @@ class TableWriter(object):
 
         self.nextref = 0
 
+        # latest from *META.  PV name -> {attribute:value}
+        self.meta = {}
+        # field -> dictionary for encoded string columns
+        self.dicts = {}
+
+        # updates written since last sync, and time of last sync
+        self.unsynced = 0
+        self.sync_time = 0
+
+        # records the row count of each dataset as of the last sync
+        self.journal = self.ftemp+'.journal'
+
         self.initial = True
         self.prevstart = None
 
         self.F, self.G = None, None # h5py.File and h5py.Group
 
-        self._migrate = None
+        # queue of (stage2, datasets) for migration workers.  None to stop
+        self._migrateQ = Queue()
+        self._nstage = 0
+        self._migrate = []
+        for n in range(max(1, nmigrate)):
+            T = threading.Thread(name='BSAS Migration %d'%n, target=self._migrator)
+            T.daemon = True
+            T.start()
+            self._migrate.append(T)
+
+        self.S, self.M = None, None
+        if subscribe:
+            # otherwise updates are fed through update()
+            if TableWriter.context is None:
+                TableWriter.context = Context('pva', unwrap=False)
 
-        _log.info("Create subscription")
-        self.S = self.context.monitor(self.pv, self._update, request='field()record[pipeline=True]', notify_disconnect=True)
+            _log.info("Create subscription")
+            self.S = self.context.monitor(self.pv, self._update, request='field()record[pipeline=True]', notify_disconnect=True)
+
+            if self.metapv:
+                self.M = self.context.monitor(self.metapv, self._update_meta, notify_disconnect=True)
 
     def close(self): # self.lock is locked
-        _log.info("Close subscription")
-        self.S.close()
+        if self.S is not None:
+            _log.info("Close subscription")
+            self.S.close()
+        if self.M is not None:
+            self.M.close()
         _log.info("Final flush")
         self.flush(force=True)
-        if self._migrate is not None:
-            _log.info("Wait for final migration")
-            self._migrate.join()
-            _log.info("final migration complete")
+        _log.info("Wait for final migration")
+        for T in self._migrate:
+            self._migrateQ.put(None)
+        for T in self._migrate:
+            T.join()
+        _log.info("final migration complete")
 
     def _update(self, val):
         # called from PVA worker only
@@ -161,8 +358,7 @@ class TableWriter(object):
         self.prevstart = start
 
         _log.debug('Update')
-        with self.lock:
-            self.__update(val)
+        self.update(decode(val))
 
         if prevstart is None:
             return
@@ -176,30 +372,67 @@ class TableWriter(object):
         else:
             _log.info("Processing time %.2f, threshold %.2f", dT, interval)
 
-    def __update(self, val): # self.lock is locked
+    def _update_meta(self, val):
+        # called from PVA worker only
+        meta = decode_meta(val)
+        if meta is not None:
+            self.update_meta(meta)
+
+    def update_meta(self, meta):
+        """Apply meta-data, as returned by decode_meta(), to the current and future files.
+        """
+        with self.lock:
+            _log.info("Update meta-data for %d PVs", len(meta))
+            self.meta = meta
+            if self.G is not None:
+                for D in self.G.values():
+                    if isinstance(D, h5py.Dataset) and 'label' in D.attrs:
+                        self._apply_meta(D)
+
+    def _apply_meta(self, D): # self.lock is locked
+        lbl = D.attrs['label']
+        if isinstance(lbl, bytes):
+            lbl = lbl.decode('utf-8')
+        for name, value in self.meta.get(lbl, {}).items():
+            D.attrs[name] = value
+
+    def update(self, cols):
+        """Write one decoded update.  cols as returned by decode()
+        """
+        with self.lock:
+            self.__update(cols)
+
+    def __update(self, cols): # self.lock is locked
 
-        if isinstance(val, Disconnected):
+        if cols is None:
             _log.warn("Table PV disconnect")
             self.initial = True
+            self.dicts = {} # server starts over on reconnect
             self.flush()
             return
 
         elif self.initial:
             _log.warn("Table PV (re)connect")
             self.initial = False
+            for fld, lbl, V in cols:
+                if isinstance(V, Encoded) and V.dictionary is not None:
+                    self.dicts[fld] = V.dictionary
             return # ignore initial update
 
         elif self.F is None:
             self.open() # lazy (re)open on first update
 
-        # should always contain at least the two timestamp columns
-        assert len(val.labels)>0, "Empty labels"
-
         seenone = False
-        for fld, lbl in zip(val.value.keys(), val.labels):
-            V = val.value[fld]
+        for fld, lbl, V in cols:
             seenone = True
 
+            newdict = False
+            if isinstance(V, Encoded):
+                if V.dictionary is not None:
+                    self.dicts[fld] = V.dictionary
+                    newdict = True
+                V = V.codes
+
             if isinstance(V, numpy.ndarray):
                 new, = V.shape
                 try:
@@ -207,14 +440,37 @@ class TableWriter(object):
                 except KeyError:
                     D = self.G.create_dataset(fld, dtype=V.dtype,
                                             shape=(0, 1), chunks=None, maxshape=(None, 1),
-                                            shuffle=True, compression='gzip')
+                                            **self.compress)
                     D.attrs['label'] = lbl
                     D.attrs['MATLAB_class'] = _mat_class[V.dtype]
+                    self._apply_meta(D)
+                    newdict = fld in self.dicts
+
+                if newdict:
+                    # codes are indices into this list
+                    D.attrs['dictionary'] = numpy.asarray(self.dicts[fld], dtype=str_dtype)
 
                 cur, _one = D.shape
                 D.resize((cur+new, 1))
                 D[cur:, 0] = V # copy
 
+            elif isinstance(V, list) and len(V)==0:
+                pass # empty update, type unknown
+
+            elif isinstance(V, list) and isinstance(V[0], _text): # string[]
+                # stored as variable length strings.  Not readable by MATLAB
+                try:
+                    D = self.G[fld]
+                except KeyError:
+                    D = self.G.create_dataset(fld, dtype=str_dtype,
+                                              shape=(0, 1), chunks=None, maxshape=(None, 1))
+                    D.attrs['label'] = lbl
+                    self._apply_meta(D)
+
+                cur, _one = D.shape
+                D.resize((cur+len(V), 1))
+                D[cur:, 0] = numpy.asarray(V, dtype=object)
+
             elif isinstance(V, list): # union[]
                 # store as cell array
                 try:
@@ -224,6 +480,7 @@ class TableWriter(object):
                                               shape=(0, 1), chunks=None, maxshape=(None, 1))
                     D.attrs['label'] = lbl
                     D.attrs['MATLAB_class'] = numpy.string_("cell")
+                    self._apply_meta(D)
 
                 refs = []
                 _refs_ = self.G.require_group('#refs#')
@@ -243,25 +500,90 @@ class TableWriter(object):
 
                     else:
                         dset = _refs_.create_dataset('cellval%d'%self.nextref, data=img,
-                                                    shuffle=True, compression='gzip', compression_opts=9)
+                                                    **self.cell_compress)
                         dset.attrs['MATLAB_class'] = _mat_class[img.dtype]
                         dset.attrs['H5PATH'] = _path
                         refs.append(dset.ref)
                         self.nextref += 1
 
                 cur, _one = D.shape
-                D.resize((cur+new, 1))
+                D.resize((cur+len(refs), 1))
                 D[cur:, 0] = refs
 
-        assert seenone, (val.value.keys(), val.labels)
+        assert seenone, "Empty update"
 
-        self.F.flush() # flush this update to disk
+        self.unsynced += 1
+        if self.sync_updates and self.unsynced >= self.sync_updates:
+            self._sync()
 
         self.flush()
 
+    def _sync(self): # self.lock is locked
+        """Make everything written so far durable, then journal the row counts.
+        After a crash, the scratch file is truncated back to the journaled state.
+        """
+        self.F.flush()
+        os.fsync(self.F.id.get_vfd_handle())
+
+        rows = {}
+        for D in self.G.values():
+            if isinstance(D, h5py.Dataset):
+                rows[D.name] = D.shape[0]
+
+        tmp = self.journal+'.tmp'
+        with open(tmp, 'w') as J:
+            json.dump({'file':self.ftemp, 'rows':rows, 'nextref':self.nextref, 'group':self.G.name}, J)
+            J.flush()
+            os.fsync(J.fileno())
+        os.rename(tmp, self.journal)
+
+        _log.debug('Sync after %d updates', self.unsynced)
+        self.unsynced = 0
+        self.sync_time = time.time()
+
+    def _recover(self): # self.lock is locked
+        """Best effort.  Discard anything in a left over scratch file written after the last journaled sync.
+
+        The scratch file is not written in SWMR mode, so HDF5 does not promise that
+        a file which was not closed can be opened at all.  If it can not be,
+        or the journal is missing, the file is migrated as is.
+        Returns True if the file was truncated to the journaled state.
+        """
+        try:
+            with open(self.journal, 'r') as J:
+                jour = json.load(J)
+        except (IOError, OSError, ValueError):
+            _log.warn("No valid journal for '%s'.  Migrating as is.", self.ftemp)
+            return False
+
+        _log.warn("Recover '%s' to journaled state", self.ftemp)
+        try:
+            with h5py.File(self.ftemp, 'r+') as F:
+                G = F[jour['group']]
+                for D in list(G.values()):
+                    if not isinstance(D, h5py.Dataset):
+                        continue
+                    N = jour['rows'].get(D.name)
+                    if N is None:
+                        del G[D.name] # created after last sync
+                    elif D.shape[0] > N:
+                        _log.warn("Discard %d rows of %s", D.shape[0]-N, D.name)
+                        D.resize((N, 1))
+
+                refs = G.get('#refs#')
+                if refs is not None:
+                    for name in list(refs.keys()):
+                        if name.startswith('cellval') and int(name[7:]) >= jour['nextref']:
+                            del refs[name]
+            return True
+        except:
+            _log.exception("Unable to recover '%s'.  Migrating as is.", self.ftemp)
+            return False
+
     def flush(self, force=False): # self.lock is locked
         if self.F is not None:
-            self.F.flush()
+            if self.unsynced and self.sync_period and time.time()-self.sync_time >= self.sync_period:
+                self._sync()
 
             age = time.time()-self.F_time
             size = os.stat(self.ftemp).st_size
@@ -271,34 +593,72 @@ class TableWriter(object):
                 return
 
             _log.info('Close and rotate')
+            dsets = [D.name for D in self.G.values() if isinstance(D, h5py.Dataset)]
             self.F.close()
+            os.remove(self.journal) # closed cleanly
+        else:
+            dsets = []
 
         self.F, self.G = None, None
 
-        if os.path.isfile(self.ftemp):
-            if self._migrate is not None:
-                # We only pipeline a single migration.
-                # If this hasn't completed, then we stall until it has.
-                self._migrate.join(0.01)
-                if self._migrate.isAlive():
-                    _log.warn("Flush stalls waiting for previous migration to complete.  Prepare for data loss!")
-                    self._migrate.join()
-
-                self._migrate = None
-                _log.info("Previous migration complete")
+        if os.path.isfile(self.journal):
+            # file not closed cleanly.  eg. left over from a crash
+            if os.path.isfile(self.ftemp):
+                self._recover()
+            os.remove(self.journal)
 
+        if os.path.isfile(self.ftemp):
+            # Migrations are queued, and never waited for here.
             _log.info("Starting migration of '%s'", self.ftemp)
 
-            stage2 = self.ftemp+'.tmp'
+            self._nstage += 1
+            stage2 = '%s.%d.tmp'%(self.ftemp, self._nstage)
             if os.path.isfile(stage2):
                 _log.error("Overwriting debris '%s' !", stage2)
 
             os.rename(self.ftemp, stage2)
 
-            self._migrate = threading.Thread(name='BSAS Migration', target=self._movefile, args=(stage2,))
-            self._migrate.start()
-
-    def _movefile(self, stage2):
+            self._migrateQ.put((stage2, dsets))
+            _log.info("%d migrations pending", self._migrateQ.qsize())
+
+    def _migrator(self):
+        # migration worker thread
+        while True:
+            job = self._migrateQ.get()
+            if job is None:
+                break
+            self._movefile(*job)
+
+    def _repack(self, stage2, dsets):
+        # called from migration thread only.
+        # h5repack runs as a separate process, so does not contend with ingest for the GIL or the HDF5 lock.
+        if not self.recompress and not self.repack_chunk:
+            return stage2
+
+        stage3 = stage2+'.pack'
+        cmd = ['h5repack', '-b', '512']
+        if self.recompress:
+            cmd += ['-f', self.recompress]
+        if self.repack_chunk:
+            # only the (N,1) column datasets.  not cells under #refs#
+            for name in dsets:
+                cmd += ['-l', '%s:CHUNK=%dx1'%(name, self.repack_chunk)]
+        cmd += [stage2, stage3]
+
+        _log.debug('Run %s', cmd)
+        try:
+            subprocess.check_call(cmd)
+            matheader(stage3) # h5repack may not preserve userblock content
+        except (OSError, subprocess.CalledProcessError):
+            _log.exception("Repack of '%s' fails.  Migrating as is.", stage2)
+            if os.path.isfile(stage3):
+                os.remove(stage3)
+            return stage2
+
+        os.remove(stage2)
+        return stage3
+
+    def _movefile(self, stage2, dsets):
         # called from migration thread only
         finalpath = None
         try:
@@ -309,19 +669,21 @@ class TableWriter(object):
             finalpath = time.strftime(self.ftemplate, time.gmtime(mtime)) # expand using UTC
 
             if os.path.isfile(finalpath):
-                _log.error("Migration destination '%s' already exists.  Prepare for data loss!")
+                _log.error("Migration destination '%s' already exists.  Prepare for data loss!", finalpath)
                 os.remove(finalpath)
 
-            _log.info('Migrate %s -> %s', stage2, finalpath)
+            src = self._repack(stage2, dsets)
+
+            _log.info('Migrate %s -> %s', src, finalpath)
             try:
                 os.makedirs(os.path.dirname(finalpath))
             except OSError:
                 pass #if we failed, then the move will also fail
-            shutil.move(stage2, finalpath)
+            how = relocate(src, finalpath)
 
             end = time.time()
 
-            _log.info("Migration of '%s' complete after %.2f sec", finalpath, end-start)
+            _log.info("Migration of '%s' complete after %.2f sec (%s)", finalpath, end-start, how)
         except:
             _log.exception("Failure during Migration of '%s' -> '%s'", stage2, finalpath)
 
@@ -340,6 +702,8 @@ class TableWriter(object):
         self.G = self.F.require_group(self.group)
         self.nextref = 0
 
+        self._sync() # initial (empty) journal
+
     def __enter__(self):
         return self
     def __exit__(self, A,B,C):
@@ -0,0 +1,95 @@
+"""Crash recovery of h5tablewriter scratch files
+
+  python -m unittest test_h5tablewriter
+"""
+
+from __future__ import division, print_function, unicode_literals
+
+import os
+import shutil
+import tempfile
+import unittest
+
+import h5py
+
+from h5tablewriter import TableWriter
+from bench_h5tablewriter import Source
+
+class TestRecover(unittest.TestCase):
+    nrows = 10
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp(prefix='test_h5tw_')
+
+    def tearDown(self):
+        shutil.rmtree(self.dir, ignore_errors=True)
+
+    def writer(self, name):
+        return TableWriter({
+            'tablePV':'TEST:TBL',
+            'metaPV':'',
+            'outfile':os.path.join(self.dir, name+'.h5'),
+            'scratch':os.path.join(self.dir, name+'.scratch.h5'),
+            'temp_limit':'1',
+            'temp_period':'1000',
+            'durability':'rotate',
+        }, subscribe=False)
+
+    def crash(self):
+        """Returns (scratch, journal) as left by a writer which stopped
+        after one journaled update and one which was not journaled
+        """
+        W = self.writer('orig')
+        src = Source(self.nrows, 3, 1, 16)
+        W.update(src.next()) # initial, not written
+        W.update(src.next())
+        with W.lock:
+            W._sync()
+        W.update(src.next())
+        with W.lock:
+            W.F.flush() # as if the process died now
+
+        scratch = os.path.join(self.dir, 'crash.scratch.h5')
+        shutil.copyfile(W.ftemp, scratch)
+        shutil.copyfile(W.journal, scratch+'.journal')
+
+        with W.lock:
+            W.close()
+        return scratch, scratch+'.journal'
+
+    def rows(self, fname):
+        with h5py.File(fname, 'r') as F:
+            return set(D.shape[0] for D in F.values() if isinstance(D, h5py.Dataset))
+
+    def test_truncate(self):
+        scratch, journal = self.crash()
+
+        W = self.writer('crash')
+        with W.lock:
+            W.close() # finds left over scratch file
+
+        self.assertFalse(os.path.isfile(journal))
+        self.assertEqual(self.rows(W.ftemplate), set([self.nrows]))
+
+        with h5py.File(W.ftemplate, 'r') as F:
+            cells = [K for K in F['#refs#'] if K.startswith('cellval')]
+        self.assertEqual(len(cells), self.nrows-self.nrows//7) # one update of cells
+
+    def test_unreadable(self):
+        scratch, journal = self.crash()
+        with open(scratch, 'r+b') as F:
+            F.seek(512) # past userblock
+            F.write(b'\0'*512) # HDF5 superblock
+        size = os.stat(scratch).st_size
+
+        W = self.writer('crash')
+        with W.lock:
+            W.close()
+
+        # not recovered, but migrated as is rather than lost
+        self.assertFalse(os.path.isfile(journal))
+        self.assertFalse(os.path.isfile(scratch))
+        self.assertEqual(os.stat(W.ftemplate).st_size, size)
+
+if __name__=='__main__':
+    unittest.main()